@@ -1,13 +1,21 @@
 #pragma once
 
 #include <SDL3/SDL_events.h>
+#include <span>
+#include <mutex>
+#include <future>
+#include <thread>
 #include <filesystem>
+#include <condition_variable>
 
 #include "fm_utils.hpp"
+#include "fm_job_system.hpp"
 #include "fm_scene.hpp"
+#include "fm_frame_packet.hpp"
 #include "vk_mesh.hpp"
 #include "vk_types.hpp"
 #include "vk_renderer.hpp"
+#include "vk_shader_compiler.hpp"
 
 //class SDL_Event;
 
@@ -18,17 +26,35 @@ public:
     ~Firemountain() {};
 
     int Init(int width, int height, SDL_Window* window);
-    void Frame(const fmCamera* camera, std::vector<RenderSceneObj> scene);
+    void Frame(const fmCamera* camera);
+    void ClearScene();
     void Resize(uint32_t width, uint32_t height);
+    void SetDepthPrepass(bool enabled);
     void Destroy();
 
+    // Draw on a thread of its own. Frame() then only hands the frame over, so the next one can be
+    // simulated while this one is drawn. Assets have to be loaded before it is started
+    void StartRenderThread();
+    void StopRenderThread();
+
     void ProcessImGuiEvent(SDL_Event* e);
 
+    // Compile the shader sources in process and again whenever they change
+    void WatchShaders(const std::filesystem::path& source_dir);
     void CompileShaders();
 
+    // Only before StartRenderThread(), both change renderer state directly
     MeshID AddMesh(const std::string& name, const char* path);
     LightID AddLight(const std::string& name);
 
+    // The renderer keeps the scene between frames, only the changes are passed in
+    InstanceID CreateInstance(MeshID mesh, const glm::mat4& transform);
+    void DestroyInstance(InstanceID instance);
+    // An instance may only appear once per call, the batch is placed in parallel
+    void SetTransforms(std::span<const InstanceID> instances, std::span<const glm::mat4> transforms);
+    void SetLight(LightID light, const GPULightData& data);
+    void RemoveLight(LightID light);
+
     fmvk::Vulkan vulkan;
     Scene scene;
     
@@ -38,13 +64,35 @@ public:
 private:
     DeletionQueue _deletion_queue;
 
-    std::vector<RenderObject> _renderables;
-    // std::vector<IRenderable> _renderables;
+    // Shared by the renderer and the asset loading
+    JobSystem _jobs;
+
+    fmvk::ShaderCompiler _shader_compiler;
+    std::future<bool> _shader_build;
+
+    // Double buffered, the game thread fills one packet while the render thread draws the other.
+    // A packet is only handed over once the previous one is drawn, so the game is at most a frame ahead
+    FramePacket _packets[2];
+    uint32_t _write_packet = 0;
+    bool _packet_pending = false;
+    std::mutex _packet_mutex;
+    std::condition_variable_any _packet_cv;
+    std::jthread _render_thread;
+
+    // Instance ids are handed out here, the game thread never waits on the renderer for one
+    uint32_t _instance_count = 0;
+    std::vector<InstanceID> _free_instances;
+
+    FramePacket& packet() { return this->_packets[this->_write_packet]; }
+    void render_thread_main(std::stop_token stop);
+    void render_frame(FramePacket& packet);
+    void build_ui();
+    void start_shader_build();
+
     std::unordered_map<std::string, MaterialInstance> _materials;
     //std::unordered_map<std::string, GPUMeshBuffers> _meshes;
 
     std::unordered_map<std::string, std::vector<std::shared_ptr<MeshAsset>>> _meshes;
-    std::unordered_map<std::string, std::shared_ptr<Node>> loadedNodes;
     std::unordered_map<std::string, std::shared_ptr<LoadedGLTF>> loaded_Scenes;
 
     MaterialInstance* create_material(const std::string& name);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <variant>
+#include <optional>
+#include "imgui.h"
+
+#include "vk_types.hpp"
+
+// Copy of the frame's ImGui draw data. The UI is built on the game thread and the renderer only
+// records it, so the draw lists are cloned before the next frame reuses them
+struct UIDrawData {
+    UIDrawData() {}
+    ~UIDrawData() { clear(); }
+
+    UIDrawData(const UIDrawData&) = delete;
+    UIDrawData& operator=(const UIDrawData&) = delete;
+
+    void copy(const ImDrawData* source) {
+        clear();
+        this->data = *source;
+        for (ImDrawList*& list : this->data.CmdLists) {
+            list = list->CloneOutput();
+        }
+    }
+
+    void clear() {
+        for (ImDrawList* list : this->data.CmdLists) {
+            IM_DELETE(list);
+        }
+        this->data.Clear();
+    }
+
+    ImDrawData* get() { return this->data.Valid ? &this->data : nullptr; }
+
+private:
+    ImDrawData data;
+};
+
+// Everything the game thread hands to the renderer for one frame. It is filled through the
+// Firemountain calls during the frame and left alone once submitted, until the renderer is done with it.
+struct FramePacket {
+    struct CreateInstance {
+        InstanceID instance;
+        MeshID mesh;
+        glm::mat4 transform;
+    };
+    struct DestroyInstance {
+        InstanceID instance;
+    };
+    // Range of moved_instances and moved_transforms
+    struct SetTransforms {
+        uint32_t first;
+        uint32_t count;
+    };
+    struct SetLight {
+        LightID light;
+        GPULightData data;
+    };
+    struct RemoveLight {
+        LightID light;
+    };
+    struct ClearScene {};
+
+    using Command = std::variant<CreateInstance, DestroyInstance, SetTransforms, SetLight, RemoveLight, ClearScene>;
+
+    fmCamera camera {};
+
+    // Scene changes, applied in order
+    std::vector<Command> commands;
+    std::vector<InstanceID> moved_instances;
+    std::vector<glm::mat4> moved_transforms;
+
+    UIDrawData ui;
+    std::optional<VkExtent2D> resize;
+    std::optional<bool> depth_prepass;
+    bool compile_shaders = false;
+
+    // Keeps the capacity, packets are reused every other frame
+    void clear() {
+        this->commands.clear();
+        this->moved_instances.clear();
+        this->moved_transforms.clear();
+        this->ui.clear();
+        this->resize.reset();
+        this->depth_prepass.reset();
+        this->compile_shaders = false;
+    }
+};
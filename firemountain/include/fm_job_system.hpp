@@ -0,0 +1,110 @@
+#pragma once
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+struct JobCounter;
+
+struct Job {
+    std::function<void()> function;
+    JobCounter* counter = nullptr;  // Released once the function returns
+    bool on_main = false;           // Goes to the main thread's queue
+};
+
+// Counts the unfinished jobs of a group. JobSystem::wait() waits on it and JobSystem::run_after()
+// holds jobs back until it reaches zero. It has to outlive the jobs that were run with it.
+struct JobCounter {
+    JobCounter() {}
+    JobCounter(const JobCounter&) = delete;
+    JobCounter& operator=(const JobCounter&) = delete;
+
+    bool done() const { return this->pending.load(std::memory_order_acquire) == 0; }
+
+private:
+    friend struct JobSystem;
+
+    std::atomic<uint32_t> pending = 0;
+    std::mutex mutex;
+    std::vector<Job> dependents;  // Queued when pending reaches zero
+};
+
+// Work stealing scheduler shared by the engine. Every worker has its own deque, it takes its jobs
+// from the back and the others steal from the front once theirs run dry. Jobs queued by threads
+// that aren't workers go to a shared queue, and those threads help with the work while they wait.
+struct JobSystem {
+    struct WorkerStats {
+        uint64_t jobs;
+        uint64_t steals;
+        float utilization;  // Busy fraction of the time since the previous sample
+    };
+
+    // One worker less than there are cores by default. The calling thread becomes the main thread
+    void init(uint32_t worker_count = 0);
+    void destroy();
+
+    void run(std::function<void()>&& function, JobCounter* counter = nullptr);
+
+    // Queued once the dependency reaches zero
+    void run_after(JobCounter& dependency, std::function<void()>&& function, JobCounter* counter = nullptr);
+
+    // Runs on the main thread the next time it waits or calls run_main_jobs(), for work that has to stay there
+    void run_on_main(std::function<void()>&& function, JobCounter* counter = nullptr);
+    void run_on_main_after(JobCounter& dependency, std::function<void()>&& function, JobCounter* counter = nullptr);
+    void run_main_jobs();
+
+    // Runs other jobs until the counter reaches zero
+    void wait(JobCounter& counter);
+
+    // Calls function(begin, end) on ranges of [0, count) of at least min_batch items, returns once all are done.
+    // The calling thread takes one of the ranges itself
+    void parallel_for(uint32_t count, uint32_t min_batch, const std::function<void(uint32_t begin, uint32_t end)>& function);
+
+    uint32_t worker_count() const { return this->workers.size(); }
+
+    // Meant to be called from one thread, once a frame
+    std::vector<WorkerStats> sample_stats();
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+
+        std::atomic<uint64_t> busy_ns = 0;
+        std::atomic<uint64_t> job_count = 0;
+        std::atomic<uint64_t> steal_count = 0;
+        uint64_t sampled_busy_ns = 0;
+    };
+
+    void worker_main(uint32_t index, std::stop_token stop);
+    void push(Job&& job);
+    void push_main(Job&& job);
+    void schedule_after(JobCounter& dependency, Job&& job);
+    bool pop(Job& job, bool& stolen);
+    void execute(Job& job, bool stolen);
+    void release(JobCounter* counter);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::jthread> threads;
+
+    std::mutex shared_mutex;
+    std::deque<Job> shared_jobs;
+
+    std::thread::id main_thread;
+    std::mutex main_mutex;
+    std::deque<Job> main_jobs;
+
+    // Jobs in the worker and shared queues, idle workers sleep until there are some
+    std::atomic<int32_t> queued = 0;
+    std::mutex sleep_mutex;
+    std::condition_variable_any sleep_cv;
+
+    std::chrono::steady_clock::time_point sampled_at;
+};
@@ -14,30 +14,39 @@
 
 struct LoadedGLTF : public IRenderable {
     std::unordered_map<std::string, std::shared_ptr<MeshAsset>> meshes;
-    std::unordered_map<std::string, std::shared_ptr<Node>> nodes;
+    std::unordered_map<std::string, uint32_t> nodes;  // Into the hierarchy
     std::unordered_map<std::string, fmvk::Image::AllocatedImage> images;
     std::unordered_map<std::string, std::shared_ptr<GLTFMaterial>> materials;
 
-    std::vector<std::shared_ptr<Node>> top_nodes;
+    // Meshes in file order, the node mesh indices point here
+    std::vector<std::shared_ptr<MeshAsset>> mesh_list;
+    NodeHierarchy hierarchy;
 
     std::vector<VkSampler> samplers;
 
-    DescriptorAllocatorGrowable descriptor_pool;
-
-    fmvk::Buffer::AllocatedBuffer material_data_buffer;
+    // Constants of the materials in the renderer's material buffer
+    std::vector<uint32_t> material_indices;
 
     fmvk::Vulkan* creator;
 
     ~LoadedGLTF() { clear_all(); };
     virtual void Draw(const glm::mat4& top_matrix, DrawContext& ctx);
 
+    // Draw records of the whole file in its own space, built on first use and shared by all of its instances.
+    // Assets don't change once loaded, and the records point to the materials, whose pipelines are swapped in place
+    const DrawContext& get_surfaces();
+
 private:
     void clear_all();
+
+    DrawContext surfaces;
+    bool surfaces_built = false;
 };
 
 
 namespace MeshLoader {
     bool LoadObj(const char* path, std::vector<Vertex> *vertices, std::vector<uint32_t> *indices);
+    // Decodes on the engine's job workers, has to be called from the main thread which does the uploads
     std::optional<std::shared_ptr<LoadedGLTF>> load_GLTF(fmvk::Vulkan* engine, std::string_view file_path);
 
     // std::vector<std::shared_ptr<MeshAsset>> LoadGltf(std::filesystem::path file_path, fmvk::Vulkan *vk_engine);
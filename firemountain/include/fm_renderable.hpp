@@ -14,10 +14,13 @@ struct RenderObject {
     Bounds bounds;
     glm::mat4 transform;
     VkDeviceAddress vertex_buffer_address;
+    VkDeviceAddress position_buffer_address;
+    uint32_t object_index;  // Into the scene object buffer
 };
 
 struct DrawContext {
     std::vector<RenderObject> opaque_surfaces;
+    std::vector<RenderObject> masked_surfaces;
     std::vector<RenderObject> transparent_surfaces;
 };
 
@@ -30,24 +33,30 @@ private:
 };
 
 
-// Render graph stuff
-struct Node : public IRenderable {
-    std::weak_ptr<Node> parent;
-    std::vector<std::shared_ptr<Node>> children;
+// Node hierarchy as flat arrays, ordered so that every parent comes before its children
+struct NodeHierarchy {
+    std::vector<glm::mat4> local_transforms;
+    std::vector<glm::mat4> world_transforms;
+    std::vector<int32_t> parents;  // -1 for top nodes
+    std::vector<int32_t> meshes;   // Mesh of the node, -1 if it has none
 
-    glm::mat4 local_transform;
-    glm::mat4 world_transform;
-
-    void refresh_transform(const glm::mat4& parent_matrix) {
-        this->world_transform = parent_matrix * this->local_transform;
-        for (auto c : this->children) {
-            c->refresh_transform(this->world_transform);
-        }
+    uint32_t add_node(int32_t parent, const glm::mat4& local_transform, int32_t mesh) {
+        this->parents.push_back(parent);
+        this->local_transforms.push_back(local_transform);
+        this->world_transforms.push_back(local_transform);
+        this->meshes.push_back(mesh);
+        return this->parents.size() - 1;
     }
 
-    virtual void Draw(const glm::mat4& top_matrix, DrawContext& ctx) {
-        for (auto& c : this->children) {
-            c->Draw(top_matrix, ctx);
+    // Parents are always refreshed before their children, so one pass over the arrays does it
+    void refresh_transforms() {
+        for (size_t i = 0; i < this->parents.size(); i++) {
+            const int32_t parent = this->parents[i];
+            if (parent < 0) {
+                this->world_transforms[i] = this->local_transforms[i];
+            } else {
+                this->world_transforms[i] = this->world_transforms[parent] * this->local_transforms[i];
+            }
         }
     }
-};
\ No newline at end of file
+};
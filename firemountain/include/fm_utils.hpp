@@ -1,7 +1,12 @@
 #pragma once
 
 #include <deque>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
 #include <functional>
+#include <memory_resource>
 
 struct DeletionQueue {
     std::deque<std::function<void()>> deletors;
@@ -14,4 +19,93 @@ struct DeletionQueue {
         }
         deletors.clear();
     }
-};
\ No newline at end of file
+};
+
+// Deletions that wait for the GPU timeline to reach the value they were pushed with.
+// Values have to be pushed in increasing order.
+struct TimelineDeletionQueue {
+    std::deque<std::pair<uint64_t, std::function<void()>>> deletors;
+    void push_function(uint64_t timeline_value, std::function<void()>&& function) {
+        deletors.emplace_back(timeline_value, function);
+    };
+    void flush(uint64_t completed_value) {
+        while (!deletors.empty() && deletors.front().first <= completed_value) {
+            deletors.front().second();
+            deletors.pop_front();
+        }
+    }
+};
+
+// Linear allocator for CPU data that only lives for one frame, used through std::pmr containers.
+// Allocations bump through one block and are all released by reset(), which keeps the block.
+// What didn't fit comes from the heap, and the block grows to hold all of it after the next reset.
+struct FrameArena : public std::pmr::memory_resource {
+    explicit FrameArena(size_t capacity = 256 * 1024) :
+        block(std::make_unique<std::byte[]>(capacity)),
+        capacity(capacity) {}
+    ~FrameArena() { release_overflow(); }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    void reset() {
+        if (this->overflow_bytes > 0) {
+            this->capacity = std::max(this->capacity * 2, this->offset + this->overflow_bytes);
+            this->block = std::make_unique<std::byte[]>(this->capacity);
+        }
+        release_overflow();
+        this->offset = 0;
+        this->allocation_count = 0;
+        this->heap_allocation_count = 0;
+    }
+
+    // Since the last reset
+    uint32_t allocation_count = 0;
+    uint32_t heap_allocation_count = 0;
+
+private:
+    struct Overflow {
+        void* memory;
+        size_t bytes;
+        size_t alignment;
+    };
+
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        this->allocation_count++;
+
+        void* memory = this->block.get() + this->offset;
+        size_t space = this->capacity - this->offset;
+        if (std::align(alignment, bytes, memory, space)) {
+            this->offset = this->capacity - space + bytes;
+            return memory;
+        }
+
+        this->heap_allocation_count++;
+        memory = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        this->overflow.push_back({ memory, bytes, alignment });
+        this->overflow_bytes += bytes + alignment;
+        return memory;
+    }
+
+    // Freed all at once by reset()
+    void do_deallocate(void*, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    void release_overflow() {
+        for (const Overflow& o : this->overflow) {
+            std::pmr::new_delete_resource()->deallocate(o.memory, o.bytes, o.alignment);
+        }
+        this->overflow.clear();
+        this->overflow_bytes = 0;
+    }
+
+    std::unique_ptr<std::byte[]> block;
+    size_t capacity;
+    size_t offset = 0;
+
+    std::vector<Overflow> overflow;
+    size_t overflow_bytes = 0;
+};
@@ -3,6 +3,7 @@
 #include <span>
 #include <vector>
 #include <deque>
+#include <memory_resource>
 
 #include "vk_types.hpp"
 
@@ -38,9 +39,15 @@ private:
 };
 
 struct DescriptorWriter {
-    std::deque<VkDescriptorImageInfo> image_infos;
-    std::deque<VkDescriptorBufferInfo> buffer_infos;
-    std::vector<VkWriteDescriptorSet> writes;
+    // Writers used during a frame keep their lists in the frame arena
+    explicit DescriptorWriter(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) :
+        image_infos(resource),
+        buffer_infos(resource),
+        writes(resource) {}
+
+    std::pmr::deque<VkDescriptorImageInfo> image_infos;
+    std::pmr::deque<VkDescriptorBufferInfo> buffer_infos;
+    std::pmr::vector<VkWriteDescriptorSet> writes;
 
     void write_image(int binding, VkImageView image, VkSampler sampler, VkImageLayout layout, VkDescriptorType type);
     void write_buffer(int binding, VkBuffer buffer, size_t size, size_t offset, VkDescriptorType type);
@@ -8,6 +8,13 @@ namespace VKUtil {
         VkImageLayout current_layout, VkImageLayout new_layout
     );
 
+    // Global memory barrier, used for buffer hazards between compute and draw passes
+    void memory_barrier(
+        VkCommandBuffer cmd,
+        VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access,
+        VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access
+    );
+
     void copy_image_to_image(
         VkCommandBuffer cmd, 
         VkImage src, 
@@ -38,12 +38,15 @@ namespace VKInit {
 
     VkFenceCreateInfo fence_create_info(VkFenceCreateFlags flags = 0);
     VkSemaphoreCreateInfo samephore_create_info(VkSemaphoreCreateFlags flags = 0);
-    VkSemaphoreSubmitInfo semaphore_submit_info(VkPipelineStageFlags2 stage_mask, VkSemaphore semaphore);
+    // Value is only used by timeline semaphores
+    VkSemaphoreSubmitInfo semaphore_submit_info(VkPipelineStageFlags2 stage_mask, VkSemaphore semaphore, uint64_t value = 1);
 
     VkSubmitInfo2 submit_info(
         VkCommandBufferSubmitInfo* cmd, 
         VkSemaphoreSubmitInfo* signal_semaphore_info,
-        VkSemaphoreSubmitInfo* wait_semaphore_info
+        VkSemaphoreSubmitInfo* wait_semaphore_info,
+        uint32_t signal_semaphore_count = 1,
+        uint32_t wait_semaphore_count = 1
     );
 
 
@@ -53,7 +56,7 @@ namespace VKInit {
     VkPipelineDepthStencilStateCreateInfo depth_stencil_create_info(bool depth_test, bool depth_write, VkCompareOp compare_op);
 
     VkRenderingAttachmentInfo attachment_info(VkImageView view, VkClearValue* clear, VkImageLayout layout);
-    VkRenderingAttachmentInfo depth_attachment_info(VkImageView view, VkImageLayout layout);
+    VkRenderingAttachmentInfo depth_attachment_info(VkImageView view, VkImageLayout layout, VkAttachmentLoadOp load_op = VK_ATTACHMENT_LOAD_OP_CLEAR);
     VkRenderingInfo rendering_info(
         VkExtent2D render_extent, 
         VkRenderingAttachmentInfo* color_attachment, 
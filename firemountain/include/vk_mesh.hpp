@@ -45,6 +45,10 @@ struct GPUMeshBuffers {
     fmvk::Buffer::AllocatedBuffer index_buffer;
     fmvk::Buffer::AllocatedBuffer vertex_buffer;
     VkDeviceAddress vertex_buffer_address;
+
+    // Positions only, tightly packed for the depth prepass
+    fmvk::Buffer::AllocatedBuffer position_buffer;
+    VkDeviceAddress position_buffer_address;
 };
 
 struct MeshAsset {
@@ -53,8 +57,23 @@ struct MeshAsset {
     GPUMeshBuffers mesh_buffers;
 };
 
-struct GPUDrawPushConstants {
-    glm::mat4 world_matrix;
+// Record of the scene object buffer, kept on the GPU and only updated when the object moves
+struct GPUObjectData {
+    glm::mat4 transform;
+    glm::vec4 bounds_origin_radius;  // Local bounds, sphere radius as .w
+    glm::vec4 bounds_extents;
+};
+static_assert(sizeof(GPUObjectData) == 96);
+
+// Per draw record, the vertex shader finds its own through the instance index (firstInstance of the draw)
+struct GPUDrawData {
     VkDeviceAddress vertex_buffer;
+    VkDeviceAddress position_buffer;
+    uint32_t object_index;
+    uint32_t material_index;
+};
+
+struct GPUDrawPushConstants {
+    VkDeviceAddress draw_data;
 };
 
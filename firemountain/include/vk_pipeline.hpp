@@ -14,7 +14,7 @@ namespace fmvk {
         VkPipelineLayout layout;
         ComputePushConstants data;
 
-        int Init(const VkDevice device, const char* shader_name, VkDescriptorSetLayout descriptor_layout);
+        int Init(const VkDevice device, const char* shader_name, VkDescriptorSetLayout descriptor_layout, uint32_t push_constant_size = sizeof(ComputePushConstants));
         void Cleanup(const VkDevice device);
     };
 
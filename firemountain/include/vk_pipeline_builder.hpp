@@ -1,5 +1,6 @@
 #pragma once
 
+#include <span>
 #include <vector>
 
 #include "vk_types.hpp"
@@ -15,7 +16,18 @@ namespace fmvk {
         VkPipeline build_pipeline(VkDevice device);
         void clear();
 
+        // VK_EXT_graphics_pipeline_library parts, each one only takes the state of the builder it owns
+        VkPipeline build_vertex_input_library(VkDevice device);
+        VkPipeline build_pre_rasterization_library(VkDevice device);
+        VkPipeline build_fragment_shader_library(VkDevice device);
+        VkPipeline build_fragment_output_library(VkDevice device);
+
+        // Link one library of each part into a complete pipeline. The fast link skips link time optimization
+        static VkPipeline link_libraries(VkDevice device, VkPipelineLayout layout, std::span<const VkPipeline> libraries, bool optimize);
+
         void set_shaders(VkShaderModule vertex_shader, VkShaderModule fragment_shader);
+        void set_vertex_shader_only(VkShaderModule vertex_shader);
+        void set_specialization(VkShaderStageFlagBits stage, const VkSpecializationInfo* specialization);
         void set_input_topology(VkPrimitiveTopology topology);
         void set_polygon_mode(VkPolygonMode mode);
         void set_cull_mode(VkCullModeFlags cull_mode, VkFrontFace front_face);
@@ -41,5 +53,8 @@ namespace fmvk {
         VkPipelineDepthStencilStateCreateInfo _depth_stencil;
         VkPipelineRenderingCreateInfo _render_info;
         VkFormat _color_attachment_format;
+
+    private:
+        VkPipeline build_library(VkDevice device, VkGraphicsPipelineLibraryFlagsEXT part);
     };
 }
\ No newline at end of file
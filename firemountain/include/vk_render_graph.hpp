@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+#include "vk_types.hpp"
+#include "vk_image.hpp"
+#include "fm_utils.hpp"
+
+namespace fmvk {
+    // How a pass uses an image, each one maps to the stages, access and layout the barriers are built from
+    enum class RGAccess : uint8_t {
+        COLOR_ATTACHMENT,
+        DEPTH_ATTACHMENT,
+        COMPUTE_STORAGE_WRITE,
+        COMPUTE_SAMPLED_READ,
+        COMPUTE_DEPTH_SAMPLED_READ,  // Depth buffer sampled in its read only layout
+        TRANSFER_SRC,
+        TRANSFER_DST,
+        PRESENT
+    };
+
+    struct RGImage {
+        uint32_t id;
+    };
+
+    struct RGImageUse {
+        RGImage image;
+        RGAccess access;
+    };
+
+    // Frame graph of the renderer. Passes are added every frame in execution order together with
+    // the images they read and write, execute() then records them with only the barriers needed
+    // between them. Transient images live only inside the frame, the ones whose pass ranges do not
+    // overlap share the same memory.
+    struct RenderGraph {
+        void init(VkDevice device, VmaAllocator allocator);
+        void destroy();
+
+        // Images that outlive the graph, the layout and last access are carried over to the next frame
+        RGImage import_image(const std::string& name, const fmvk::Image::AllocatedImage& image, bool preserve_contents = false);
+
+        // Swapchain images become usable once the acquire semaphore wait at acquire_stage is done
+        RGImage import_swapchain_image(const std::string& name, VkImage image, VkImageView view, VkExtent2D extent, VkPipelineStageFlags2 acquire_stage);
+
+        RGImage create_image(const std::string& name, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage);
+
+        void add_pass(const std::string& name, std::vector<RGImageUse> uses, std::function<void(VkCommandBuffer cmd)>&& record = nullptr);
+
+        // Assign memory to the transient images. Images of an outdated aliasing plan are handed to the deletion queue
+        void compile(DeletionQueue& deletion_queue);
+        const fmvk::Image::AllocatedImage& get_image(RGImage image) const { return this->images[image.id].image; }
+
+        void execute(VkCommandBuffer cmd);
+
+        // Forget the tracked state of an imported image, needed once it gets destroyed
+        void forget_image(VkImage image);
+
+    private:
+        // Last access of a piece of memory. Reads are tracked since the last write to know which
+        // stages the write was already made visible to
+        struct AccessState {
+            VkPipelineStageFlags2 write_stages = VK_PIPELINE_STAGE_2_NONE;
+            VkAccessFlags2 write_access = VK_ACCESS_2_NONE;
+            VkPipelineStageFlags2 read_stages = VK_PIPELINE_STAGE_2_NONE;
+        };
+
+        struct ImportedState {
+            VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            AccessState access {};
+        };
+
+        // Cached transient image and the memory slot it is bound to
+        struct TransientImage {
+            std::string name;
+            VkExtent3D extent;
+            VkFormat format;
+            VkImageUsageFlags usage;
+            fmvk::Image::AllocatedImage image;
+            uint32_t slot;
+        };
+
+        struct MemorySlot {
+            VmaAllocation allocation;
+            AccessState access {};
+        };
+
+        struct GraphImage {
+            std::string name;
+            fmvk::Image::AllocatedImage image;
+            VkImageAspectFlags aspect;
+            VkImageLayout layout;
+            bool transient;
+            bool preserve_contents;
+            VkImageUsageFlags usage = 0;
+            int32_t transient_index = -1;
+
+            // Range of passes that use the image
+            uint32_t first_pass = UINT32_MAX;
+            uint32_t last_pass = 0;
+        };
+
+        struct Pass {
+            std::string name;
+            std::vector<RGImageUse> uses;
+            std::function<void(VkCommandBuffer cmd)> record;
+        };
+
+        AccessState& access_state(const GraphImage& image);
+        bool plan_is_valid() const;
+        void build_plan(DeletionQueue& deletion_queue);
+        void retire_transients(DeletionQueue& deletion_queue);
+
+        VkDevice device {};
+        VmaAllocator allocator {};
+
+        std::vector<GraphImage> images;
+        std::vector<Pass> passes;
+
+        std::unordered_map<VkImage, ImportedState> imported_states;
+        std::vector<TransientImage> transients;
+        std::vector<MemorySlot> slots;
+    };
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <span>
 #include <string>
 #include <vector>
+#include <future>
+#include <optional>
 #include <filesystem>
 #include <unordered_map>
 #include "vk_mem_alloc.h"
@@ -12,62 +15,72 @@
 #include "vk_pipeline.hpp"
 #include "vk_swapchain.hpp"
 #include "vk_descriptors.hpp"
+#include "vk_render_graph.hpp"
 
 #include "fm_utils.hpp"
+#include "fm_job_system.hpp"
 #include "fm_renderable.hpp"
 #include "vk_texture_cache.hpp"
 
 struct SDL_Window;
 union SDL_Event;
+struct ImDrawData;
 
 struct LoadedGLTF;
 
 
-struct MeshNode : public Node {
-    std::shared_ptr<MeshAsset> mesh;
-    
-    void Draw(const glm::mat4& top_matrix, DrawContext& ctx) override;
-};
-
 struct EngineStats {
     float frametime;
     int triangle_count;
     int drawcall_count;
     float scene_update_time;
     float mesh_draw_time;
+    int occlusion_culled_count;
+    int cluster_lights_dropped;  // Light indices that didn't fit into the cluster lists, the lists grow for the next frames
+    float depth_prepass_gpu_time;
+    float occlusion_gpu_time;
+    float geometry_gpu_time;
+    float gpu_frametime;
+    float render_scale;
+    int frame_arena_allocations;
+    int frame_heap_allocations;  // Arena allocations that didn't fit in its block
+    bool draw_lists_cached;
 };
 
 
 namespace fmvk {
     class Vulkan;
+    class PipelineBuilder;
 
     struct GLTFMetallic_Roughness {
-        MaterialPipeline opaque_pipeline;
-        MaterialPipeline transparent_pipeline;
-        VkDescriptorSetLayout material_layout;
+        // Pipelines of one set of material features, the pixel shader is specialized for them
+        struct FeatureVariants {
+            MaterialPipeline opaque;
+            MaterialPipeline transparent;
+            // Opaque shading that only passes on the depth a prepass laid down
+            MaterialPipeline opaque_depth_equal;
+        };
+
+        // Position only depth writes of the depth prepass, the same for every material
+        MaterialPipeline depth_prepass_pipeline;
 
+        // Element of the material storage buffer, the texture maps are indices into the bindless textures.
+        // Which maps are used is a pipeline feature, see MaterialFeature
         struct MaterialConstants {
             glm::vec4 color_factors;
-            glm::vec2 metal_roughness_factors;
-            float has_metal_roughness_map;
-            float has_color_map;
-
             glm::vec4 emissive_factor;
-            float use_alpha_blending;
-            float has_emissive_map;
-            float has_normal_map;
+            glm::vec2 metal_roughness_factors;
+            float alpha_cutoff;
 
             int color_tex_id;
             int metal_roughness_tex_id;
             int normal_tex_id;
             int emissive_tex_id;
-
-            float padding_1;
-            glm::vec4 extra[11];  // Padding for uniform buffers
+            float padding;
         };
-        static_assert(sizeof(MaterialConstants) == 256);  // Make sure the size is right
+        static_assert(sizeof(MaterialConstants) == 64);  // Make sure the size is right
 
-        // TODO: These need to be cleaned on exit
+        // Textures of a material, registered in the texture cache when it's loaded
         struct MaterialResources {
             fmvk::Image::AllocatedImage color_image;
             VkSampler color_sampler;    
@@ -80,22 +93,65 @@ namespace fmvk {
 
             fmvk::Image::AllocatedImage emissive_image;
             VkSampler emissive_sampler;
+        };
 
-            VkBuffer data_buffer;
-            uint32_t data_buffer_offset;
+        // Renderer state the pipelines are built against, copied so the build doesn't touch the renderer
+        struct BuildInfo {
+            VkDevice device;
+            VkFormat color_format;
+            VkFormat depth_format;
+            VkDescriptorSetLayout scene_layout;
+            bool pipeline_library;
+            bool fast_linking;
         };
 
-        DescriptorWriter writer;
+        // Builds the state shared by all variants and the variants of the given feature sets
+        void build_pipelines(const BuildInfo& info, const std::vector<uint32_t>& features = {});
+        void clear_pipelines(VkDevice device);
+
+        // Variants of a feature set, built on first use and shared by all materials with the same features
+        FeatureVariants& get_variants(uint32_t features);
+        std::vector<uint32_t> variant_features() const;
 
-        void build_pipelines(const fmvk::Vulkan* renderer);
-        void clear_resources(VkDevice device);
+        // Exchange the pipelines with the ones of another material, material instances keep pointing to this one
+        void swap_pipelines(GLTFMetallic_Roughness& other);
 
-        MaterialInstance write_material(
-            VkDevice device, 
-            MaterialPass pass, 
-            const MaterialResources& resources,
-            DescriptorAllocatorGrowable& descriptor_allocator
-        );
+        // Swap in the link time optimized variants that finished in the background, returns the replaced
+        // fast linked pipelines which may still be in flight
+        std::vector<VkPipeline> swap_optimized_pipelines();
+
+        // The constants are added to the renderer with Vulkan::add_material_constants()
+        MaterialInstance write_material(MaterialPass pass, uint32_t features, uint32_t material_index);
+
+    private:
+        // Kept from build_pipelines() for the variants built later on
+        VkDevice device {};
+        bool pipeline_library = false;
+        bool fast_linking = false;
+        VkFormat color_format {};
+        VkFormat depth_format {};
+        VkShaderModule vertex_shader {};
+        VkShaderModule pixel_shader {};
+        VkPipelineLayout mesh_layout {};
+
+        std::unordered_map<uint32_t, FeatureVariants> feature_variants;
+
+        // Graphics pipeline library parts the variants are linked from, empty on the monolithic fallback.
+        // Only the fragment shader part differs between feature sets
+        std::vector<VkPipeline> pipeline_libraries;
+        VkPipeline vertex_input_library {};
+        VkPipeline mesh_pre_rasterization_library {};
+        VkPipeline alphablend_output_library {};
+        VkPipeline additive_output_library {};
+
+        struct OptimizedLink {
+            MaterialPipeline* target;
+            std::future<VkPipeline> pipeline;
+        };
+        std::vector<OptimizedLink> optimized_links;
+
+        void configure_mesh_builder(fmvk::PipelineBuilder& builder) const;
+        void link_variant(MaterialPipeline& variant, std::vector<VkPipeline> libraries);
     };
 
     struct FrameData {
@@ -103,11 +159,86 @@ namespace fmvk {
         VkCommandBuffer _main_command_buffer;
 
         VkSemaphore _swapchain_semaphore;
-        VkFence _render_fence;
+
+        // Timeline value the last submission of this frame signals, reaching it frees the frame for reuse
+        uint64_t _timeline_value = 0;
 
         DescriptorAllocatorGrowable _frame_descriptors;
         DeletionQueue _deletion_queue;
+
+        // Transient CPU lists of the frame, reset together with the deletion queue
+        FrameArena _arena;
+        fmvk::Buffer::AllocatedBuffer _scene_buffer {};
+
+        // GPU timings, indexed by GPUTimestamp
+        VkQueryPool _timestamp_pool;
+        bool _timestamps_written = false;
+
+        // Occlusion culling data, read back once the frame timeline value is reached
+        fmvk::Buffer::AllocatedBuffer _occlusion_objects {};
+        fmvk::Buffer::AllocatedBuffer _occlusion_commands {};
+        fmvk::Buffer::AllocatedBuffer _occlusion_visibility {};
+        uint32_t _occlusion_capacity = 0;
+        uint64_t _occlusion_surface_generation = 0;  // Of the surface lists the candidates index into
+        std::vector<uint32_t> _occlusion_candidates;
+
+        // Clustered lighting: all scene lights, and the per cluster light lists built from them
+        fmvk::Buffer::AllocatedBuffer _lights {};
+        fmvk::Buffer::AllocatedBuffer _cluster_grid {};
+        fmvk::Buffer::AllocatedBuffer _cluster_light_indices {};
+        fmvk::Buffer::AllocatedBuffer _cluster_index_usage {};  // Allocation counter of the list, read back to grow it
+        uint32_t _light_capacity = 0;
+        uint32_t _cluster_index_capacity = 0;
+
+        // Staging of the scene object records that changed since the last frame
+        fmvk::Buffer::AllocatedBuffer _object_upload {};
+        uint32_t _object_upload_capacity = 0;
+
+        // Indirect commands of the frame's draws and the record each one reads through its instance index
+        fmvk::Buffer::AllocatedBuffer _draw_commands {};
+        fmvk::Buffer::AllocatedBuffer _draw_data {};
+        VkDeviceAddress _draw_data_address = 0;
+        uint32_t _draw_capacity = 0;
+        uint64_t _draw_build = 0;  // Build of the draw list cache the draw and occlusion buffers hold
+    };
+
+    // Per object input of the occlusion cull shader
+    struct GPUOcclusionObject {
+        glm::vec4 rect;  // NDC bounds, .xy min and .zw max
+        float depth;     // Nearest depth of the bounds
+        uint32_t flags;
+        uint32_t padding[2];
     };
+    static_assert(sizeof(GPUOcclusionObject) == 32);
+
+    constexpr uint32_t OCCLUSION_FLAG_EARLY = 1;
+    constexpr uint32_t OCCLUSION_FLAG_SKIP_TEST = 2;
+
+    enum GPUTimestamp : uint32_t {
+        FM_TIMESTAMP_FRAME_BEGIN,
+        FM_TIMESTAMP_GEOMETRY_BEGIN,
+        FM_TIMESTAMP_DEPTH_PREPASS_END,
+        FM_TIMESTAMP_OCCLUSION_BEGIN,
+        FM_TIMESTAMP_OCCLUSION_END,
+        FM_TIMESTAMP_GEOMETRY_END,
+        FM_TIMESTAMP_FRAME_END,
+        FM_TIMESTAMP_COUNT
+    };
+
+    // Light cluster grid, screen tiles times exponential depth slices
+    constexpr uint32_t CLUSTER_GRID_X = 16;
+    constexpr uint32_t CLUSTER_GRID_Y = 9;
+    constexpr uint32_t CLUSTER_GRID_Z = 24;
+    constexpr uint32_t CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+    constexpr float CLUSTER_Z_NEAR = 0.1f;
+    constexpr float CLUSTER_Z_FAR = 10000.0f;
+
+    // Average lights per cluster the light index list starts out sized for. Lights that overflow it
+    // are dropped for a frame, then the list grows to what the clusters asked for
+    constexpr uint32_t CLUSTER_AVERAGE_LIGHTS = 64;
+
+    // Intensity a point light without a range is allowed to fade to before it's cut off
+    constexpr float LIGHT_ATTENUATION_CUTOFF = 0.005f;
 
     constexpr int FRAME_OVERLAP = 2;
 
@@ -117,10 +248,14 @@ namespace fmvk {
         ~Vulkan() = default;
 
         int Init(uint32_t width, uint32_t height, SDL_Window* window);
-        void Draw(RenderObject* first_render_object, int render_object_count);
+        void Draw(ImDrawData* ui_draw_data);
         void Resize(uint32_t width, uint32_t height);
         void Destroy();
+
+        // The ImGui platform side calls into SDL, so events and the UI build stay on the thread that owns
+        // the window. The UI ends up in ImGui::GetDrawData(), Draw() only records it
         void ProcessImGuiEvent(const SDL_Event* e);
+        void build_ui();
         
         GPUMeshBuffers UploadMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices);
 
@@ -133,6 +268,9 @@ namespace fmvk {
         std::unordered_map<std::string, fmvk::Pipeline> pipelines;
         std::unordered_map<std::string, fmvk::ComputePipeline> compute_pipelines;
 
+        // Owned by Firemountain, set before Init
+        JobSystem* jobs = nullptr;
+
         // TODO: Move into object renderer or something
         unsigned int next_id = 0;
         MeshID AddMesh(const std::string& name, const std::shared_ptr<LoadedGLTF>& mesh);
@@ -167,6 +305,29 @@ namespace fmvk {
         fmvk::Image::AllocatedImage _draw_image {};
         fmvk::Image::AllocatedImage _depth_image {};
         void init_render_targets();
+        void destroy_render_targets();
+
+        // VK_EXT_graphics_pipeline_library, material variants are linked from shared parts
+        bool _pipeline_library = false;
+        bool _pipeline_library_fast_linking = false;
+
+        // Two-phase occlusion culling against a depth pyramid of the first pass
+        bool occlusion_culling = true;
+
+        // Lay down opaque depth first, then shade with an EQUAL depth test
+        bool depth_prepass = false;
+
+        // Reuse the culled draw lists and their indirect data while nothing they depend on changed
+        bool cache_draw_lists = true;
+
+        // Scale the render resolution to keep the GPU frame time within the target
+        bool dynamic_resolution = true;
+        float target_gpu_frametime = 16.0f;
+        float min_render_scale = 0.5f;
+
+        // Edge adaptive upscaling and sharpening instead of a plain blit when the render scale is below 1
+        bool upscaling = true;
+        float sharpness = 0.2f;  // In stops, 0 is the sharpest
 
     private:
         int _frame_number = 0;
@@ -181,6 +342,7 @@ namespace fmvk {
         VkExtent2D _requested_extent {};
         VkInstance _instance {};
         VkPhysicalDevice _gpu {};
+        float _timestamp_period = 1.0f;  // Nanoseconds per timestamp tick
         // VkDevice _device;
 
         VkSurfaceKHR _surface {};
@@ -191,6 +353,7 @@ namespace fmvk {
 
         fmvk::Swapchain _swapchain;
         void init_swapchain();
+        void recreate_swapchain();
 
         VkQueue _graphics_queue {};
         uint32_t _graphics_queue_family {};
@@ -203,42 +366,202 @@ namespace fmvk {
         FrameData& get_current_frame() { return this->_frames[this->_frame_number % FRAME_OVERLAP]; }
         void init_sync_structures();
 
-        // Immediate submit structures
-        VkFence _immediate_fence {};
-        VkCommandBuffer _immediate_command_buffer {};
+        // Single timeline for every submission to the graphics queue, each one signals the next value
+        VkSemaphore _timeline_semaphore {};
+        uint64_t _timeline_value = 0;
+        uint64_t _upload_timeline_value = 0;  // Last upload, frames wait on it on the GPU
+        TimelineDeletionQueue _timeline_deletion_queue;
+        uint64_t completed_timeline_value() const;
+        void wait_timeline(uint64_t value) const;
+
+        // Immediate submit structures, command buffers are reused once their submission has finished
+        struct ImmediateCommand {
+            VkCommandBuffer cmd;
+            uint64_t timeline_value;
+        };
+        std::vector<ImmediateCommand> _immediate_commands;
         VkCommandPool _immediate_command_pool {};
-        void immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function) const;
+        uint64_t immediate_submit(std::function<void(VkCommandBuffer cmd)>&& function);
 
         // Pipelines
     public:
         void clean_pipelines();
         void init_pipelines();
 
+        // Recompile the pipelines on worker threads, the current ones stay in use until all are done
+        void reload_pipelines();
+
     private:
+        struct CompiledComputePipeline {
+            fmvk::ComputePipeline pipeline;
+            float compile_time;  // ms
+        };
+        struct CompiledMaterial {
+            std::shared_ptr<GLTFMetallic_Roughness> material;
+            float compile_time;  // ms
+        };
+        struct PipelineCompile {
+            std::vector<std::pair<std::string, std::future<CompiledComputePipeline>>> compute;
+            std::future<CompiledMaterial> material;
+        };
+        std::optional<PipelineCompile> _pipeline_compile;
+        bool pipelines_compiled() const;
+        void swap_compiled_pipelines();
+
         // Draw resources
         // AllocatedImage _draw_image;
         // AllocatedImage _depth_image;
+        VkExtent2D _render_target_extent {};  // High-water size of the render targets
         VkExtent2D _draw_extent {};
         float _render_scale = 1.0f;
+        void update_render_scale(float gpu_frametime);
+
+        // Passes of the frame and the transient targets they use
+        RenderGraph _render_graph;
+
+        // Spatial upscaler, the upscale image is a render graph transient
+        fmvk::Image::AllocatedImage _upscale_image {};
+        VkDescriptorSetLayout _upscale_descriptor_layout {};
+        VkSampler _upscale_sampler {};
+        void upscale_easu(VkCommandBuffer cmd);
+        void upscale_rcas(VkCommandBuffer cmd);
 
         // TODO: move these to FM
         // ----------------------
     public:
         DrawContext _main_draw_context;
-        void update_scene(const fmCamera* camera, std::vector<RenderSceneObj> scene);
+
+        // Retained scene: instances and lights stay until they're destroyed, so a frame only passes in what changed.
+        // Instance ids are handed out by the caller, so they can be known before the renderer sees them
+        void create_instance(InstanceID instance_id, MeshID mesh_id, const glm::mat4& transform);
+        void destroy_instance(InstanceID instance_id);
+        // Ids have to be unique within a batch, its instances are placed in parallel
+        void set_instance_transforms(std::span<const InstanceID> instance_ids, std::span<const glm::mat4> transforms);
+        void set_light(LightID light_id, const GPULightData& light);
+        void remove_light(LightID light_id);
+
+        void update_scene(const fmCamera* camera);
+        void clear_scene();
     private:
+        // Placed instance of a loaded mesh, its surfaces stay in the draw context between frames
+        struct SceneInstance {
+            struct Surface {
+                std::vector<RenderObject>* list;
+                uint32_t index;
+                glm::mat4 node_transform;
+            };
+            std::vector<Surface> surfaces;
+            glm::mat4 transform;
+            bool placed = false;
+        };
+        std::vector<SceneInstance> _scene_instances;  // By instance id - 1
+        std::unordered_map<uint32_t, GPULightData> _light_instances;   // By light id
+        bool _lights_dirty = false;
+
+        // Instance surface behind each entry of the draw context lists, updated when entries move
+        struct SurfaceOwner {
+            uint32_t instance;
+            uint32_t surface;
+        };
+        std::vector<SurfaceOwner> _opaque_owners;
+        std::vector<SurfaceOwner> _masked_owners;
+        std::vector<SurfaceOwner> _transparent_owners;
+        std::vector<SurfaceOwner>& surface_owners(const std::vector<RenderObject>& list);
+
+        // Object records of every surface, only the dirty ones are uploaded
+        std::vector<GPUObjectData> _scene_objects;
+        std::vector<uint32_t> _free_objects;
+        std::vector<uint32_t> _dirty_objects;
+        fmvk::Buffer::AllocatedBuffer _object_buffer {};
+        uint32_t _object_capacity = 0;
+
+        void set_instance_transform(SceneInstance& instance, const glm::mat4& transform);
+        bool place_instance(SceneInstance& instance, const glm::mat4& transform);
+        void mark_objects_dirty(const SceneInstance& instance);
+        void upload_scene_objects(VkCommandBuffer cmd);
+
         // ----------------------
         // End of TODO
  
         void init_imgui();
-        void draw_imgui(VkCommandBuffer cmd, VkImageView image_view) const;
+        void draw_imgui(VkCommandBuffer cmd, VkImageView image_view, ImDrawData* ui_draw_data) const;
         void draw_background(VkCommandBuffer cmd);
-        void draw_geometry(VkCommandBuffer cmd, RenderObject* render_objects, uint32_t render_object_count);
+
+        // Geometry is recorded by several graph passes, prepare_geometry() sets up what they share
+        enum class GeometryPass : uint8_t {
+            EARLY,   // Opaque surfaces that were visible last time, only depth with the prepass on
+            LATE,    // Opaque surfaces the occlusion cull found visible
+            SHADING  // Prepass shading, masked and transparent surfaces
+        };
+        struct GeometryFrame {
+            VkDescriptorSet global_descriptor;
+            bool use_prepass;
+            bool use_occlusion;  // The depth pyramid, occlusion cull and late pass run this frame
+        };
+        GeometryFrame _geometry_frame {};
+        void prepare_geometry(VkCommandBuffer cmd);
+        void draw_geometry(VkCommandBuffer cmd, GeometryPass pass);
+
+        // Draw lists of the last build with the indirect data of their draws. They are valid while the
+        // camera, the surfaces, their occlusion visibility and the pipelines stay the same. Moved
+        // surfaces are patched in as long as they stay on the same side of the frustum
+        struct DrawListCache {
+            uint64_t build = 0;
+            uint64_t generation = 0;
+            glm::mat4 view_projection {};
+            bool use_occlusion = false;
+
+            std::vector<uint32_t> opaque_draws;
+            std::vector<uint32_t> late_draws;
+            std::vector<uint32_t> masked_draws;
+            std::vector<uint32_t> transparent_draws;
+
+            std::vector<uint8_t> opaque_visible;     // Frustum test of each surface
+            std::vector<uint8_t> masked_visible;
+            std::vector<uint32_t> opaque_candidate;  // Occlusion candidate of each opaque surface, UINT32_MAX if none
+
+            std::vector<GPUDrawData> draw_data;
+            std::vector<VkDrawIndexedIndirectCommand> draw_commands;
+            std::vector<uint32_t> occlusion_candidates;  // Opaque surface of each candidate
+            std::vector<GPUOcclusionObject> occlusion_objects;
+            std::vector<VkDrawIndexedIndirectCommand> occlusion_commands;
+        };
+        DrawListCache _draw_cache;
+        uint64_t _draw_generation = 1;  // Bumped by every change the draw lists depend on, other than the camera and moves
+        std::vector<uint32_t> _moved_instances;  // Instance indices moved since the lists were built
+        void build_draw_lists(const glm::mat4& view_projection, bool use_occlusion);
+        bool patch_draw_lists(const glm::mat4& view_projection);
+        void reserve_draw_buffers(FrameData& frame, uint32_t draw_count);
+        void read_gpu_timings(FrameData& frame);
+
+        // Lights of the scene, directional ones first
+        std::vector<GPULightData> _scene_lights;
+        uint32_t _directional_light_count = 0;
+        VkDescriptorSetLayout _light_cluster_descriptor_layout {};
+        uint32_t _cluster_index_demand = 0;  // Light index list size the clusters asked for, with some headroom
+        void read_light_cluster_usage(FrameData& frame);
+        void reserve_light_buffers(FrameData& frame, uint32_t light_count);
+        void cull_lights(VkCommandBuffer cmd, VkBuffer scene_buffer);
+
+        // Hierarchical depth buffer
+        fmvk::Image::AllocatedImage _depth_pyramid {};
+        std::vector<VkImageView> _depth_pyramid_mips;
+        VkExtent2D _depth_pyramid_extent {};
+        VkSampler _depth_reduction_sampler {};
+        VkDescriptorSetLayout _depth_pyramid_descriptor_layout {};
+        VkDescriptorSetLayout _occlusion_cull_descriptor_layout {};
+
+        // Visibility of each opaque surface as of the last read back frame
+        std::vector<uint8_t> _occlusion_visible;
+        uint64_t _surface_generation = 0;  // Bumped whenever surfaces are added to or removed from the lists
+        void read_occlusion_results(FrameData& frame);
+        void reserve_occlusion_buffers(FrameData& frame, uint32_t object_count);
+        void build_depth_pyramid(VkCommandBuffer cmd);
+        void cull_occluded(VkCommandBuffer cmd, uint32_t object_count);
 
 
         // Descriptor sets
         DescriptorAllocatorGrowable global_descriptor_allocator;
-        VkDescriptorSet _draw_image_descriptors{};
         VkDescriptorSetLayout _draw_image_descriptor_layout{};
         void init_descriptors();
 
@@ -253,7 +576,16 @@ namespace fmvk {
         // Images & Textures
     public:
         fmvk::TextureCache texture_cache;
+
+        // Constants of every material, in one storage buffer indexed by MaterialInstance::material_index
+        uint32_t add_material_constants(const GLTFMetallic_Roughness::MaterialConstants& constants);
+        void remove_material_constants(uint32_t material_index);
     private:
+        std::vector<GLTFMetallic_Roughness::MaterialConstants> _material_constants;
+        std::vector<uint32_t> _free_material_indices;
+        fmvk::Buffer::AllocatedBuffer _material_buffer {};
+        uint32_t _material_capacity = 0;
+
         void init_default_textures();
         void init_default_data();
     };
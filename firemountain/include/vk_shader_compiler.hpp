@@ -0,0 +1,63 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+
+#include <slang.h>
+#include <slang-com-ptr.h>
+
+namespace fmvk {
+    // Compiles the Slang sources of a directory to SPIR-V in process, one {module}_{stage}.spv per entry point.
+    // Only modules whose source or imports changed since the last build are compiled again, and the
+    // SPIR-V is cached on disk by the hash of everything that went into it.
+    struct ShaderCompiler {
+        void init(const std::filesystem::path& source_dir, const std::filesystem::path& output_dir, const std::filesystem::path& cache_dir);
+        void destroy();
+
+        // Compile the changed modules in parallel, returns true if any of the outputs changed
+        bool build();
+
+        // Poll the sources on a background thread, sources_changed() then tells when a build is due
+        void start_watching(std::chrono::milliseconds interval = std::chrono::milliseconds(250));
+        void stop_watching();
+        bool sources_changed() { return this->changed.exchange(false); }
+
+    private:
+        using WriteTimes = std::unordered_map<std::string, std::filesystem::file_time_type>;
+
+        // Files a module was built from and their write times at the time
+        struct ModuleState {
+            WriteTimes dependencies;
+        };
+
+        struct ModuleResult {
+            std::string name;
+            bool compiled = false;
+            bool outputs_changed = false;
+            ModuleState state;
+        };
+
+        bool is_dirty(const std::string& module_name) const;
+        ModuleResult build_module(slang::IGlobalSession* global_session, const std::string& module_name) const;
+        WriteTimes source_write_times() const;
+
+        std::filesystem::path source_dir;
+        std::filesystem::path output_dir;
+        std::filesystem::path cache_dir;
+
+        std::unordered_map<std::string, ModuleState> modules;
+
+        // A global session can only be used by one thread at a time, every build worker has its own
+        std::vector<Slang::ComPtr<slang::IGlobalSession>> global_sessions;
+        std::mutex build_mutex;
+
+        std::jthread watcher;
+        std::atomic<bool> changed = false;
+    };
+}
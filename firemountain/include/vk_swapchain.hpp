@@ -6,7 +6,7 @@
 
 namespace fmvk {
     struct Swapchain {
-        VkSwapchainKHR swapchain;
+        VkSwapchainKHR swapchain = VK_NULL_HANDLE;
 
         VkExtent2D extent;
         VkFormat image_format;
@@ -66,23 +66,39 @@ struct GPUSceneData {
     glm::vec3 camera_position = glm::vec3 { 0.0f };
     unsigned int light_count;
 
-    GPULightData lights[32];
+    // Cluster grid size in .xyz, number of directional lights at the start of the light buffer in .w
+    glm::uvec4 cluster_grid = glm::uvec4 { 0 };
+
+    // .x near and .y far depth of the cluster slices, .zw viewport size
+    glm::vec4 cluster_params = glm::vec4 { 0.0f };
 };
 
 enum class MaterialPass : uint8_t {
     FM_MATERIAL_PASS_OPAQUE,
     FM_MATERIAL_PASS_TRANSPARENT,
-    FM_MATERIAL_PASS_OTHER
+    FM_MATERIAL_PASS_OTHER  // Alpha masked, drawn after the opaque geometry
+};
+
+// Material features the pixel shader is specialized for, bit i is specialization constant i
+enum MaterialFeature : uint32_t {
+    FM_MATERIAL_FEATURE_COLOR_MAP = 1 << 0,
+    FM_MATERIAL_FEATURE_METAL_ROUGHNESS_MAP = 1 << 1,
+    FM_MATERIAL_FEATURE_NORMAL_MAP = 1 << 2,
+    FM_MATERIAL_FEATURE_EMISSIVE_MAP = 1 << 3,
+    FM_MATERIAL_FEATURE_ALPHA_BLENDING = 1 << 4,
+    FM_MATERIAL_FEATURE_ALPHA_MASK = 1 << 5
 };
+constexpr uint32_t FM_MATERIAL_FEATURE_COUNT = 6;
 
 struct MaterialPipeline {
-    VkPipeline pipeline;
-    VkPipelineLayout layout;
+    VkPipeline pipeline {};
+    VkPipelineLayout layout {};
 };
 
 struct MaterialInstance {
     MaterialPipeline* pipeline;
-    VkDescriptorSet material_set;
+    MaterialPipeline* depth_equal_pipeline;  // Shading after a depth prepass
+    uint32_t material_index;  // Constants in the renderer's material buffer
     MaterialPass pass_type;
 };
 
@@ -91,6 +107,12 @@ struct MeshID {
     uint32_t id;
 };
 
+// Placed instance of a mesh in the renderer's scene
+struct InstanceID {
+    operator bool() const noexcept { return id != 0; }
+    uint32_t id;
+};
+
 struct ShaderID {
     operator bool() const noexcept { return id != 0; }
     uint32_t id;
@@ -102,13 +124,3 @@ struct fmCamera {
     glm::mat4 projection;
     bool debug_pov_lock = false;
 };
-
-struct RenderSceneObj {
-    MeshID mesh_id;
-    glm::mat4 transform;
-
-    LightID light_id;
-    glm::vec4 light_position_type;
-    glm::vec4 light_color_intensity;
-    glm::vec4 light_direction_range;
-};
@@ -10,32 +10,167 @@
 
 
 int Firemountain::Init(const int width, const int height, SDL_Window* window) {
+    this->_jobs.init();
+    this->vulkan.jobs = &this->_jobs;
     this->vulkan.Init(width, height, window);
     return 0;
 }
 
-void Firemountain::Frame(const fmCamera* camera, std::vector<RenderSceneObj> render_scene)
+void Firemountain::Frame(const fmCamera* camera)
 {
-    this->vulkan.update_scene(camera, render_scene);
-    this->vulkan.Draw(this->_renderables.data(), this->_renderables.size());
+    this->packet().camera = *camera;
+
+    if (!this->_render_thread.joinable()) {
+        build_ui();
+        render_frame(this->packet());
+        this->packet().clear();
+        return;
+    }
+
+    // Waits for the render thread to finish the previous packet before the next one gets written
+    {
+        std::unique_lock lock(this->_packet_mutex);
+        this->_packet_cv.wait(lock, [this]() { return !this->_packet_pending; });
+
+        // The render thread is idle until the packet is handed over, so the UI can read the renderer's stats
+        build_ui();
+
+        this->_packet_pending = true;
+        this->_write_packet ^= 1;
+    }
+    this->_packet_cv.notify_all();
+}
+
+void Firemountain::render_thread_main(std::stop_token stop)
+{
+    while (true) {
+        FramePacket* packet = nullptr;
+        {
+            std::unique_lock lock(this->_packet_mutex);
+            this->_packet_cv.wait(lock, stop, [this]() { return this->_packet_pending; });
+            if (!this->_packet_pending) {
+                return;  // Stopped
+            }
+            packet = &this->_packets[this->_write_packet ^ 1];
+        }
+
+        render_frame(*packet);
+        packet->clear();
+
+        {
+            std::lock_guard lock(this->_packet_mutex);
+            this->_packet_pending = false;
+        }
+        this->_packet_cv.notify_all();
+    }
+}
+
+void Firemountain::render_frame(FramePacket& packet)
+{
+    // Pipelines are reloaded once a shader build changed some of the SPIR-V
+    if (this->_shader_build.valid() && this->_shader_build.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+        if (this->_shader_build.get()) {
+            this->vulkan.reload_pipelines();
+        }
+    }
+    if (packet.compile_shaders || (!this->_shader_build.valid() && this->_shader_compiler.sources_changed())) {
+        start_shader_build();
+    }
+
+    if (packet.resize) {
+        this->vulkan.Resize(packet.resize->width, packet.resize->height);
+    }
+    if (packet.depth_prepass) {
+        this->vulkan.depth_prepass = *packet.depth_prepass;
+    }
+
+    for (const FramePacket::Command& command : packet.commands) {
+        std::visit([&](const auto& c) {
+            using T = std::decay_t<decltype(c)>;
+            if constexpr (std::is_same_v<T, FramePacket::CreateInstance>) {
+                this->vulkan.create_instance(c.instance, c.mesh, c.transform);
+            } else if constexpr (std::is_same_v<T, FramePacket::DestroyInstance>) {
+                this->vulkan.destroy_instance(c.instance);
+            } else if constexpr (std::is_same_v<T, FramePacket::SetTransforms>) {
+                this->vulkan.set_instance_transforms(
+                    std::span(packet.moved_instances).subspan(c.first, c.count),
+                    std::span(packet.moved_transforms).subspan(c.first, c.count));
+            } else if constexpr (std::is_same_v<T, FramePacket::SetLight>) {
+                this->vulkan.set_light(c.light, c.data);
+            } else if constexpr (std::is_same_v<T, FramePacket::RemoveLight>) {
+                this->vulkan.remove_light(c.light);
+            } else if constexpr (std::is_same_v<T, FramePacket::ClearScene>) {
+                this->vulkan.clear_scene();
+            }
+        }, command);
+    }
+
+    this->vulkan.update_scene(&packet.camera);
+    this->vulkan.Draw(packet.ui.get());
+}
+
+void Firemountain::build_ui()
+{
+    this->vulkan.build_ui();
+    this->packet().ui.copy(ImGui::GetDrawData());
+}
+
+void Firemountain::StartRenderThread()
+{
+    assert(!this->_render_thread.joinable());
+    this->_render_thread = std::jthread([this](std::stop_token stop) { render_thread_main(stop); });
+}
+
+void Firemountain::StopRenderThread()
+{
+    if (!this->_render_thread.joinable()) {
+        return;
+    }
+    // A packet handed over before the stop is still drawn
+    this->_render_thread.request_stop();
+    this->_render_thread.join();
+}
+
+void Firemountain::ClearScene()
+{
+    this->packet().commands.push_back(FramePacket::ClearScene {});
+
+    // Every instance is gone, ids start over
+    this->_instance_count = 0;
+    this->_free_instances.clear();
 }
 
 void Firemountain::Resize(const uint32_t width, const uint32_t height)
 {
-    this->vulkan.Resize(width, height);
+    this->packet().resize = VkExtent2D { width, height };
+}
+
+void Firemountain::SetDepthPrepass(const bool enabled)
+{
+    this->packet().depth_prepass = enabled;
 }
 
 void Firemountain::Destroy() {
+    StopRenderThread();
+    if (this->_shader_build.valid()) {
+        this->_shader_build.wait();
+    }
+    this->_shader_compiler.destroy();
     this->vulkan.Destroy();
     this->loaded_Scenes.clear();
+    this->_jobs.destroy();
 }
 
 void Firemountain::ProcessImGuiEvent(SDL_Event* e)
 {
+    // The UI is built on this thread too, so events go straight to ImGui while their strings are still valid
     this->vulkan.ProcessImGuiEvent(e);
 }
 
 MeshID Firemountain::AddMesh(const std::string& name, const char* path) {
+    // Uploads through the renderer's queue, which the render thread owns once it runs
+    assert(!this->_render_thread.joinable());
+
     // Should I move this to renderer?
     auto mesh_file = MeshLoader::load_GLTF(&this->vulkan, path);
     assert(mesh_file.has_value());
@@ -45,10 +180,49 @@ MeshID Firemountain::AddMesh(const std::string& name, const char* path) {
 
 LightID Firemountain::AddLight(const std::string &name)
 {
+    assert(!this->_render_thread.joinable());
     auto id = this->vulkan.AddLight(name);
     return id;
 }
 
+InstanceID Firemountain::CreateInstance(MeshID mesh, const glm::mat4& transform)
+{
+    InstanceID instance;
+    if (!this->_free_instances.empty()) {
+        instance = this->_free_instances.back();
+        this->_free_instances.pop_back();
+    } else {
+        instance = { ++this->_instance_count };
+    }
+    this->packet().commands.push_back(FramePacket::CreateInstance { instance, mesh, transform });
+    return instance;
+}
+
+void Firemountain::DestroyInstance(InstanceID instance)
+{
+    this->packet().commands.push_back(FramePacket::DestroyInstance { instance });
+    this->_free_instances.push_back(instance);
+}
+
+void Firemountain::SetTransforms(std::span<const InstanceID> instances, std::span<const glm::mat4> transforms)
+{
+    assert(instances.size() == transforms.size());
+    FramePacket& packet = this->packet();
+    packet.commands.push_back(FramePacket::SetTransforms { (uint32_t) packet.moved_instances.size(), (uint32_t) instances.size() });
+    packet.moved_instances.insert(packet.moved_instances.end(), instances.begin(), instances.end());
+    packet.moved_transforms.insert(packet.moved_transforms.end(), transforms.begin(), transforms.end());
+}
+
+void Firemountain::SetLight(LightID light, const GPULightData& data)
+{
+    this->packet().commands.push_back(FramePacket::SetLight { light, data });
+}
+
+void Firemountain::RemoveLight(LightID light)
+{
+    this->packet().commands.push_back(FramePacket::RemoveLight { light });
+}
+
 MaterialInstance* Firemountain::get_material(const std::string& name) {
     auto i = this->_materials.find(name);
     if (i == this->_materials.end()) {
@@ -58,9 +232,29 @@ MaterialInstance* Firemountain::get_material(const std::string& name) {
     }
 }
 
+void Firemountain::WatchShaders(const std::filesystem::path& source_dir) {
+    this->_shader_compiler.init(source_dir, "shaders", "shaders/cache");
+    this->_shader_compiler.start_watching();
+
+    // Brings the SPIR-V up to date with the sources, mostly from the cache
+    start_shader_build();
+}
+
 void Firemountain::CompileShaders() {
+    // Started by the renderer, which also owns the pipelines it reloads
+    this->packet().compile_shaders = true;
+}
+
+void Firemountain::start_shader_build() {
+    if (this->_shader_build.valid()) {
+        fmt::println("Shaders are still building, reload skipped");
+        return;
+    }
+
     fmt::println("Reloading shaders...");
 
-    // Clean and re-init pipelines
-    this->vulkan.init_pipelines();
+    // Built in the background, the current pipelines are used until the new ones are ready
+    this->_shader_build = std::async(std::launch::async, [this]() {
+        return this->_shader_compiler.build();
+    });
 }
@@ -0,0 +1,301 @@
+#include <cassert>
+#include <algorithm>
+
+#include "fm_job_system.hpp"
+
+
+namespace {
+    // Worker the thread runs, -1 on the threads that aren't workers
+    thread_local int32_t current_worker = -1;
+}
+
+void JobSystem::init(uint32_t worker_count)
+{
+    if (worker_count == 0) {
+        worker_count = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    }
+
+    this->main_thread = std::this_thread::get_id();
+    this->sampled_at = std::chrono::steady_clock::now();
+
+    for (uint32_t i = 0; i < worker_count; i++) {
+        this->workers.push_back(std::make_unique<Worker>());
+    }
+    for (uint32_t i = 0; i < worker_count; i++) {
+        this->threads.emplace_back([this, i](std::stop_token stop) { worker_main(i, stop); });
+    }
+}
+
+void JobSystem::destroy()
+{
+    for (std::jthread& thread : this->threads) {
+        thread.request_stop();
+    }
+    this->threads.clear();
+    this->workers.clear();
+    this->shared_jobs.clear();
+    this->main_jobs.clear();
+}
+
+void JobSystem::run(std::function<void()>&& function, JobCounter* counter)
+{
+    if (counter) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    push({ std::move(function), counter });
+}
+
+void JobSystem::run_after(JobCounter& dependency, std::function<void()>&& function, JobCounter* counter)
+{
+    if (counter) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    schedule_after(dependency, { std::move(function), counter });
+}
+
+void JobSystem::run_on_main(std::function<void()>&& function, JobCounter* counter)
+{
+    if (counter) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    push_main({ std::move(function), counter, true });
+}
+
+void JobSystem::run_on_main_after(JobCounter& dependency, std::function<void()>&& function, JobCounter* counter)
+{
+    if (counter) {
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    }
+    schedule_after(dependency, { std::move(function), counter, true });
+}
+
+void JobSystem::run_main_jobs()
+{
+    assert(std::this_thread::get_id() == this->main_thread);
+
+    while (true) {
+        Job job;
+        {
+            std::lock_guard lock(this->main_mutex);
+            if (this->main_jobs.empty()) {
+                return;
+            }
+            job = std::move(this->main_jobs.front());
+            this->main_jobs.pop_front();
+        }
+        execute(job, false);
+    }
+}
+
+void JobSystem::wait(JobCounter& counter)
+{
+    const bool on_main = std::this_thread::get_id() == this->main_thread;
+
+    while (!counter.done()) {
+        if (on_main) {
+            run_main_jobs();
+        }
+
+        Job job;
+        bool stolen = false;
+        if (pop(job, stolen)) {
+            execute(job, stolen);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    // The job that released the counter may still hold its lock
+    std::lock_guard lock(counter.mutex);
+}
+
+void JobSystem::parallel_for(uint32_t count, uint32_t min_batch, const std::function<void(uint32_t begin, uint32_t end)>& function)
+{
+    if (count == 0) {
+        return;
+    }
+
+    // A few ranges per thread, so the ones that finish early can steal from the others
+    const uint32_t thread_count = this->workers.size() + 1;
+    const uint32_t batch = std::max({ 1u, min_batch, (count + thread_count * 4 - 1) / (thread_count * 4) });
+    if (this->workers.empty() || count <= batch) {
+        function(0, count);
+        return;
+    }
+
+    JobCounter counter;
+    for (uint32_t begin = batch; begin < count; begin += batch) {
+        const uint32_t end = std::min(count, begin + batch);
+        run([&function, begin, end]() { function(begin, end); }, &counter);
+    }
+    function(0, batch);
+    wait(counter);
+}
+
+std::vector<JobSystem::WorkerStats> JobSystem::sample_stats()
+{
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->sampled_at).count();
+    this->sampled_at = now;
+
+    std::vector<WorkerStats> stats;
+    stats.reserve(this->workers.size());
+    for (const auto& worker : this->workers) {
+        const uint64_t busy_ns = worker->busy_ns.load(std::memory_order_relaxed);
+        stats.push_back({
+            .jobs = worker->job_count.load(std::memory_order_relaxed),
+            .steals = worker->steal_count.load(std::memory_order_relaxed),
+            .utilization = elapsed_ns > 0 ? (float) (busy_ns - worker->sampled_busy_ns) / (float) elapsed_ns : 0.0f
+        });
+        worker->sampled_busy_ns = busy_ns;
+    }
+    return stats;
+}
+
+void JobSystem::worker_main(uint32_t index, std::stop_token stop)
+{
+    current_worker = index;
+
+    while (!stop.stop_requested()) {
+        Job job;
+        bool stolen = false;
+        if (pop(job, stolen)) {
+            execute(job, stolen);
+            continue;
+        }
+
+        std::unique_lock lock(this->sleep_mutex);
+        this->sleep_cv.wait(lock, stop, [this]() { return this->queued.load(std::memory_order_relaxed) > 0; });
+    }
+}
+
+void JobSystem::push(Job&& job)
+{
+    // Counted before the job is visible, so a pop never takes the count below zero
+    {
+        std::lock_guard lock(this->sleep_mutex);
+        this->queued.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (current_worker >= 0) {
+        Worker& worker = *this->workers[current_worker];
+        std::lock_guard lock(worker.mutex);
+        worker.jobs.push_back(std::move(job));
+    } else {
+        std::lock_guard lock(this->shared_mutex);
+        this->shared_jobs.push_back(std::move(job));
+    }
+    this->sleep_cv.notify_one();
+}
+
+void JobSystem::push_main(Job&& job)
+{
+    std::lock_guard lock(this->main_mutex);
+    this->main_jobs.push_back(std::move(job));
+}
+
+void JobSystem::schedule_after(JobCounter& dependency, Job&& job)
+{
+    {
+        std::lock_guard lock(dependency.mutex);
+        if (dependency.pending.load(std::memory_order_acquire) != 0) {
+            dependency.dependents.push_back(std::move(job));
+            return;
+        }
+    }
+
+    if (job.on_main) {
+        push_main(std::move(job));
+    } else {
+        push(std::move(job));
+    }
+}
+
+bool JobSystem::pop(Job& job, bool& stolen)
+{
+    auto take = [&](std::mutex& mutex, std::deque<Job>& jobs, bool from_back) {
+        std::lock_guard lock(mutex);
+        if (jobs.empty()) {
+            return false;
+        }
+        if (from_back) {
+            job = std::move(jobs.back());
+            jobs.pop_back();
+        } else {
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        this->queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    };
+
+    // Own jobs newest first, they are the most likely to still be in cache
+    if (current_worker >= 0) {
+        Worker& worker = *this->workers[current_worker];
+        if (take(worker.mutex, worker.jobs, true)) {
+            return true;
+        }
+    }
+    if (take(this->shared_mutex, this->shared_jobs, false)) {
+        return true;
+    }
+
+    // Steal the oldest jobs of the others, starting from the next worker to spread the thieves
+    const uint32_t worker_count = this->workers.size();
+    const uint32_t first = current_worker >= 0 ? current_worker + 1 : 0;
+    for (uint32_t i = 0; i < worker_count; i++) {
+        const uint32_t victim = (first + i) % worker_count;
+        if ((int32_t) victim == current_worker) {
+            continue;
+        }
+        if (take(this->workers[victim]->mutex, this->workers[victim]->jobs, false)) {
+            stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::execute(Job& job, bool stolen)
+{
+    if (current_worker < 0) {
+        job.function();
+        release(job.counter);
+        return;
+    }
+
+    Worker& worker = *this->workers[current_worker];
+    const auto start = std::chrono::steady_clock::now();
+    job.function();
+    const auto end = std::chrono::steady_clock::now();
+
+    worker.busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+    worker.job_count.fetch_add(1, std::memory_order_relaxed);
+    if (stolen) {
+        worker.steal_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    release(job.counter);
+}
+
+void JobSystem::release(JobCounter* counter)
+{
+    if (!counter) {
+        return;
+    }
+
+    // Released under the lock, so run_after() either sees the count above zero or queues the job itself
+    std::vector<Job> dependents;
+    {
+        std::lock_guard lock(counter->mutex);
+        if (counter->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            dependents.swap(counter->dependents);
+        }
+    }
+    for (Job& dependent : dependents) {
+        if (dependent.on_main) {
+            push_main(std::move(dependent));
+        } else {
+            push(std::move(dependent));
+        }
+    }
+}
@@ -49,52 +49,50 @@ VkSamplerMipmapMode extract_mipmap_mode(fastgltf::Filter filter) {
 }
 
 
-std::optional<fmvk::Image::AllocatedImage> load_image(fmvk::Vulkan* engine, fastgltf::Asset& asset, fastgltf::Image& image, std::filesystem::path working_dir) {
-    fmvk::Image::AllocatedImage new_image {};
+// RGBA8 pixels decoded by stb_image, null data when the image couldn't be read
+struct DecodedImage {
+    unsigned char* data = nullptr;
+    VkExtent3D extent {};
+};
+
+// Only reads the asset, so images are decoded on the job workers
+DecodedImage decode_image(const fastgltf::Asset& asset, const fastgltf::Image& image, const std::filesystem::path& working_dir) {
+    DecodedImage decoded {};
     int width, height, nr_channels;
 
+    auto set_extent = [&]() {
+        decoded.extent = {
+            .width = (uint32_t) width,
+            .height = (uint32_t) height,
+            .depth = 1
+        };
+    };
+
     std::visit(fastgltf::visitor {
-        [](auto& arg) {},
-        [&](fastgltf::sources::URI& file_path) {
+        [](const auto& arg) {},
+        [&](const fastgltf::sources::URI& file_path) {
             assert(file_path.fileByteOffset == 0);
             assert(file_path.uri.isLocalPath());
 
-            const std::string path(file_path.uri.path().begin(), file_path.uri.path().end());
             auto full_path = working_dir / file_path.uri.fspath();
             // fmt::println("* Loading image: {}", full_path.string());
-            unsigned char* data = stbi_load(full_path.c_str(), &width, &height, &nr_channels, 4);
-            if (data) {
-                VkExtent3D image_size = {
-                    .width = (uint32_t) width,
-                    .height = (uint32_t) height,
-                    .depth = 1
-                };
-                new_image = engine->create_image(data, image_size, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-                stbi_image_free(data);
-            }
+            decoded.data = stbi_load(full_path.c_str(), &width, &height, &nr_channels, 4);
+            set_extent();
         },
-        [&](fastgltf::sources::Array& vector) {
-            unsigned char* data = stbi_load_from_memory(
+        [&](const fastgltf::sources::Array& vector) {
+            decoded.data = stbi_load_from_memory(
                 reinterpret_cast<const stbi_uc*>(vector.bytes.data()),
                 static_cast<int>(vector.bytes.size()),
                 &width, &height, &nr_channels, 4);
-            if (data) {
-                VkExtent3D image_size = {
-                    .width = (uint32_t) width,
-                    .height = (uint32_t) height,
-                    .depth = 1
-                };
-                new_image = engine->create_image(data, image_size, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-                stbi_image_free(data);
-            }
+            set_extent();
         },
-        [&](fastgltf::sources::BufferView& view) {
+        [&](const fastgltf::sources::BufferView& view) {
             auto& buffer_view = asset.bufferViews[view.bufferViewIndex];
             auto& buffer = asset.buffers[buffer_view.bufferIndex];
             std::visit(fastgltf::visitor {
-                [](auto& arg) {},
-                [&](fastgltf::sources::Array& vector) {
-                    unsigned char* data = stbi_load_from_memory(
+                [](const auto& arg) {},
+                [&](const fastgltf::sources::Array& vector) {
+                    decoded.data = stbi_load_from_memory(
                         reinterpret_cast<const stbi_uc *>(vector.bytes.data() + buffer_view.byteOffset),
                         static_cast<int>(buffer_view.byteLength),
                         &width,
@@ -102,26 +100,23 @@ std::optional<fmvk::Image::AllocatedImage> load_image(fmvk::Vulkan* engine, fast
                         &nr_channels,
                         4
                     );
-                    if (data) {
-                        VkExtent3D image_size = {
-                            .width = (uint32_t) width,
-                            .height = (uint32_t) height,
-                            .depth = 1
-                        };
-                        new_image = engine->create_image(data, image_size, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
-                        stbi_image_free(data);
-                    }
+                    set_extent();
                 }
             }, buffer.data);
         },
     }, image.data);
 
-    if (new_image.image == VK_NULL_HANDLE) {
-        destroy_image(new_image, engine->_device, engine->_allocator);
+    return decoded;
+}
+
+// Creates the image on the GPU and frees the pixels, has to stay on the thread that submits to the GPU
+std::optional<fmvk::Image::AllocatedImage> upload_image(fmvk::Vulkan* engine, const DecodedImage& decoded) {
+    if (!decoded.data) {
         return {};
-    } else {
-        return new_image;
     }
+    fmvk::Image::AllocatedImage new_image = engine->create_image(decoded.data, decoded.extent, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT, true);
+    stbi_image_free(decoded.data);
+    return new_image;
 }
 
 std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* engine, std::string_view file_path) {
@@ -172,12 +167,137 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
         return {};
     }
 
-    std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> sizes = {
-        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4},
-        {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3},
-        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}
+    // Meshes and textures are decoded on the job workers while the rest is set up here.
+    // What goes to the GPU is uploaded on this thread, each upload runs after its decode
+    struct DecodedMesh {
+        std::vector<uint32_t> indices;
+        std::vector<Vertex> vertices;
+        std::vector<size_t> surface_materials;
     };
-    file.descriptor_pool.init(engine->_device, gltf.materials.size(), sizes);
+    std::vector<std::shared_ptr<MeshAsset>> meshes;
+    std::vector<DecodedMesh> decoded_meshes(gltf.meshes.size());
+    std::vector<JobCounter> meshes_decoded(gltf.meshes.size());
+    JobCounter meshes_loaded;
+    for (size_t m = 0; m < gltf.meshes.size(); m++) {
+        std::shared_ptr<MeshAsset> new_mesh = std::make_shared<MeshAsset>();
+        meshes.push_back(new_mesh);
+        file.meshes[gltf.meshes[m].name.c_str()] = new_mesh;
+        new_mesh->name = gltf.meshes[m].name;
+
+        engine->jobs->run([&, m, new_mesh]() {
+            fastgltf::Mesh& mesh = gltf.meshes[m];
+            DecodedMesh& decoded = decoded_meshes[m];
+            std::vector<uint32_t>& indices = decoded.indices;
+            std::vector<Vertex>& vertices = decoded.vertices;
+            for (auto&& p : mesh.primitives) {
+                GeoSurface new_surface;
+                new_surface.start_index = (uint32_t) indices.size();
+                new_surface.count = (uint32_t) gltf.accessors[p.indicesAccessor.value()].count;
+                size_t initial_vertex = vertices.size();
+
+                {   // Load indices
+                    fastgltf::Accessor& index_accessor = gltf.accessors[p.indicesAccessor.value()];
+                    indices.reserve(indices.size() + index_accessor.count);
+                    fastgltf::iterateAccessor<uint32_t>(gltf, index_accessor,
+                        [&](uint32_t idx) {
+                            indices.push_back(idx + initial_vertex);
+                    });
+                }
+
+                {   // Load vertex positions
+                    fastgltf::Accessor& position_accessor = gltf.accessors[p.findAttribute("POSITION")->accessorIndex];
+                    vertices.resize(vertices.size() + position_accessor.count);
+                    fastgltf::iterateAccessorWithIndex<glm::vec3>(gltf, position_accessor,
+                        [&](glm::vec3 v, size_t index) {
+                            Vertex new_vertex = {
+                                .position = v,
+                                .uv_x = 0.0f,
+                                .normal = { 1, 0, 0 },
+                                .uv_y = 0.0f,
+                                .color = glm::vec4 { 1.0f },
+                                .tangent = glm::vec4 { 0.0f }
+                            };
+                            vertices[initial_vertex + index] = new_vertex;
+                    });
+                }
+
+                // Load vertex normals
+                auto normals = p.findAttribute("NORMAL");
+                if (normals != p.attributes.end()) {
+                    fastgltf::iterateAccessorWithIndex<glm::vec3>(gltf, gltf.accessors[normals->accessorIndex],
+                    [&](glm::vec3 v, size_t index) {
+                        vertices[initial_vertex + index].normal = v;
+                    });
+                }
+
+                // Load tangents
+                auto tangents = p.findAttribute("TANGENT");
+                if (tangents != p.attributes.end()) {
+                    fastgltf::iterateAccessorWithIndex<glm::vec4>(gltf, gltf.accessors[tangents->accessorIndex],
+                    [&](glm::vec4 t, size_t index) {
+                        vertices[initial_vertex + index].tangent = t;
+                    });
+                }
+
+                // Load UVs
+                auto uv = p.findAttribute("TEXCOORD_0");
+                if (uv != p.attributes.end()) {
+                    fastgltf::iterateAccessorWithIndex<glm::vec2>(gltf, gltf.accessors[uv->accessorIndex],
+                    [&](glm::vec2 uv, size_t index) {
+                        vertices[initial_vertex + index].uv_x = uv.x;
+                        vertices[initial_vertex + index].uv_y = uv.y;
+                    });
+                }
+
+                auto colors = p.findAttribute("COLOR_0");
+                if (colors != p.attributes.end()) {
+                    fastgltf::iterateAccessorWithIndex<glm::vec4>(gltf, gltf.accessors[colors->accessorIndex],
+                    [&](glm::vec4 c, size_t index) {
+                        vertices[initial_vertex + index].color = c;
+                    });
+                }
+
+
+                // Materials are created meanwhile, they are assigned once everything is in
+                decoded.surface_materials.push_back(p.materialIndex.has_value() ? p.materialIndex.value() : 0);
+
+                // Calculate bounds for culling
+                glm::vec3 min_pos = vertices[initial_vertex].position;
+                glm::vec3 max_pos = vertices[initial_vertex].position;
+                for (size_t i = initial_vertex; i < vertices.size(); i++) {
+                    min_pos = glm::min(min_pos, vertices[i].position);
+                    max_pos = glm::max(max_pos, vertices[i].position);
+                }
+                new_surface.bounds = {
+                    .origin = (max_pos + min_pos) / 2.0f,
+                    .sphere_radius = glm::length(new_surface.bounds.extents),
+                    .extents = (max_pos - min_pos) / 2.0f
+                };
+
+                new_mesh->surfaces.push_back(new_surface);
+            }
+        }, &meshes_decoded[m]);
+
+        engine->jobs->run_on_main_after(meshes_decoded[m], [&, m, new_mesh]() {
+            DecodedMesh& decoded = decoded_meshes[m];
+            new_mesh->mesh_buffers = engine->UploadMesh(decoded.vertices, decoded.indices);
+            decoded.vertices = {};
+            decoded.indices = {};
+        }, &meshes_loaded);
+    }
+
+    std::vector<DecodedImage> decoded_images(gltf.images.size());
+    std::vector<std::optional<fmvk::Image::AllocatedImage>> loaded_images(gltf.images.size());
+    std::vector<JobCounter> images_decoded(gltf.images.size());
+    JobCounter images_loaded;
+    for (size_t i = 0; i < gltf.images.size(); i++) {
+        engine->jobs->run([&, i]() {
+            decoded_images[i] = decode_image(gltf, gltf.images[i], working_dir);
+        }, &images_decoded[i]);
+        engine->jobs->run_on_main_after(images_decoded[i], [&, i]() {
+            loaded_images[i] = upload_image(engine, decoded_images[i]);
+        }, &images_loaded);
+    }
 
     for (fastgltf::Sampler& sampler : gltf.samplers) {
         VkSamplerCreateInfo sampler_info = {
@@ -199,15 +319,15 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
     }
 
     // Temporary containers to load everything into
-    std::vector<std::shared_ptr<MeshAsset>> meshes;
-    std::vector<std::shared_ptr<Node>> nodes;
     std::vector<fmvk::Image::AllocatedImage> images;
     std::vector<std::shared_ptr<GLTFMaterial>> materials;
 
     // Load textures
+    engine->jobs->wait(images_loaded);
     int image_idx = 0;
-    for (fastgltf::Image& image : gltf.images) {
-        std::optional<fmvk::Image::AllocatedImage> img = load_image(engine, gltf, image, working_dir);
+    for (size_t i = 0; i < gltf.images.size(); i++) {
+        fastgltf::Image& image = gltf.images[i];
+        const std::optional<fmvk::Image::AllocatedImage>& img = loaded_images[i];
         if (img.has_value()) {
             // Generate a name if image doesn't have one to avoid overwrites and assure proper unloading
             // since the images are stored in a map
@@ -223,16 +343,6 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
         }
     }
 
-    // TODO: need to "publish" the buffer creation function and GLTF Materials
-    file.material_data_buffer = fmvk::Buffer::create_buffer(
-        sizeof(fmvk::GLTFMetallic_Roughness::MaterialConstants) * gltf.materials.size(),
-        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VMA_MEMORY_USAGE_CPU_TO_GPU,
-        engine->_allocator
-    );
-    int data_index = 0;
-    auto scene_material_constants = static_cast<fmvk::GLTFMetallic_Roughness::MaterialConstants *>(file.material_data_buffer.info.pMappedData);
-
     for (fastgltf::Material& mat : gltf.materials) {
         std::shared_ptr<GLTFMaterial> new_material = std::make_shared<GLTFMaterial>();
         materials.push_back(new_material);
@@ -245,22 +355,30 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
                 mat.pbrData.baseColorFactor[2],
                 mat.pbrData.baseColorFactor[3],
             },
-            .metal_roughness_factors = glm::vec2 {
-                mat.pbrData.metallicFactor,
-                mat.pbrData.roughnessFactor
-            },
             .emissive_factor = glm::vec4 {
                 mat.emissiveFactor[0],
                 mat.emissiveFactor[1],
                 mat.emissiveFactor[2],
                 mat.emissiveStrength
+            },
+            .metal_roughness_factors = glm::vec2 {
+                mat.pbrData.metallicFactor,
+                mat.pbrData.roughnessFactor
             }
         };
 
+        // Selects the specialized pipeline variant of the material
+        uint32_t features = 0;
+
         MaterialPass pass_type = MaterialPass::FM_MATERIAL_PASS_OPAQUE;
         if (mat.alphaMode == fastgltf::AlphaMode::Blend) {
             pass_type = MaterialPass::FM_MATERIAL_PASS_TRANSPARENT;
-            constants.use_alpha_blending = 1.0f;
+            features |= FM_MATERIAL_FEATURE_ALPHA_BLENDING;
+        }
+        else if (mat.alphaMode == fastgltf::AlphaMode::Mask) {
+            pass_type = MaterialPass::FM_MATERIAL_PASS_OTHER;
+            constants.alpha_cutoff = mat.alphaCutoff;
+            features |= FM_MATERIAL_FEATURE_ALPHA_MASK;
         }
 
         fmvk::GLTFMetallic_Roughness::MaterialResources material_resources = {
@@ -271,9 +389,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
             .normal_image = engine->_default_texture_black,
             .normal_sampler = engine->_default_sampler_linear,
             .emissive_image = engine->_default_texture_black,
-            .emissive_sampler = engine->_default_sampler_linear,
-            .data_buffer = file.material_data_buffer.buffer,
-            .data_buffer_offset = (uint32_t)(data_index * sizeof(fmvk::GLTFMetallic_Roughness::MaterialConstants))
+            .emissive_sampler = engine->_default_sampler_linear
         };
 
         if (mat.pbrData.baseColorTexture.has_value()) {
@@ -281,7 +397,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
             size_t sampler = gltf.textures[mat.pbrData.baseColorTexture.value().textureIndex].samplerIndex.value();
             material_resources.color_image = images[img];
             material_resources.color_sampler = file.samplers[sampler];
-            constants.has_color_map = 1.0;
+            features |= FM_MATERIAL_FEATURE_COLOR_MAP;
         }
         constants.color_tex_id = engine->texture_cache.add_texture(material_resources.color_image.view, material_resources.color_sampler).index;
 
@@ -290,7 +406,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
             size_t sampler = gltf.textures[mat.pbrData.metallicRoughnessTexture.value().textureIndex].samplerIndex.value();
             material_resources.metal_roughness_image = images[img];
             material_resources.metal_roughness_sampler = file.samplers[sampler];
-            constants.has_metal_roughness_map = 1.0;
+            features |= FM_MATERIAL_FEATURE_METAL_ROUGHNESS_MAP;
         }
         constants.metal_roughness_tex_id = engine->texture_cache.add_texture(material_resources.metal_roughness_image.view, material_resources.metal_roughness_sampler).index;
 
@@ -299,7 +415,7 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
             size_t sampler = gltf.textures[mat.normalTexture.value().textureIndex].samplerIndex.value();
             material_resources.normal_image = images[img];
             material_resources.normal_sampler = file.samplers[sampler];
-            constants.has_normal_map = 1.0;
+            features |= FM_MATERIAL_FEATURE_NORMAL_MAP;
         }
         constants.normal_tex_id = engine->texture_cache.add_texture(material_resources.normal_image.view, material_resources.normal_sampler).index;
 
@@ -308,142 +424,59 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
             size_t sampler = gltf.textures[mat.emissiveTexture.value().textureIndex].samplerIndex.value();
             material_resources.emissive_image = images[img];
             material_resources.emissive_sampler = file.samplers[sampler];
-            constants.has_emissive_map = 1.0;
+            features |= FM_MATERIAL_FEATURE_EMISSIVE_MAP;
         }
         constants.emissive_tex_id = engine->texture_cache.add_texture(material_resources.emissive_image.view, material_resources.emissive_sampler).index;
-        scene_material_constants[data_index] = constants;
+        uint32_t material_index = engine->add_material_constants(constants);
+        file.material_indices.push_back(material_index);
 
-        new_material->data = engine->metal_roughness_material.write_material(engine->_device, pass_type, material_resources, file.descriptor_pool);
-        data_index++;
+        new_material->data = engine->metal_roughness_material.write_material(pass_type, features, material_index);
     }
 
-    std::vector<uint32_t> indices;
-    std::vector<Vertex> vertices;
-    for (fastgltf::Mesh& mesh : gltf.meshes) {
-        std::shared_ptr<MeshAsset> new_mesh = std::make_shared<MeshAsset>();
-        meshes.push_back(new_mesh);
-        file.meshes[mesh.name.c_str()] = new_mesh;
-        new_mesh->name = mesh.name;
-
-        indices.clear();
-        vertices.clear();
-        for (auto&& p : mesh.primitives) {
-            GeoSurface new_surface;
-            new_surface.start_index = (uint32_t) indices.size();
-            new_surface.count = (uint32_t) gltf.accessors[p.indicesAccessor.value()].count;
-            size_t initial_vertex = vertices.size();
-
-            {   // Load indices
-                fastgltf::Accessor& index_accessor = gltf.accessors[p.indicesAccessor.value()];
-                indices.reserve(indices.size() + index_accessor.count);
-                fastgltf::iterateAccessor<uint32_t>(gltf, index_accessor,
-                    [&](uint32_t idx) {
-                        indices.push_back(idx + initial_vertex);
-                });
-            }
-
-            {   // Load vertex positions
-                fastgltf::Accessor& position_accessor = gltf.accessors[p.findAttribute("POSITION")->accessorIndex];
-                vertices.resize(vertices.size() + position_accessor.count);
-                fastgltf::iterateAccessorWithIndex<glm::vec3>(gltf, position_accessor,
-                    [&](glm::vec3 v, size_t index) {
-                        Vertex new_vertex = {
-                            .position = v,
-                            .uv_x = 0.0f,
-                            .normal = { 1, 0, 0 },
-                            .uv_y = 0.0f,
-                            .color = glm::vec4 { 1.0f },
-                            .tangent = glm::vec4 { 0.0f }
-                        };
-                        vertices[initial_vertex + index] = new_vertex;
-                });
-            }
-
-            // Load vertex normals
-            auto normals = p.findAttribute("NORMAL");
-            if (normals != p.attributes.end()) {
-                fastgltf::iterateAccessorWithIndex<glm::vec3>(gltf, gltf.accessors[normals->accessorIndex],
-                [&](glm::vec3 v, size_t index) {
-                    vertices[initial_vertex + index].normal = v;
-                });
-            }
-
-            // Load tangents
-            auto tangents = p.findAttribute("TANGENT");
-            if (tangents != p.attributes.end()) {
-                fastgltf::iterateAccessorWithIndex<glm::vec4>(gltf, gltf.accessors[tangents->accessorIndex],
-                [&](glm::vec4 t, size_t index) {
-                    vertices[initial_vertex + index].tangent = t;
-                });
-            }
-
-            // Load UVs
-            auto uv = p.findAttribute("TEXCOORD_0");
-            if (uv != p.attributes.end()) {
-                fastgltf::iterateAccessorWithIndex<glm::vec2>(gltf, gltf.accessors[uv->accessorIndex],
-                [&](glm::vec2 uv, size_t index) {
-                    vertices[initial_vertex + index].uv_x = uv.x;
-                    vertices[initial_vertex + index].uv_y = uv.y;
-                });
-            }
-
-            auto colors = p.findAttribute("COLOR_0");
-            if (colors != p.attributes.end()) {
-                fastgltf::iterateAccessorWithIndex<glm::vec4>(gltf, gltf.accessors[colors->accessorIndex],
-                [&](glm::vec4 c, size_t index) {
-                    vertices[initial_vertex + index].color = c;
-                });
-            }
-
-
-            if (p.materialIndex.has_value()) {
-                new_surface.material = materials[p.materialIndex.value()];
-            } else {
-                new_surface.material = materials[0];
-            }
+    engine->jobs->wait(meshes_loaded);
+    for (size_t m = 0; m < meshes.size(); m++) {
+        for (size_t i = 0; i < meshes[m]->surfaces.size(); i++) {
+            meshes[m]->surfaces[i].material = materials[decoded_meshes[m].surface_materials[i]];
+        }
+    }
 
-            // Calculate bounds for culling
-            glm::vec3 min_pos = vertices[initial_vertex].position;
-            glm::vec3 max_pos = vertices[initial_vertex].position;
-            for (size_t i = initial_vertex; i < vertices.size(); i++) {
-                min_pos = glm::min(min_pos, vertices[i].position);
-                max_pos = glm::max(max_pos, vertices[i].position);
-            }
-            new_surface.bounds = {
-                .origin = (max_pos + min_pos) / 2.0f,
-                .sphere_radius = glm::length(new_surface.bounds.extents),
-                .extents = (max_pos - min_pos) / 2.0f
-            };
+    file.mesh_list = meshes;
 
-            new_mesh->surfaces.push_back(new_surface);
+    // Parents of the glTF nodes, -1 for the top nodes
+    std::vector<int32_t> node_parents(gltf.nodes.size(), -1);
+    for (size_t i = 0; i < gltf.nodes.size(); i++) {
+        for (auto& c : gltf.nodes[i].children) {
+            node_parents[c] = i;
         }
-        new_mesh->mesh_buffers = engine->UploadMesh(vertices, indices);
     }
 
-    // Load nodes and their meshes
-    for (fastgltf::Node& node : gltf.nodes) {
-        std::shared_ptr<Node> new_node;
-
-        if (node.meshIndex.has_value()) {
-            new_node = std::make_shared<MeshNode>();
-            static_cast<MeshNode*>(new_node.get())->mesh = meshes[*node.meshIndex];
-        } else {
-            new_node = std::make_shared<Node>();
+    // The hierarchy is filled breadth first from the top nodes, so parents are always added before their children
+    std::vector<uint32_t> node_order;
+    node_order.reserve(gltf.nodes.size());
+    for (size_t i = 0; i < gltf.nodes.size(); i++) {
+        if (node_parents[i] < 0) {
+            node_order.push_back(i);
         }
+    }
+    for (size_t n = 0; n < node_order.size(); n++) {
+        for (auto& c : gltf.nodes[node_order[n]].children) {
+            node_order.push_back(c);
+        }
+    }
 
-        nodes.push_back(new_node);
-        file.nodes[node.name.c_str()];
+    // Load nodes and their meshes
+    std::vector<uint32_t> hierarchy_indices(gltf.nodes.size());
+    for (uint32_t node_index : node_order) {
+        fastgltf::Node& node = gltf.nodes[node_index];
+        glm::mat4 local_transform { 1.0f };
 
         std::visit(fastgltf::visitor {
             [&](fastgltf::math::fmat4x4 matrix) {
                 // Can't memcpy with -Werror because fastgltfs flat array based matrix
                 // doesn't implement a trivial copy-assignment to glm matrix
-                // memcpy(&new_node->local_transform, matrix.data(), sizeof(matrix));
-                //int i = 0;
                 for (int x = 0; x < 4; x++) {
-                    for (int y = 0; 0 < 4; y++) {
-                        new_node->local_transform[x][y] = matrix[x][y];
-                        //i++;
+                    for (int y = 0; y < 4; y++) {
+                        local_transform[x][y] = matrix[x][y];
                     }
                 }
             },
@@ -456,37 +489,61 @@ std::optional<std::shared_ptr<LoadedGLTF>> MeshLoader::load_GLTF(fmvk::Vulkan* e
                 glm::mat4 rm = glm::toMat4(r);
                 glm::mat4 sm = glm::scale(glm::mat4(1.0f), s);
 
-                new_node->local_transform = tm * rm * sm;
+                local_transform = tm * rm * sm;
             }
         }, node.transform);
+
+        const int32_t parent = node_parents[node_index] < 0 ? -1 : (int32_t) hierarchy_indices[node_parents[node_index]];
+        const int32_t mesh = node.meshIndex.has_value() ? *node.meshIndex : -1;
+        hierarchy_indices[node_index] = file.hierarchy.add_node(parent, local_transform, mesh);
+        file.nodes[node.name.c_str()] = hierarchy_indices[node_index];
     }
+    file.hierarchy.refresh_transforms();
 
-    // Setup transform hierarchy
-    for (size_t i = 0; i < gltf.nodes.size(); i++) {
-        fastgltf::Node& node = gltf.nodes[i];
-        std::shared_ptr<Node>& scene_node = nodes[i];
-        for (auto& c : node.children) {
-            scene_node->children.push_back(nodes[c]);
-            nodes[c]->parent = scene_node;
+    return scene;
+}
+
+void LoadedGLTF::Draw(const glm::mat4 &top_matrix, DrawContext &ctx)
+{
+    const NodeHierarchy& hierarchy = this->hierarchy;
+    for (size_t i = 0; i < hierarchy.meshes.size(); i++) {
+        if (hierarchy.meshes[i] < 0) {
+            continue;
         }
-    }
 
-    // Find the top nodes (nodes with no parents)
-    for (auto& node : nodes) {
-        if (node->parent.lock() == nullptr) {
-            file.top_nodes.push_back(node);
-            node->refresh_transform(glm::mat4 { 1.0f });
+        const MeshAsset& mesh = *this->mesh_list[hierarchy.meshes[i]];
+        const glm::mat4 node_matrix = top_matrix * hierarchy.world_transforms[i];
+        for (auto& s : mesh.surfaces) {
+            RenderObject object = {
+                .index_count = s.count,
+                .first_index = s.start_index,
+                .index_buffer = mesh.mesh_buffers.index_buffer.buffer,
+                .material = &s.material->data,
+                .bounds = s.bounds,
+                .transform = node_matrix,
+                .vertex_buffer_address = mesh.mesh_buffers.vertex_buffer_address,
+                .position_buffer_address = mesh.mesh_buffers.position_buffer_address
+            };
+
+            if (s.material->data.pass_type == MaterialPass::FM_MATERIAL_PASS_TRANSPARENT) {
+                ctx.transparent_surfaces.push_back(object);
+            } else if (s.material->data.pass_type == MaterialPass::FM_MATERIAL_PASS_OTHER) {
+                ctx.masked_surfaces.push_back(object);
+            } else {
+                ctx.opaque_surfaces.push_back(object);
+            }
         }
     }
-
-    return scene;
 }
 
-void LoadedGLTF::Draw(const glm::mat4 &top_matrix, DrawContext &ctx)
+const DrawContext& LoadedGLTF::get_surfaces()
 {
-    for (auto& n : this->top_nodes) {
-        n->Draw(top_matrix, ctx);
+    if (!this->surfaces_built) {
+        this->surfaces = {};
+        Draw(glm::mat4 { 1.0f }, this->surfaces);
+        this->surfaces_built = true;
     }
+    return this->surfaces;
 }
 
 void LoadedGLTF::clear_all()
@@ -496,6 +553,7 @@ void LoadedGLTF::clear_all()
     for (auto& [k, v] : this->meshes) {
         fmvk::Buffer::destroy_buffer(v->mesh_buffers.index_buffer, creator->_allocator);
         fmvk::Buffer::destroy_buffer(v->mesh_buffers.vertex_buffer, creator->_allocator);
+        fmvk::Buffer::destroy_buffer(v->mesh_buffers.position_buffer, creator->_allocator);
     }
 
     for (auto& [k, v] : this->images) {
@@ -510,6 +568,7 @@ void LoadedGLTF::clear_all()
         vkDestroySampler(device, sampler, nullptr);
     }
 
-    this->descriptor_pool.destroy_pools(device);
-    fmvk::Buffer::destroy_buffer(this->material_data_buffer, creator->_allocator);
+    for (uint32_t material_index : this->material_indices) {
+        creator->remove_material_constants(material_index);
+    }
 }
@@ -3,7 +3,11 @@
 
 
 void VKUtil::transition_image(VkCommandBuffer cmd, VkImage image, VkImageLayout current_layout, VkImageLayout new_layout) {
-    VkImageAspectFlags aspect_mask = (new_layout == VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL)
+    auto is_depth_layout = [](VkImageLayout layout) {
+        return layout == VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL
+            || layout == VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL;
+    };
+    VkImageAspectFlags aspect_mask = (is_depth_layout(new_layout) || is_depth_layout(current_layout))
         ? VK_IMAGE_ASPECT_DEPTH_BIT
         : VK_IMAGE_ASPECT_COLOR_BIT;
     
@@ -30,6 +34,30 @@ void VKUtil::transition_image(VkCommandBuffer cmd, VkImage image, VkImageLayout
     vkCmdPipelineBarrier2(cmd, &dependency_info);
 }
 
+void VKUtil::memory_barrier(
+    VkCommandBuffer cmd,
+    VkPipelineStageFlags2 src_stage, VkAccessFlags2 src_access,
+    VkPipelineStageFlags2 dst_stage, VkAccessFlags2 dst_access
+) {
+    VkMemoryBarrier2 barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2,
+        .pNext = nullptr,
+        .srcStageMask = src_stage,
+        .srcAccessMask = src_access,
+        .dstStageMask = dst_stage,
+        .dstAccessMask = dst_access
+    };
+
+    VkDependencyInfo dependency_info = {
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .pNext = nullptr,
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &barrier
+    };
+
+    vkCmdPipelineBarrier2(cmd, &dependency_info);
+}
+
 void VKUtil::copy_image_to_image(VkCommandBuffer cmd, VkImage src, VkImage dst, VkExtent2D src_size, VkExtent2D dst_size) {
     VkImageBlit2 blit_region = { 
         .sType = VK_STRUCTURE_TYPE_IMAGE_BLIT_2,
@@ -130,12 +130,12 @@ VkSemaphoreCreateInfo VKInit::samephore_create_info(VkSemaphoreCreateFlags flags
     return info;
 }
 
-VkSemaphoreSubmitInfo VKInit::semaphore_submit_info(VkPipelineStageFlags2 stage_mask, VkSemaphore semaphore) {
+VkSemaphoreSubmitInfo VKInit::semaphore_submit_info(VkPipelineStageFlags2 stage_mask, VkSemaphore semaphore, uint64_t value) {
     VkSemaphoreSubmitInfo info = {
         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_SUBMIT_INFO,
         .pNext = nullptr,
         .semaphore = semaphore,
-        .value = 1,
+        .value = value,
         .stageMask = stage_mask,
         .deviceIndex = 0
     };
@@ -145,10 +145,12 @@ VkSemaphoreSubmitInfo VKInit::semaphore_submit_info(VkPipelineStageFlags2 stage_
 VkSubmitInfo2 VKInit::submit_info(
     VkCommandBufferSubmitInfo* cmd, 
     VkSemaphoreSubmitInfo* signal_semaphore_info,
-    VkSemaphoreSubmitInfo* wait_semaphore_info
+    VkSemaphoreSubmitInfo* wait_semaphore_info,
+    uint32_t signal_semaphore_count,
+    uint32_t wait_semaphore_count
 ) {
-    uint32_t wait_semaphore_info_count = wait_semaphore_info == nullptr ? 0 : 1;
-    uint32_t signal_semaphore_info_count = signal_semaphore_info == nullptr ? 0 : 1;
+    uint32_t wait_semaphore_info_count = wait_semaphore_info == nullptr ? 0 : wait_semaphore_count;
+    uint32_t signal_semaphore_info_count = signal_semaphore_info == nullptr ? 0 : signal_semaphore_count;
     VkSubmitInfo2 info = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO_2,
         .pNext = nullptr,
@@ -228,14 +230,14 @@ VkRenderingAttachmentInfo VKInit::attachment_info(VkImageView view, VkClearValue
     return attachment;
 }
 
-VkRenderingAttachmentInfo VKInit::depth_attachment_info(VkImageView view, VkImageLayout layout)
+VkRenderingAttachmentInfo VKInit::depth_attachment_info(VkImageView view, VkImageLayout layout, VkAttachmentLoadOp load_op)
 {
     VkRenderingAttachmentInfo depth_info = {
         .sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO,
         .pNext = nullptr,
         .imageView = view,
         .imageLayout = layout,
-        .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+        .loadOp = load_op,
         .storeOp = VK_ATTACHMENT_STORE_OP_STORE
     };
     depth_info.clearValue.depthStencil.depth = 0.0f;
@@ -249,7 +251,7 @@ VkRenderingInfo VKInit::rendering_info(VkExtent2D render_extent, VkRenderingAtta
         .pNext = nullptr,
         .renderArea = VkRect2D { VkOffset2D {0, 0}, render_extent },
         .layerCount = 1,
-        .colorAttachmentCount = 1,
+        .colorAttachmentCount = color_attachment ? 1u : 0u,
         .pColorAttachments = color_attachment,
         .pDepthAttachment = depth_attachment,
         .pStencilAttachment = nullptr
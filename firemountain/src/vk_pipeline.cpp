@@ -121,12 +121,14 @@ void fmvk::Pipeline::Cleanup(const VkDevice device) {
     vkDestroyPipeline(device, this->pipeline, nullptr);
 }
 
-int fmvk::ComputePipeline::Init(const VkDevice device, const char *shader_name, VkDescriptorSetLayout descriptor_layout)
+int fmvk::ComputePipeline::Init(const VkDevice device, const char *shader_name, VkDescriptorSetLayout descriptor_layout, uint32_t push_constant_size)
 {
+    this->name = shader_name;
+
     VkPushConstantRange push_constants = {
         .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
         .offset = 0,
-        .size = sizeof(ComputePushConstants)
+        .size = push_constant_size
     };
 
     VkPipelineLayoutCreateInfo compute_layout = {
@@ -141,11 +143,12 @@ int fmvk::ComputePipeline::Init(const VkDevice device, const char *shader_name,
     VK_CHECK(vkCreatePipelineLayout(device, &compute_layout, nullptr, &this->layout));
 
     VkShaderModule compute_shader;
-    if (!load_shader_module("shaders/bg_gradient_compute.spv", device, &compute_shader)) {
-        fmt::println("Error building compute shader module");
+    auto shader_path = fmt::format("shaders/{}_compute.spv", shader_name);
+    if (!load_shader_module(shader_path.c_str(), device, &compute_shader)) {
+        fmt::println("Error building compute shader module ({})", shader_path);
     }
     else {
-        fmt::println("Compute shader module loaded.");
+        fmt::println("Compute shader module loaded ({}).", shader_path);
     }
 
     VkPipelineShaderStageCreateInfo stage_info = {
@@ -19,7 +19,7 @@ VkPipeline fmvk::PipelineBuilder::build_pipeline(VkDevice device)
         .pNext = nullptr,
         .logicOpEnable = VK_FALSE,
         .logicOp = VK_LOGIC_OP_COPY,
-        .attachmentCount = 1,
+        .attachmentCount = this->_render_info.colorAttachmentCount,
         .pAttachments = &this->_color_blend_attachment
     };
 
@@ -59,6 +59,129 @@ VkPipeline fmvk::PipelineBuilder::build_pipeline(VkDevice device)
     return pipeline;
 }
 
+VkPipeline fmvk::PipelineBuilder::build_library(VkDevice device, VkGraphicsPipelineLibraryFlagsEXT part)
+{
+    VkPipelineViewportStateCreateInfo viewport_state = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO,
+        .viewportCount = 1,
+        .pViewports = &this->viewport,
+        .scissorCount = 1,
+        .pScissors = &this->scissor,
+    };
+
+    VkPipelineColorBlendStateCreateInfo color_blending = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO,
+        .logicOpEnable = VK_FALSE,
+        .logicOp = VK_LOGIC_OP_COPY,
+        .attachmentCount = this->_render_info.colorAttachmentCount,
+        .pAttachments = &this->_color_blend_attachment
+    };
+
+    this->_vertex_input_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO
+    };
+
+    VkDynamicState state[] = {VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+    VkPipelineDynamicStateCreateInfo dynamic_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO,
+        .dynamicStateCount = 2,
+        .pDynamicStates = &state[0]
+    };
+
+    // Pre-rasterization takes the vertex stage, the fragment shader part the fragment stage
+    std::vector<VkPipelineShaderStageCreateInfo> stages;
+    for (const auto& stage : this->_shader_stages) {
+        const bool fragment = stage.stage == VK_SHADER_STAGE_FRAGMENT_BIT;
+        if ((fragment && part == VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT)
+            || (!fragment && part == VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT)) {
+            stages.push_back(stage);
+        }
+    }
+
+    VkGraphicsPipelineLibraryCreateInfoEXT library_info = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_LIBRARY_CREATE_INFO_EXT,
+        .pNext = &this->_render_info,
+        .flags = part
+    };
+
+    VkGraphicsPipelineCreateInfo pipeline_info = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = &library_info,
+        // Keep what the optimized link needs to optimize across the parts
+        .flags = VK_PIPELINE_CREATE_LIBRARY_BIT_KHR | VK_PIPELINE_CREATE_RETAIN_LINK_TIME_OPTIMIZATION_INFO_BIT_EXT,
+        .stageCount = (uint32_t) stages.size(),
+        .pStages = stages.data(),
+    };
+
+    switch (part) {
+        case VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT:
+            pipeline_info.pVertexInputState = &this->_vertex_input_info;
+            pipeline_info.pInputAssemblyState = &this->_input_assembly;
+            break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT:
+            pipeline_info.pViewportState = &viewport_state;
+            pipeline_info.pRasterizationState = &this->_rasterizer;
+            pipeline_info.pDynamicState = &dynamic_info;
+            pipeline_info.layout = this->_pipeline_layout;
+            break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT:
+            pipeline_info.pMultisampleState = &this->_multisampling;
+            pipeline_info.pDepthStencilState = &this->_depth_stencil;
+            pipeline_info.layout = this->_pipeline_layout;
+            break;
+        case VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT:
+            pipeline_info.pMultisampleState = &this->_multisampling;
+            pipeline_info.pColorBlendState = &color_blending;
+            break;
+    }
+
+    VkPipeline pipeline;
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline) != VK_SUCCESS) {
+        fmt::println("failed to create pipeline library");
+        return VK_NULL_HANDLE;
+    }
+    return pipeline;
+}
+
+VkPipeline fmvk::PipelineBuilder::build_vertex_input_library(VkDevice device) {
+    return build_library(device, VK_GRAPHICS_PIPELINE_LIBRARY_VERTEX_INPUT_INTERFACE_BIT_EXT);
+}
+
+VkPipeline fmvk::PipelineBuilder::build_pre_rasterization_library(VkDevice device) {
+    return build_library(device, VK_GRAPHICS_PIPELINE_LIBRARY_PRE_RASTERIZATION_SHADERS_BIT_EXT);
+}
+
+VkPipeline fmvk::PipelineBuilder::build_fragment_shader_library(VkDevice device) {
+    return build_library(device, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_SHADER_BIT_EXT);
+}
+
+VkPipeline fmvk::PipelineBuilder::build_fragment_output_library(VkDevice device) {
+    return build_library(device, VK_GRAPHICS_PIPELINE_LIBRARY_FRAGMENT_OUTPUT_INTERFACE_BIT_EXT);
+}
+
+VkPipeline fmvk::PipelineBuilder::link_libraries(VkDevice device, VkPipelineLayout layout, std::span<const VkPipeline> libraries, bool optimize)
+{
+    VkPipelineLibraryCreateInfoKHR library_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR,
+        .libraryCount = (uint32_t) libraries.size(),
+        .pLibraries = libraries.data()
+    };
+
+    VkGraphicsPipelineCreateInfo pipeline_info = {
+        .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
+        .pNext = &library_info,
+        .flags = optimize ? (VkPipelineCreateFlags) VK_PIPELINE_CREATE_LINK_TIME_OPTIMIZATION_BIT_EXT : 0u,
+        .layout = layout
+    };
+
+    VkPipeline pipeline;
+    if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipeline_info, nullptr, &pipeline) != VK_SUCCESS) {
+        fmt::println("failed to link pipeline");
+        return VK_NULL_HANDLE;
+    }
+    return pipeline;
+}
+
 void fmvk::PipelineBuilder::clear() {
     this->_input_assembly = { .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO };
     this->_rasterizer = { .sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO };
@@ -80,6 +203,21 @@ void fmvk::PipelineBuilder::set_shaders(VkShaderModule vertex_shader, VkShaderMo
     ));
 }
 
+void fmvk::PipelineBuilder::set_vertex_shader_only(VkShaderModule vertex_shader) {
+    this->_shader_stages.clear();
+    this->_shader_stages.push_back(VKInit::pipeline_shader_stage_create_info(
+        VK_SHADER_STAGE_VERTEX_BIT, vertex_shader
+    ));
+}
+
+void fmvk::PipelineBuilder::set_specialization(VkShaderStageFlagBits stage, const VkSpecializationInfo* specialization) {
+    for (auto& shader_stage : this->_shader_stages) {
+        if (shader_stage.stage == stage) {
+            shader_stage.pSpecializationInfo = specialization;
+        }
+    }
+}
+
 void fmvk::PipelineBuilder::set_input_topology(VkPrimitiveTopology topology) {
     this->_input_assembly.topology = topology;
     this->_input_assembly.primitiveRestartEnable = VK_FALSE;
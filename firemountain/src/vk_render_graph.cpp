@@ -0,0 +1,429 @@
+#include <algorithm>
+
+#include "vk_render_graph.hpp"
+#include "vk_init.hpp"
+
+
+namespace {
+    struct AccessInfo {
+        VkPipelineStageFlags2 stages;
+        VkAccessFlags2 access;
+        VkAccessFlags2 write_access;  // Part of the access that has to be made available to later passes
+        VkImageLayout layout;
+    };
+
+    AccessInfo access_info(fmvk::RGAccess access) {
+        switch (access) {
+        case fmvk::RGAccess::COLOR_ATTACHMENT:
+            return {
+                VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
+            };
+        case fmvk::RGAccess::DEPTH_ATTACHMENT:
+            return {
+                VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT,
+                VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL
+            };
+        case fmvk::RGAccess::COMPUTE_STORAGE_WRITE:
+            return {
+                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                VK_IMAGE_LAYOUT_GENERAL
+            };
+        case fmvk::RGAccess::COMPUTE_SAMPLED_READ:
+            return {
+                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                VK_ACCESS_2_NONE,
+                VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+            };
+        case fmvk::RGAccess::COMPUTE_DEPTH_SAMPLED_READ:
+            return {
+                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                VK_ACCESS_2_SHADER_SAMPLED_READ_BIT,
+                VK_ACCESS_2_NONE,
+                VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL
+            };
+        case fmvk::RGAccess::TRANSFER_SRC:
+            return {
+                VK_PIPELINE_STAGE_2_BLIT_BIT,
+                VK_ACCESS_2_TRANSFER_READ_BIT,
+                VK_ACCESS_2_NONE,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+            };
+        case fmvk::RGAccess::TRANSFER_DST:
+            return {
+                VK_PIPELINE_STAGE_2_BLIT_BIT,
+                VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+            };
+        case fmvk::RGAccess::PRESENT:
+            // Presentation waits on the submit semaphore, the barrier only has to change the layout
+            return {
+                VK_PIPELINE_STAGE_2_NONE,
+                VK_ACCESS_2_NONE,
+                VK_ACCESS_2_NONE,
+                VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
+            };
+        }
+        return {};
+    }
+
+    VkImageAspectFlags aspect_of(VkFormat format) {
+        return format == VK_FORMAT_D32_SFLOAT ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+}
+
+
+void fmvk::RenderGraph::init(VkDevice device, VmaAllocator allocator)
+{
+    this->device = device;
+    this->allocator = allocator;
+}
+
+void fmvk::RenderGraph::destroy()
+{
+    for (auto& t : this->transients) {
+        vkDestroyImageView(this->device, t.image.view, nullptr);
+        vkDestroyImage(this->device, t.image.image, nullptr);
+    }
+    for (auto& slot : this->slots) {
+        vmaFreeMemory(this->allocator, slot.allocation);
+    }
+    this->transients.clear();
+    this->slots.clear();
+    this->imported_states.clear();
+    this->images.clear();
+    this->passes.clear();
+}
+
+fmvk::RGImage fmvk::RenderGraph::import_image(const std::string& name, const fmvk::Image::AllocatedImage& image, bool preserve_contents)
+{
+    const auto& state = this->imported_states[image.image];
+    this->images.push_back(GraphImage {
+        .name = name,
+        .image = image,
+        .aspect = aspect_of(image.format),
+        .layout = state.layout,
+        .transient = false,
+        .preserve_contents = preserve_contents
+    });
+    return RGImage { static_cast<uint32_t>(this->images.size() - 1) };
+}
+
+fmvk::RGImage fmvk::RenderGraph::import_swapchain_image(
+    const std::string& name,
+    VkImage image,
+    VkImageView view,
+    VkExtent2D extent,
+    VkPipelineStageFlags2 acquire_stage)
+{
+    // The first barrier has to start at the semaphore wait stage to chain with the acquire
+    this->imported_states[image] = ImportedState {
+        .layout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .access = { .write_stages = acquire_stage }
+    };
+
+    fmvk::Image::AllocatedImage swapchain_image = {
+        .image = image,
+        .view = view,
+        .allocation = nullptr,
+        .extent = { extent.width, extent.height, 1 },
+        .format = VK_FORMAT_UNDEFINED
+    };
+    return import_image(name, swapchain_image, false);
+}
+
+fmvk::RGImage fmvk::RenderGraph::create_image(const std::string& name, VkExtent3D extent, VkFormat format, VkImageUsageFlags usage)
+{
+    this->images.push_back(GraphImage {
+        .name = name,
+        .image = { .extent = extent, .format = format },
+        .aspect = aspect_of(format),
+        .layout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .transient = true,
+        .preserve_contents = false,
+        .usage = usage
+    });
+    return RGImage { static_cast<uint32_t>(this->images.size() - 1) };
+}
+
+void fmvk::RenderGraph::add_pass(const std::string& name, std::vector<RGImageUse> uses, std::function<void(VkCommandBuffer cmd)>&& record)
+{
+    const uint32_t pass_index = this->passes.size();
+    for (const auto& use : uses) {
+        auto& image = this->images[use.image.id];
+        image.first_pass = std::min(image.first_pass, pass_index);
+        image.last_pass = std::max(image.last_pass, pass_index);
+    }
+    this->passes.push_back(Pass { name, std::move(uses), std::move(record) });
+}
+
+void fmvk::RenderGraph::compile(DeletionQueue& deletion_queue)
+{
+    // Match the transients of this frame with the images of the current plan
+    bool all_matched = true;
+    for (auto& image : this->images) {
+        if (!image.transient) {
+            continue;
+        }
+
+        image.transient_index = -1;
+        for (uint32_t i = 0; i < this->transients.size(); i++) {
+            const auto& t = this->transients[i];
+            if (t.name == image.name
+                && t.format == image.image.format
+                && t.usage == image.usage
+                && t.extent.width == image.image.extent.width
+                && t.extent.height == image.image.extent.height
+                && t.extent.depth == image.image.extent.depth) {
+                image.transient_index = i;
+                break;
+            }
+        }
+        all_matched &= image.transient_index >= 0;
+    }
+
+    if (!all_matched || !plan_is_valid()) {
+        build_plan(deletion_queue);
+    }
+
+    for (auto& image : this->images) {
+        if (image.transient) {
+            image.image = this->transients[image.transient_index].image;
+        }
+    }
+}
+
+void fmvk::RenderGraph::execute(VkCommandBuffer cmd)
+{
+    std::vector<VkImageMemoryBarrier2> barriers;
+
+    for (uint32_t pass_index = 0; pass_index < this->passes.size(); pass_index++) {
+        const auto& pass = this->passes[pass_index];
+
+        // Collect the barriers of every image the pass uses into one batch
+        barriers.clear();
+        for (const auto& use : pass.uses) {
+            auto& image = this->images[use.image.id];
+            auto& state = access_state(image);
+            const AccessInfo info = access_info(use.access);
+            const bool is_write = info.write_access != VK_ACCESS_2_NONE;
+
+            // Contents from before the frame are discarded on first use unless they are asked to be kept
+            VkImageLayout old_layout = image.layout;
+            if (pass_index == image.first_pass && !image.preserve_contents) {
+                old_layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            }
+            const bool layout_change = old_layout != info.layout;
+
+            VkImageMemoryBarrier2 barrier = {
+                .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2,
+                .pNext = nullptr,
+                .dstStageMask = info.stages,
+                .dstAccessMask = info.access,
+                .oldLayout = old_layout,
+                .newLayout = info.layout,
+                .image = image.image.image,
+                .subresourceRange = VKInit::image_subresource_range(image.aspect)
+            };
+
+            if (layout_change || is_write) {
+                // Writes and layout transitions wait for the last write and every read since
+                barrier.srcStageMask = state.write_stages | state.read_stages;
+                barrier.srcAccessMask = state.write_access;
+                if (layout_change || barrier.srcStageMask != VK_PIPELINE_STAGE_2_NONE) {
+                    barriers.push_back(barrier);
+                }
+
+                // A layout transition counts as a write that later readers chain onto
+                state.write_stages = info.stages;
+                state.write_access = info.write_access;
+                state.read_stages = is_write ? VK_PIPELINE_STAGE_2_NONE : info.stages;
+            }
+            else if ((info.stages & ~state.read_stages) != 0) {
+                // Read from a stage the last write was not made visible to yet
+                barrier.srcStageMask = state.write_stages;
+                barrier.srcAccessMask = state.write_access;
+                barriers.push_back(barrier);
+
+                state.read_stages |= info.stages;
+            }
+
+            image.layout = info.layout;
+        }
+
+        if (!barriers.empty()) {
+            VkDependencyInfo dependency_info = {
+                .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+                .pNext = nullptr,
+                .imageMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
+                .pImageMemoryBarriers = barriers.data()
+            };
+            vkCmdPipelineBarrier2(cmd, &dependency_info);
+        }
+
+        if (pass.record) {
+            pass.record(cmd);
+        }
+    }
+
+    // Carry the layouts of imported images over to the next frame
+    for (const auto& image : this->images) {
+        if (!image.transient) {
+            this->imported_states[image.image.image].layout = image.layout;
+        }
+    }
+
+    this->images.clear();
+    this->passes.clear();
+}
+
+void fmvk::RenderGraph::forget_image(VkImage image)
+{
+    this->imported_states.erase(image);
+}
+
+fmvk::RenderGraph::AccessState& fmvk::RenderGraph::access_state(const GraphImage& image)
+{
+    // Aliased transients share the state of their memory so the first use waits on the previous owner
+    if (image.transient) {
+        return this->slots[this->transients[image.transient_index].slot].access;
+    }
+    return this->imported_states[image.image.image].access;
+}
+
+bool fmvk::RenderGraph::plan_is_valid() const
+{
+    for (uint32_t i = 0; i < this->images.size(); i++) {
+        const auto& a = this->images[i];
+        if (!a.transient) {
+            continue;
+        }
+
+        for (uint32_t j = i + 1; j < this->images.size(); j++) {
+            const auto& b = this->images[j];
+            if (!b.transient || a.transient_index == b.transient_index) {
+                continue;
+            }
+
+            const bool same_slot = this->transients[a.transient_index].slot == this->transients[b.transient_index].slot;
+            const bool overlaps = a.first_pass <= b.last_pass && b.first_pass <= a.last_pass;
+            if (same_slot && overlaps) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void fmvk::RenderGraph::build_plan(DeletionQueue& deletion_queue)
+{
+    retire_transients(deletion_queue);
+
+    // Create the images first, their memory requirements decide which ones can share memory
+    std::vector<uint32_t> order;
+    for (uint32_t i = 0; i < this->images.size(); i++) {
+        auto& image = this->images[i];
+        if (!image.transient) {
+            continue;
+        }
+
+        TransientImage t = {
+            .name = image.name,
+            .extent = image.image.extent,
+            .format = image.image.format,
+            .usage = image.usage,
+            .image = { .extent = image.image.extent, .format = image.image.format },
+            .slot = UINT32_MAX
+        };
+        VkImageCreateInfo image_info = VKInit::image_create_info(t.format, t.usage, t.extent);
+        VK_CHECK(vkCreateImage(this->device, &image_info, nullptr, &t.image.image));
+
+        image.transient_index = this->transients.size();
+        this->transients.push_back(t);
+        order.push_back(i);
+    }
+
+    // Greedy assignment in order of first use, an image joins the first slot whose users are all done by then
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return this->images[a].first_pass < this->images[b].first_pass;
+    });
+
+    struct SlotPlan {
+        VkMemoryRequirements requirements;
+        uint32_t last_pass;
+    };
+    std::vector<SlotPlan> slot_plans;
+
+    for (auto i : order) {
+        const auto& image = this->images[i];
+        auto& t = this->transients[image.transient_index];
+
+        VkMemoryRequirements requirements;
+        vkGetImageMemoryRequirements(this->device, t.image.image, &requirements);
+
+        for (uint32_t s = 0; s < slot_plans.size(); s++) {
+            auto& plan = slot_plans[s];
+            if (plan.last_pass < image.first_pass && (plan.requirements.memoryTypeBits & requirements.memoryTypeBits) != 0) {
+                plan.requirements.size = std::max(plan.requirements.size, requirements.size);
+                plan.requirements.alignment = std::max(plan.requirements.alignment, requirements.alignment);
+                plan.requirements.memoryTypeBits &= requirements.memoryTypeBits;
+                plan.last_pass = std::max(plan.last_pass, image.last_pass);
+                t.slot = s;
+                break;
+            }
+        }
+
+        if (t.slot == UINT32_MAX) {
+            t.slot = slot_plans.size();
+            slot_plans.push_back(SlotPlan { requirements, image.last_pass });
+        }
+    }
+
+    // Allocate the slots, bind every image to its slot and only then create the views
+    VmaAllocationCreateInfo allocation_info = {
+        .usage = VMA_MEMORY_USAGE_GPU_ONLY,
+        .requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    };
+    for (const auto& plan : slot_plans) {
+        MemorySlot slot = {};
+        VK_CHECK(vmaAllocateMemory(this->allocator, &plan.requirements, &allocation_info, &slot.allocation, nullptr));
+        this->slots.push_back(slot);
+    }
+
+    for (auto& t : this->transients) {
+        t.image.allocation = this->slots[t.slot].allocation;
+        VK_CHECK(vmaBindImageMemory(this->allocator, t.image.allocation, t.image.image));
+
+        VkImageViewCreateInfo view_info = VKInit::imageview_create_info(t.format, t.image.image, aspect_of(t.format));
+        VK_CHECK(vkCreateImageView(this->device, &view_info, nullptr, &t.image.view));
+    }
+}
+
+void fmvk::RenderGraph::retire_transients(DeletionQueue& deletion_queue)
+{
+    if (this->transients.empty() && this->slots.empty()) {
+        return;
+    }
+
+    // Frames in flight may still use the old images, they are freed once this frame's slot comes around again
+    deletion_queue.push_function([device = this->device, allocator = this->allocator, transients = this->transients, slots = this->slots]() {
+        for (auto& t : transients) {
+            vkDestroyImageView(device, t.image.view, nullptr);
+            vkDestroyImage(device, t.image.image, nullptr);
+        }
+        for (auto& slot : slots) {
+            vmaFreeMemory(allocator, slot.allocation);
+        }
+    });
+
+    this->transients.clear();
+    this->slots.clear();
+}
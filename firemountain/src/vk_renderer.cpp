@@ -1,3 +1,9 @@
+#include <bit>
+#include <cassert>
+#include <array>
+#include <span>
+#include <numeric>
+#include <algorithm>
 #include <fstream>
 
 #include "imgui.h"
@@ -23,7 +29,14 @@
 #include "fm_mesh_loader.hpp"
 
 
-bool is_visible(const RenderObject& obj, const glm::mat4& view_projection) {
+// Projected bounds of a render object, used for occlusion tests
+struct ScreenBounds {
+    glm::vec4 rect;  // NDC bounds, .xy min and .zw max
+    float depth;     // Nearest depth (reverse-Z)
+    bool valid;      // False if the bounds reach behind the camera
+};
+
+bool is_visible(const RenderObject& obj, const glm::mat4& view_projection, ScreenBounds* screen_bounds = nullptr) {
     std::array<glm::vec3, 8> corners {
         glm::vec3 { 1,  1,  1 },
         glm::vec3 { 1,  1, -1 },
@@ -37,10 +50,12 @@ bool is_visible(const RenderObject& obj, const glm::mat4& view_projection) {
     glm::mat4 matrix = view_projection * obj.transform;
     glm::vec3 min = {  1.5f,  1.5f, 1.5f };
     glm::vec3 max = { -1.5f, -1.5f, -1.5f };
+    bool behind_camera = false;
 
     for (int c = 0; c < 8; c++) {
         // Project corners into clip space
         glm::vec4 v = matrix * glm::vec4(obj.bounds.origin + (corners[c] * obj.bounds.extents), 1.0f);
+        behind_camera |= v.w <= 0.0f;
 
         // Perspective correction
         v.x = v.x / v.w;
@@ -51,6 +66,14 @@ bool is_visible(const RenderObject& obj, const glm::mat4& view_projection) {
         max = glm::max(glm::vec3 { v.x, v.y, v.z }, max);
     }
 
+    if (screen_bounds) {
+        *screen_bounds = {
+            .rect = glm::vec4 { min.x, min.y, max.x, max.y },
+            .depth = max.z,
+            .valid = !behind_camera
+        };
+    }
+
     if (min.z > 1.0f || max.z < 0.0f || min.x > 1.0f || max.x < -1.0f || min.y > 1.0f || max.y < -1.0f) {
         return false;
     } else {
@@ -82,42 +105,47 @@ int fmvk::Vulkan::Init(const uint32_t width, const uint32_t height, SDL_Window*
     return 0;
 }
 
-void fmvk::Vulkan::Draw(RenderObject* render_objects, int render_object_count) {
+void fmvk::Vulkan::Draw(ImDrawData* ui_draw_data) {
     auto start = std::chrono::system_clock::now();
 
-    VK_CHECK(vkWaitForFences(this->_device, 1, &get_current_frame()._render_fence, true, 1000000000));
+    wait_timeline(get_current_frame()._timeline_value);
     get_current_frame()._deletion_queue.flush();
+
+    FrameArena& arena = get_current_frame()._arena;
+    this->stats.frame_arena_allocations = arena.allocation_count;
+    this->stats.frame_heap_allocations = arena.heap_allocation_count;
+    arena.reset();
+    this->_timeline_deletion_queue.flush(completed_timeline_value());
     get_current_frame()._frame_descriptors.clear_pools(this->_device);
 
+    // Pipelines compiled in the background are swapped in together between frames
+    if (this->_pipeline_compile.has_value() && pipelines_compiled()) {
+        swap_compiled_pipelines();
+    }
+
+    // Material pipelines whose optimized link finished, the fast linked ones may still be in flight
+    for (VkPipeline pipeline : this->metal_roughness_material.swap_optimized_pipelines()) {
+        this->_timeline_deletion_queue.push_function(this->_timeline_value, [this, pipeline]() {
+            vkDestroyPipeline(this->_device, pipeline, nullptr);
+        });
+    }
+
+    // Timings of this frame slot's previous submission drive the render scale of this one
+    read_gpu_timings(get_current_frame());
+
     if (this->_resize_requested) {
         // Update extents
         if (this->_requested_extent.width > 0 && this->_requested_extent.height > 0) {
             this->_window_extent.width = this->_requested_extent.width;
             this->_window_extent.height = this->_requested_extent.height;
         }
-        
-        // Recreate swapchain
-        vkDeviceWaitIdle(this->_device);
-        this->_swapchain.Destroy(this->_device);
-        this->_swapchain.Create(this->_window_extent, this->_surface);
-
-        // Re-create draw and depth targets with new extent
-        destroy_image(this->_draw_image, this->_device, this->_allocator);
-        destroy_image(this->_depth_image, this->_device, this->_allocator);
-        init_render_targets();
-
-        // Update draw image descriptors
-        {
-            DescriptorWriter writer;
-            writer.write_image(0, this->_draw_image.view, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
-            writer.update_set(this->_device, this->_draw_image_descriptors);
-        }
 
+        recreate_swapchain();
         this->_resize_requested = false;
     }
 
-    this->_draw_extent.width = std::min(this->_swapchain.extent.width, this->_draw_image.extent.width) * this->_render_scale;
-    this->_draw_extent.height = std::min(this->_swapchain.extent.height, this->_draw_image.extent.height) * this->_render_scale;
+    this->_draw_extent.width = std::max(1u, (uint32_t) (std::min(this->_swapchain.extent.width, this->_draw_image.extent.width) * this->_render_scale));
+    this->_draw_extent.height = std::max(1u, (uint32_t) (std::min(this->_swapchain.extent.height, this->_draw_image.extent.height) * this->_render_scale));
 
 
     // Request image from the swapchain
@@ -136,7 +164,6 @@ void fmvk::Vulkan::Draw(RenderObject* render_objects, int render_object_count) {
     }
 
     // New draw
-    VK_CHECK(vkResetFences(this->_device, 1, &get_current_frame()._render_fence));
     VK_CHECK(vkResetCommandBuffer(get_current_frame()._main_command_buffer, 0));
 
     auto cmd = get_current_frame()._main_command_buffer;
@@ -144,39 +171,132 @@ void fmvk::Vulkan::Draw(RenderObject* render_objects, int render_object_count) {
 
     // Start drawing
     VK_CHECK(vkBeginCommandBuffer(cmd, &command_buffer_begin));
+    vkCmdResetQueryPool(cmd, get_current_frame()._timestamp_pool, 0, FM_TIMESTAMP_COUNT);
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestamp_pool, FM_TIMESTAMP_FRAME_BEGIN);
+
+    // Frame graph: passes in execution order with the images they use, the graph places the barriers between them
+    auto& graph = this->_render_graph;
+    const VkExtent3D target_extent = this->_draw_image.extent;
+    const RGImage draw_image = graph.import_image("draw", this->_draw_image);
+    const RGImage depth_image = graph.create_image(
+        "depth",
+        target_extent,
+        this->_depth_image.format,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT  // Sampled by the depth pyramid build
+    );
+    const RGImage swapchain_image = graph.import_swapchain_image(
+        "swapchain",
+        this->_swapchain.images[swapchain_image_index],
+        this->_swapchain.image_views[swapchain_image_index],
+        this->_swapchain.extent,
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT  // Wait stage of the acquire semaphore below
+    );
 
-    VKUtil::transition_image(cmd, this->_draw_image.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
-    draw_background(cmd);
-    
-    // Draw meshes, transfer the draw image and the swapchain image to transfer layouts
-    VKUtil::transition_image(cmd, this->_draw_image.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
-    VKUtil::transition_image(cmd, this->_depth_image.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
-    draw_geometry(cmd, render_objects, render_object_count);
+    graph.add_pass("background", { { draw_image, RGAccess::COMPUTE_STORAGE_WRITE } }, [this](VkCommandBuffer cmd) {
+        draw_background(cmd);
+    });
+
+    // Draw lists, buffers and descriptors of the geometry passes, they decide which of the passes run
+    prepare_geometry(cmd);
+    const GeometryFrame& geometry = this->_geometry_frame;
+
+    // With the prepass on, the opaque passes only write depth and color is first touched by the shading
+    std::vector<RGImageUse> opaque_uses = { { depth_image, RGAccess::DEPTH_ATTACHMENT } };
+    if (!geometry.use_prepass) {
+        opaque_uses.push_back({ draw_image, RGAccess::COLOR_ATTACHMENT });
+    }
+    graph.add_pass("geometry_early", opaque_uses, [this](VkCommandBuffer cmd) {
+        draw_geometry(cmd, GeometryPass::EARLY);
+    });
+
+    // Build the depth pyramid from the early pass, test all candidates against it and draw the ones that became visible
+    if (geometry.use_occlusion) {
+        const RGImage depth_pyramid = graph.import_image("depth_pyramid", this->_depth_pyramid);
+        graph.add_pass(
+            "depth_pyramid",
+            { { depth_image, RGAccess::COMPUTE_DEPTH_SAMPLED_READ }, { depth_pyramid, RGAccess::COMPUTE_STORAGE_WRITE } },
+            [this](VkCommandBuffer cmd) {
+                vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestamp_pool, FM_TIMESTAMP_OCCLUSION_BEGIN);
+                build_depth_pyramid(cmd);
+            }
+        );
+        graph.add_pass("occlusion_cull", { { depth_pyramid, RGAccess::COMPUTE_SAMPLED_READ } }, [this](VkCommandBuffer cmd) {
+            cull_occluded(cmd, get_current_frame()._occlusion_candidates.size());
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestamp_pool, FM_TIMESTAMP_OCCLUSION_END);
+        });
+        graph.add_pass("geometry_late", opaque_uses, [this](VkCommandBuffer cmd) {
+            draw_geometry(cmd, GeometryPass::LATE);
+        });
+    }
 
+    graph.add_pass(
+        "geometry",
+        { { draw_image, RGAccess::COLOR_ATTACHMENT }, { depth_image, RGAccess::DEPTH_ATTACHMENT } },
+        [this](VkCommandBuffer cmd) { draw_geometry(cmd, GeometryPass::SHADING); }
+    );
+
+    // Upscale to the swapchain sized part of the draw image when rendering below native resolution
+    VkExtent2D output_extent = this->_draw_extent;
+    const bool use_upscaling = this->upscaling
+        && (this->_draw_extent.width != this->_swapchain.extent.width || this->_draw_extent.height != this->_swapchain.extent.height);
+    RGImage upscale_image = {};
+    if (use_upscaling) {
+        upscale_image = graph.create_image("upscale", target_extent, this->_draw_image.format, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+        graph.add_pass(
+            "upscale_easu",
+            { { draw_image, RGAccess::COMPUTE_SAMPLED_READ }, { upscale_image, RGAccess::COMPUTE_STORAGE_WRITE } },
+            [this](VkCommandBuffer cmd) { upscale_easu(cmd); }
+        );
+        graph.add_pass(
+            "upscale_rcas",
+            { { upscale_image, RGAccess::COMPUTE_SAMPLED_READ }, { draw_image, RGAccess::COMPUTE_STORAGE_WRITE } },
+            [this](VkCommandBuffer cmd) { upscale_rcas(cmd); }
+        );
+        output_extent = this->_swapchain.extent;
+    }
+
+    graph.add_pass(
+        "copy_to_swapchain",
+        { { draw_image, RGAccess::TRANSFER_SRC }, { swapchain_image, RGAccess::TRANSFER_DST } },
+        [this, output_extent, swapchain_image_index](VkCommandBuffer cmd) {
+            VKUtil::copy_image_to_image(cmd, this->_draw_image.image, this->_swapchain.images[swapchain_image_index], output_extent, this->_swapchain.extent);
+        }
+    );
 
-    // Transition draw image and swapchain
-    VKUtil::transition_image(cmd, this->_draw_image.image, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
-    VKUtil::transition_image(cmd, this->_swapchain.images[swapchain_image_index], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    graph.add_pass("imgui", { { swapchain_image, RGAccess::COLOR_ATTACHMENT } }, [this, swapchain_image_index, ui_draw_data](VkCommandBuffer cmd) {
+        draw_imgui(cmd, this->_swapchain.image_views[swapchain_image_index], ui_draw_data);
+    });
 
-    // Copy draw image into the swapchain
-    VKUtil::copy_image_to_image(cmd, this->_draw_image.image, _swapchain.images[swapchain_image_index], this->_draw_extent, this->_swapchain.extent);
+    graph.add_pass("present", { { swapchain_image, RGAccess::PRESENT } });
 
-    // Draw Imgui
-    VKUtil::transition_image(cmd, this->_swapchain.images[swapchain_image_index], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
-    draw_imgui(cmd, this->_swapchain.image_views[swapchain_image_index]);
+    // Transient targets may have moved to new memory, the passes read them through the members
+    graph.compile(get_current_frame()._deletion_queue);
+    this->_depth_image = graph.get_image(depth_image);
+    if (use_upscaling) {
+        this->_upscale_image = graph.get_image(upscale_image);
+    }
 
-    // Set swapchain image layout to PRESENT
-    VKUtil::transition_image(cmd, this->_swapchain.images[swapchain_image_index], VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    graph.execute(cmd);
 
     // Finalize command buffer
+    vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, get_current_frame()._timestamp_pool, FM_TIMESTAMP_FRAME_END);
+    get_current_frame()._timestamps_written = true;
     VK_CHECK(vkEndCommandBuffer(cmd));
 
+    // Wait for the acquire and for the uploads so far, signal presentation and the next timeline value
+    get_current_frame()._timeline_value = ++this->_timeline_value;
     auto cmd_info = VKInit::command_buffer_submit_info(cmd);
-    auto wait_info = VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, get_current_frame()._swapchain_semaphore);
-    auto signal_info = VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, this->_swapchain.image_semaphores.at(swapchain_image_index));
-    VkSubmitInfo2 submit_info = VKInit::submit_info(&cmd_info, &signal_info, &wait_info);
+    VkSemaphoreSubmitInfo wait_infos[] = {
+        VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT_KHR, get_current_frame()._swapchain_semaphore),
+        VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, this->_timeline_semaphore, this->_upload_timeline_value)
+    };
+    VkSemaphoreSubmitInfo signal_infos[] = {
+        VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_GRAPHICS_BIT, this->_swapchain.image_semaphores.at(swapchain_image_index)),
+        VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, this->_timeline_semaphore, get_current_frame()._timeline_value)
+    };
+    VkSubmitInfo2 submit_info = VKInit::submit_info(&cmd_info, signal_infos, wait_infos, 2, 2);
 
-    VK_CHECK(vkQueueSubmit2(this->_graphics_queue, 1, &submit_info, get_current_frame()._render_fence));
+    VK_CHECK(vkQueueSubmit2(this->_graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
 
     // Present the image to the screen
     // TODO move this to vkinit utils
@@ -213,17 +333,38 @@ void fmvk::Vulkan::Resize(const uint32_t width, const uint32_t height)
 void fmvk::Vulkan::Destroy() {
     if(this->_is_initialized) {
         vkDeviceWaitIdle(this->_device);
+        this->_timeline_deletion_queue.flush(UINT64_MAX);
         this->loaded_meshes.clear();
         this->clean_pipelines();
 
         for (auto& frame : this->_frames) {
             frame._deletion_queue.flush();
+            if (frame._occlusion_capacity > 0) {
+                fmvk::Buffer::destroy_buffer(frame._occlusion_objects, this->_allocator);
+                fmvk::Buffer::destroy_buffer(frame._occlusion_commands, this->_allocator);
+                fmvk::Buffer::destroy_buffer(frame._occlusion_visibility, this->_allocator);
+            }
+            if (frame._light_capacity > 0) {
+                fmvk::Buffer::destroy_buffer(frame._lights, this->_allocator);
+                fmvk::Buffer::destroy_buffer(frame._cluster_grid, this->_allocator);
+                fmvk::Buffer::destroy_buffer(frame._cluster_light_indices, this->_allocator);
+                fmvk::Buffer::destroy_buffer(frame._cluster_index_usage, this->_allocator);
+            }
+            if (frame._object_upload_capacity > 0) {
+                fmvk::Buffer::destroy_buffer(frame._object_upload, this->_allocator);
+            }
+            if (frame._draw_capacity > 0) {
+                fmvk::Buffer::destroy_buffer(frame._draw_commands, this->_allocator);
+                fmvk::Buffer::destroy_buffer(frame._draw_data, this->_allocator);
+            }
+        }
+        if (this->_object_capacity > 0) {
+            fmvk::Buffer::destroy_buffer(this->_object_buffer, this->_allocator);
         }
 
         this->_deletion_queue.flush();
 
-        destroy_image(this->_draw_image, this->_device, this->_allocator);
-        destroy_image(this->_depth_image, this->_device, this->_allocator);
+        destroy_render_targets();
         this->_swapchain.Destroy(this->_device);
         vkDestroySurfaceKHR(this->_instance, this->_surface, nullptr);
         vmaDestroyAllocator(this->_allocator);
@@ -240,9 +381,16 @@ void fmvk::Vulkan::ProcessImGuiEvent(const SDL_Event* e)
 
 GPUMeshBuffers fmvk::Vulkan::UploadMesh(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices) {
     const size_t vertex_buffer_size = vertices.size() * sizeof(Vertex);
+    const size_t position_buffer_size = vertices.size() * sizeof(glm::vec3);
     const size_t index_buffer_size = indices.size() * sizeof(uint32_t);
     GPUMeshBuffers new_surface = {};
 
+    // Separate position stream for depth only passes, so they don't have to pull in the full vertex
+    std::vector<glm::vec3> positions(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        positions[i] = vertices[i].position;
+    }
+
     VkBufferUsageFlags vertex_buffer_flags = 
         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
         | VK_BUFFER_USAGE_TRANSFER_DST_BIT
@@ -257,12 +405,21 @@ GPUMeshBuffers fmvk::Vulkan::UploadMesh(const std::vector<Vertex> &vertices, con
     };
     new_surface.vertex_buffer_address = vkGetBufferDeviceAddress(this->_device, &device_address_info);
 
+    new_surface.position_buffer = fmvk::Buffer::create_buffer(
+        position_buffer_size, vertex_buffer_flags, VMA_MEMORY_USAGE_GPU_ONLY, this->_allocator);
+
+    VkBufferDeviceAddressInfo position_address_info  {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = new_surface.position_buffer.buffer
+    };
+    new_surface.position_buffer_address = vkGetBufferDeviceAddress(this->_device, &position_address_info);
+
     VkBufferUsageFlags index_buffer_flags = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     new_surface.index_buffer = fmvk::Buffer::create_buffer(
         index_buffer_size, index_buffer_flags, VMA_MEMORY_USAGE_GPU_ONLY, this->_allocator);
 
     fmvk::Buffer::AllocatedBuffer staging = fmvk::Buffer::create_buffer(
-        vertex_buffer_size + index_buffer_size,
+        vertex_buffer_size + index_buffer_size + position_buffer_size,
         VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
         VMA_MEMORY_USAGE_CPU_ONLY,
         this->_allocator
@@ -270,7 +427,8 @@ GPUMeshBuffers fmvk::Vulkan::UploadMesh(const std::vector<Vertex> &vertices, con
     void* data = staging.allocation->GetMappedData();
     memcpy(data, vertices.data(), vertex_buffer_size);
     memcpy((char*)data + vertex_buffer_size, indices.data(), index_buffer_size);
-    immediate_submit([&](VkCommandBuffer cmd) {
+    memcpy((char*)data + vertex_buffer_size + index_buffer_size, positions.data(), position_buffer_size);
+    const uint64_t upload_value = immediate_submit([&](VkCommandBuffer cmd) {
         VkBufferCopy vertex_copy = { 0 };
         vertex_copy.srcOffset = 0;
         vertex_copy.dstOffset = 0;
@@ -282,9 +440,18 @@ GPUMeshBuffers fmvk::Vulkan::UploadMesh(const std::vector<Vertex> &vertices, con
         index_copy.dstOffset = 0;
         index_copy.size = index_buffer_size;
         vkCmdCopyBuffer(cmd, staging.buffer, new_surface.index_buffer.buffer, 1, &index_copy);
+
+        VkBufferCopy position_copy = { 0 };
+        position_copy.srcOffset = vertex_buffer_size + index_buffer_size;
+        position_copy.dstOffset = 0;
+        position_copy.size = position_buffer_size;
+        vkCmdCopyBuffer(cmd, staging.buffer, new_surface.position_buffer.buffer, 1, &position_copy);
     });
 
-    fmvk::Buffer::destroy_buffer(staging, this->_allocator);
+    // Staging memory is released once the copy has finished on the GPU
+    this->_timeline_deletion_queue.push_function(upload_value, [=, this]() {
+        fmvk::Buffer::destroy_buffer(staging, this->_allocator);
+    });
 
     return new_surface;
 }
@@ -325,6 +492,8 @@ void fmvk::Vulkan::init_vulkan(SDL_Window *window) {
 
     // Generic device features
     VkPhysicalDeviceFeatures device_features = {
+        .multiDrawIndirect = true,
+        .drawIndirectFirstInstance = true,
         .samplerAnisotropy = true
     };
 
@@ -340,6 +509,8 @@ void fmvk::Vulkan::init_vulkan(SDL_Window *window) {
     features_12.descriptorBindingPartiallyBound = true;
     features_12.descriptorBindingVariableDescriptorCount = true;
     features_12.runtimeDescriptorArray = true;
+    features_12.samplerFilterMinmax = true;
+    features_12.timelineSemaphore = true;
 
     VkPhysicalDeviceVulkan11Features features_11 {};
     features_11.shaderDrawParameters = true;
@@ -357,11 +528,34 @@ void fmvk::Vulkan::init_vulkan(SDL_Window *window) {
         .set_surface(this->_surface)
         .select()
         .value();
+
+    // Optional, pipelines are built monolithically without it
+    VkPhysicalDeviceGraphicsPipelineLibraryFeaturesEXT pipeline_library_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_FEATURES_EXT,
+        .graphicsPipelineLibrary = VK_TRUE
+    };
+    this->_pipeline_library = device.enable_extension_if_present(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME)
+        && device.enable_extension_if_present(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)
+        && device.enable_extension_features_if_present(pipeline_library_features);
+
+    if (this->_pipeline_library) {
+        VkPhysicalDeviceGraphicsPipelineLibraryPropertiesEXT pipeline_library_properties = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GRAPHICS_PIPELINE_LIBRARY_PROPERTIES_EXT
+        };
+        VkPhysicalDeviceProperties2 properties = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+            .pNext = &pipeline_library_properties
+        };
+        vkGetPhysicalDeviceProperties2(device.physical_device, &properties);
+        this->_pipeline_library_fast_linking = pipeline_library_properties.graphicsPipelineLibraryFastLinking;
+    }
+
     vkb::DeviceBuilder device_builder{ device };
     vkb::Device vkb_device = device_builder.build().value();
 
     this->_device = vkb_device.device;
     this->_gpu = device.physical_device;
+    this->_timestamp_period = device.properties.limits.timestampPeriod;
     this->_graphics_queue = vkb_device.get_queue(vkb::QueueType::graphics).value();
     this->_graphics_queue_family = vkb_device.get_queue_index(vkb::QueueType::graphics).value();
 
@@ -372,6 +566,8 @@ void fmvk::Vulkan::init_vulkan(SDL_Window *window) {
         .instance = this->_instance
     };
     vmaCreateAllocator(&allocator_info, &this->_allocator);
+
+    this->_render_graph.init(this->_device, this->_allocator);
 }
 
 void fmvk::Vulkan::init_imgui() {
@@ -425,9 +621,10 @@ void fmvk::Vulkan::init_imgui() {
     };
     ImGui_ImplVulkan_Init(&init_info);
 
+    // Kept alive, otherwise ImGui_ImplVulkan_NewFrame() creates it again with a queue submit of its own
+    // from the thread that builds the UI
     immediate_submit([&](VkCommandBuffer cmd) { ImGui_ImplVulkan_CreateFontsTexture(); });
 
-    ImGui_ImplVulkan_DestroyFontsTexture();
     this->_deletion_queue.push_function([=, this]() {
         ImGui_ImplVulkan_Shutdown();
         vkDestroyDescriptorPool(this->_device, imgui_pool, nullptr);
@@ -439,9 +636,54 @@ void fmvk::Vulkan::init_swapchain() {
     this->_swapchain.Create(this->_window_extent, this->_surface);
 }
 
-// Create render and depth buffer images
+// Recreate the swapchain without waiting for the device. The old swapchain and anything
+// that has to be replaced are destroyed once the frames submitted so far are done with them.
+void fmvk::Vulkan::recreate_swapchain() {
+    const uint64_t retire_value = this->_timeline_value;
+
+    fmvk::Swapchain old_swapchain = this->_swapchain;
+    this->_swapchain.Create(this->_window_extent, this->_surface);
+    for (auto image : old_swapchain.images) {
+        this->_render_graph.forget_image(image);
+    }
+    this->_timeline_deletion_queue.push_function(retire_value, [=, this]() mutable {
+        old_swapchain.Destroy(this->_device);
+    });
+
+    // The image count can change, present semaphores are only added since the old ones may still be pending
+    VkSemaphoreCreateInfo semaphore_create_info = VKInit::samephore_create_info();
+    while (this->_swapchain.image_semaphores.size() < this->_swapchain.images.size()) {
+        VkSemaphore semaphore;
+        VK_CHECK(vkCreateSemaphore(this->_device, &semaphore_create_info, nullptr, &semaphore));
+        this->_swapchain.image_semaphores.push_back(semaphore);
+    }
+
+    // Render targets only grow, a smaller window renders into a sub rectangle of them
+    if (this->_swapchain.extent.width > this->_render_target_extent.width
+        || this->_swapchain.extent.height > this->_render_target_extent.height) {
+        fmvk::Image::AllocatedImage old_draw_image = this->_draw_image;
+        fmvk::Image::AllocatedImage old_depth_pyramid = this->_depth_pyramid;
+        std::vector<VkImageView> old_pyramid_mips = this->_depth_pyramid_mips;
+        this->_render_graph.forget_image(old_draw_image.image);
+        this->_render_graph.forget_image(old_depth_pyramid.image);
+        this->_timeline_deletion_queue.push_function(retire_value, [=, this]() mutable {
+            for (auto view : old_pyramid_mips) {
+                vkDestroyImageView(this->_device, view, nullptr);
+            }
+            destroy_image(old_depth_pyramid, this->_device, this->_allocator);
+            destroy_image(old_draw_image, this->_device, this->_allocator);
+        });
+        this->_depth_pyramid_mips.clear();
+
+        init_render_targets();
+    }
+}
+
+// Create render and depth buffer images, at the largest extent the swapchain had so far
 void fmvk::Vulkan::init_render_targets() {
-    VkExtent3D render_image_extent = { this->_window_extent.width, this->_window_extent.height, 1 };
+    this->_render_target_extent.width = std::max(this->_render_target_extent.width, this->_swapchain.extent.width);
+    this->_render_target_extent.height = std::max(this->_render_target_extent.height, this->_swapchain.extent.height);
+    VkExtent3D render_image_extent = { this->_render_target_extent.width, this->_render_target_extent.height, 1 };
     this->_draw_image.format = VK_FORMAT_R16G16B16A16_SFLOAT;
     this->_draw_image.extent = render_image_extent;
 
@@ -449,7 +691,8 @@ void fmvk::Vulkan::init_render_targets() {
           VK_IMAGE_USAGE_TRANSFER_SRC_BIT
         | VK_IMAGE_USAGE_TRANSFER_DST_BIT
         | VK_IMAGE_USAGE_STORAGE_BIT
-        | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+        | VK_IMAGE_USAGE_SAMPLED_BIT;  // Read by the upscaler
     
     VkImageCreateInfo draw_image_info = VKInit::image_create_info(
         this->_draw_image.format,
@@ -476,36 +719,52 @@ void fmvk::Vulkan::init_render_targets() {
     );
     VK_CHECK(vkCreateImageView(this->_device, &draw_view_info, nullptr, &this->_draw_image.view));
 
+    // Depth buffer is a transient of the render graph, only its description lives here
+    this->_depth_image.format = VK_FORMAT_D32_SFLOAT;
+    this->_depth_image.extent = render_image_extent;
+
     //
-    // Create depth buffer images and views
+    // Create the depth pyramid, sized to the previous power of two of the render target
+    // so every level halves cleanly
     //
-    this->_depth_image.format = VK_FORMAT_D32_SFLOAT;
-    VkImageUsageFlags depth_image_usages {};
-    depth_image_usages |= VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-    
-    VkImageCreateInfo depth_image_info = VKInit::image_create_info(
-        this->_depth_image.format,
-        depth_image_usages,
-        render_image_extent
-    );
-    VmaAllocationCreateInfo depth_image_allocation_info = {
-        .usage = VMA_MEMORY_USAGE_GPU_ONLY,
-        .requiredFlags = VkMemoryPropertyFlags(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
+    this->_depth_pyramid_extent = {
+        .width = std::bit_floor(render_image_extent.width),
+        .height = std::bit_floor(render_image_extent.height)
     };
-    vmaCreateImage(
+    this->_depth_pyramid = fmvk::Image::create_image(
+        this->_device,
         this->_allocator,
-        &depth_image_info,
-        &depth_image_allocation_info,
-        &this->_depth_image.image,
-        &this->_depth_image.allocation,
-        nullptr
-    );
-    VkImageViewCreateInfo depth_view_info = VKInit::imageview_create_info(
-        this->_depth_image.format,
-        this->_depth_image.image,
-        VK_IMAGE_ASPECT_DEPTH_BIT
+        VkExtent3D { this->_depth_pyramid_extent.width, this->_depth_pyramid_extent.height, 1 },
+        VK_FORMAT_R32_SFLOAT,
+        VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        true
     );
-    VK_CHECK(vkCreateImageView(this->_device, &depth_view_info, nullptr, &this->_depth_image.view));
+
+    uint32_t pyramid_levels = std::bit_width(std::max(this->_depth_pyramid_extent.width, this->_depth_pyramid_extent.height));
+    this->_depth_pyramid_mips.resize(pyramid_levels);
+    for (uint32_t level = 0; level < pyramid_levels; level++) {
+        VkImageViewCreateInfo level_view_info = VKInit::imageview_create_info(
+            this->_depth_pyramid.format,
+            this->_depth_pyramid.image,
+            VK_IMAGE_ASPECT_COLOR_BIT
+        );
+        level_view_info.subresourceRange.baseMipLevel = level;
+        VK_CHECK(vkCreateImageView(this->_device, &level_view_info, nullptr, &this->_depth_pyramid_mips[level]));
+    }
+
+}
+
+void fmvk::Vulkan::destroy_render_targets() {
+    for (auto view : this->_depth_pyramid_mips) {
+        vkDestroyImageView(this->_device, view, nullptr);
+    }
+    this->_depth_pyramid_mips.clear();
+
+    destroy_image(this->_depth_pyramid, this->_device, this->_allocator);
+    destroy_image(this->_draw_image, this->_device, this->_allocator);
+
+    // Graph transients and the tracked state of the imported images go with the targets
+    this->_render_graph.destroy();
 }
 
 void fmvk::Vulkan::init_commands() {
@@ -519,16 +778,23 @@ void fmvk::Vulkan::init_commands() {
         VK_CHECK(vkCreateCommandPool(this->_device, &cmdp_info, nullptr, &_frame._command_pool));
         VkCommandBufferAllocateInfo alloc_info = VKInit::command_buffer_allocate_info(_frame._command_pool, 1);
         VK_CHECK(vkAllocateCommandBuffers(this->_device, &alloc_info, &_frame._main_command_buffer));
+
+        VkQueryPoolCreateInfo query_pool_info = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .pNext = nullptr,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = FM_TIMESTAMP_COUNT
+        };
+        VK_CHECK(vkCreateQueryPool(this->_device, &query_pool_info, nullptr, &_frame._timestamp_pool));
     
-        this->_deletion_queue.push_function([=, this]() {
+        this->_deletion_queue.push_function([&_frame, this]() {
+            vkDestroyQueryPool(this->_device, _frame._timestamp_pool, nullptr);
             vkDestroyCommandPool(this->_device, _frame._command_pool, nullptr);
         });
     }
 
-    // Init immediate command pool
+    // Init immediate command pool, its command buffers are allocated on demand
     VK_CHECK(vkCreateCommandPool(this->_device, &cmdp_info, nullptr, &this->_immediate_command_pool));
-    VkCommandBufferAllocateInfo immediata_alloc_info = VKInit::command_buffer_allocate_info(this->_immediate_command_pool, 1);
-    VK_CHECK(vkAllocateCommandBuffers(this->_device, &immediata_alloc_info, &this->_immediate_command_buffer));
 
     this->_deletion_queue.push_function([=, this]() {
         vkDestroyCommandPool(this->_device, this->_immediate_command_pool, nullptr);
@@ -536,21 +802,14 @@ void fmvk::Vulkan::init_commands() {
 }
 
 void fmvk::Vulkan::init_sync_structures() {
-    VkFenceCreateInfo fence_create_info = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .pNext = nullptr,
-        .flags = VK_FENCE_CREATE_SIGNALED_BIT
-    };
-    
     VkSemaphoreCreateInfo semaphore_create_info = {
         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
         .pNext = nullptr,
         .flags = 0
     };
 
-    // Create swapchain fence & semaphore
+    // Create swapchain acquire semaphores
     for (auto & _frame : this->_frames) {
-        VK_CHECK(vkCreateFence(this->_device, &fence_create_info, nullptr, &_frame._render_fence));
         VK_CHECK(vkCreateSemaphore(this->_device, &semaphore_create_info, nullptr, &_frame._swapchain_semaphore));
     }
 
@@ -561,35 +820,84 @@ void fmvk::Vulkan::init_sync_structures() {
         VK_CHECK(vkCreateSemaphore(this->_device, &semaphore_create_info, nullptr, &this->_swapchain.image_semaphores[i]));
     }
 
+    // Create the timeline semaphore
+    VkSemaphoreTypeCreateInfo timeline_type_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .pNext = nullptr,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0
+    };
+    VkSemaphoreCreateInfo timeline_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &timeline_type_info,
+        .flags = 0
+    };
+    VK_CHECK(vkCreateSemaphore(this->_device, &timeline_create_info, nullptr, &this->_timeline_semaphore));
+
     // ---------------
     // Deletion queues
     // ---------------
-    // Deletion queue for swapchain image semaphores
-    for (size_t i = 0; i < swapchain_image_count; i++) {
-        this->_deletion_queue.push_function([=, this]() {
-            vkDestroySemaphore(this->_device, this->_swapchain.image_semaphores[i], nullptr);
-        });
-    }
+    // Deletion queue for swapchain image semaphores, including the ones added when the swapchain is recreated
+    this->_deletion_queue.push_function([=, this]() {
+        for (auto semaphore : this->_swapchain.image_semaphores) {
+            vkDestroySemaphore(this->_device, semaphore, nullptr);
+        }
+    });
 
-    // Deletion queue for frame fence & semaphore
+    // Deletion queue for frame semaphores
     for (const auto & _frame : this->_frames) {
-        this->_deletion_queue.push_function([=, this]() {
+        this->_deletion_queue.push_function([&_frame, this]() {
             vkDestroySemaphore(this->_device, _frame._swapchain_semaphore, nullptr);
-            vkDestroyFence(this->_device, _frame._render_fence, nullptr);
         });
     }
 
-    VK_CHECK(vkCreateFence(this->_device, &fence_create_info, nullptr, &this->_immediate_fence));
     this->_deletion_queue.push_function([=, this]() { 
-        vkDestroyFence(this->_device, this->_immediate_fence, nullptr); 
+        vkDestroySemaphore(this->_device, this->_timeline_semaphore, nullptr); 
     });
 }
 
-void fmvk::Vulkan::immediate_submit(std::function<void(VkCommandBuffer cmd)> &&function) const {
-    VK_CHECK(vkResetFences(this->_device, 1, &_immediate_fence));
-    VK_CHECK(vkResetCommandBuffer(this->_immediate_command_buffer, 0));
+uint64_t fmvk::Vulkan::completed_timeline_value() const {
+    uint64_t value = 0;
+    VK_CHECK(vkGetSemaphoreCounterValue(this->_device, this->_timeline_semaphore, &value));
+    return value;
+}
+
+void fmvk::Vulkan::wait_timeline(uint64_t value) const {
+    VkSemaphoreWaitInfo wait_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .semaphoreCount = 1,
+        .pSemaphores = &this->_timeline_semaphore,
+        .pValues = &value
+    };
+    VK_CHECK(vkWaitSemaphores(this->_device, &wait_info, 1000000000));
+}
+
+// Records and submits without waiting, returns the timeline value that signals completion.
+// Frames wait on the last upload on the GPU, so results are visible to the next frame.
+uint64_t fmvk::Vulkan::immediate_submit(std::function<void(VkCommandBuffer cmd)> &&function) {
+    const uint64_t completed_value = completed_timeline_value();
+    this->_timeline_deletion_queue.flush(completed_value);
+
+    ImmediateCommand* immediate = nullptr;
+    for (auto& c : this->_immediate_commands) {
+        if (c.timeline_value <= completed_value) {
+            immediate = &c;
+            break;
+        }
+    }
+    if (immediate == nullptr) {
+        ImmediateCommand new_command = {};
+        VkCommandBufferAllocateInfo alloc_info = VKInit::command_buffer_allocate_info(this->_immediate_command_pool, 1);
+        VK_CHECK(vkAllocateCommandBuffers(this->_device, &alloc_info, &new_command.cmd));
+        this->_immediate_commands.push_back(new_command);
+        immediate = &this->_immediate_commands.back();
+    }
+
+    VK_CHECK(vkResetCommandBuffer(immediate->cmd, 0));
 
-    auto cmd = this->_immediate_command_buffer;
+    auto cmd = immediate->cmd;
     VkCommandBufferBeginInfo cmd_begin_info = VKInit::command_buffer_begin_info(
         VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
     );
@@ -599,13 +907,23 @@ void fmvk::Vulkan::immediate_submit(std::function<void(VkCommandBuffer cmd)> &&f
 
     VK_CHECK(vkEndCommandBuffer(cmd));
 
+    immediate->timeline_value = ++this->_timeline_value;
+    this->_upload_timeline_value = immediate->timeline_value;
+
     VkCommandBufferSubmitInfo cmd_info = VKInit::command_buffer_submit_info(cmd);
-    VkSubmitInfo2 submit = VKInit::submit_info(&cmd_info, nullptr, nullptr);
-    VK_CHECK(vkQueueSubmit2(this->_graphics_queue, 1, &submit, this->_immediate_fence));
-    VK_CHECK(vkWaitForFences(this->_device, 1, &this->_immediate_fence, true, 9999999999));
+    VkSemaphoreSubmitInfo signal_info = VKInit::semaphore_submit_info(VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, this->_timeline_semaphore, immediate->timeline_value);
+    VkSubmitInfo2 submit = VKInit::submit_info(&cmd_info, &signal_info, nullptr);
+    VK_CHECK(vkQueueSubmit2(this->_graphics_queue, 1, &submit, VK_NULL_HANDLE));
+
+    return immediate->timeline_value;
 }
 
 void fmvk::Vulkan::clean_pipelines() {
+    // A reload still compiling is swapped in, the frame deletion queues take care of what it replaced
+    if (this->_pipeline_compile.has_value()) {
+        swap_compiled_pipelines();
+    }
+
     for (auto &p : this->pipelines) {
         p.second.Cleanup(this->_device);
     }
@@ -613,23 +931,110 @@ void fmvk::Vulkan::clean_pipelines() {
     for (auto &p : this->compute_pipelines) {
         p.second.Cleanup(this->_device);
     }
-    this->metal_roughness_material.clear_resources(this->_device);
+    this->metal_roughness_material.clear_pipelines(this->_device);
 }
 
 void fmvk::Vulkan::init_pipelines() {
-    fmvk::ComputePipeline background_pipeline = {};
-    background_pipeline.Init(this->_device, "bg_gradient", this->_draw_image_descriptor_layout);
-    this->compute_pipelines["background"] = background_pipeline;
-    this->metal_roughness_material.build_pipelines(this);
+    reload_pipelines();
+    swap_compiled_pipelines();
+}
+
+void fmvk::Vulkan::reload_pipelines() {
+    if (this->_pipeline_compile.has_value()) {
+        fmt::println("Pipelines are still compiling, reload skipped");
+        return;
+    }
+
+    struct ComputeSource {
+        const char* name;
+        const char* shader_name;
+        VkDescriptorSetLayout descriptor_layout;
+    };
+    const ComputeSource compute_sources[] = {
+        { "background", "bg_gradient", this->_draw_image_descriptor_layout },
+        { "depth_pyramid", "depth_pyramid", this->_depth_pyramid_descriptor_layout },
+        { "occlusion_cull", "occlusion_cull", this->_occlusion_cull_descriptor_layout },
+        { "light_cluster", "light_cluster", this->_light_cluster_descriptor_layout },
+        { "upscale_easu", "upscale_easu", this->_upscale_descriptor_layout },
+        { "upscale_rcas", "upscale_rcas", this->_upscale_descriptor_layout },
+    };
+
+    PipelineCompile compile;
+    for (const auto& source : compute_sources) {
+        compile.compute.emplace_back(source.name, std::async(std::launch::async, [device = this->_device, source]() {
+            auto start = std::chrono::system_clock::now();
+            fmvk::ComputePipeline pipeline = {};
+            pipeline.Init(device, source.shader_name, source.descriptor_layout);
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start);
+            return CompiledComputePipeline { pipeline, elapsed.count() / 1000.0f };
+        }));
+    }
+
+    // The render thread keeps reassigning the targets, the build gets its own copy of what it needs
+    const GLTFMetallic_Roughness::BuildInfo build_info = {
+        .device = this->_device,
+        .color_format = this->_draw_image.format,
+        .depth_format = this->_depth_image.format,
+        .scene_layout = this->_gpu_scene_data_descriptor_layout,
+        .pipeline_library = this->_pipeline_library,
+        .fast_linking = this->_pipeline_library_fast_linking
+    };
+    compile.material = std::async(std::launch::async, [build_info, features = this->metal_roughness_material.variant_features()]() {
+        auto start = std::chrono::system_clock::now();
+        auto material = std::make_shared<GLTFMetallic_Roughness>();
+        material->build_pipelines(build_info, features);
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start);
+        return CompiledMaterial { material, elapsed.count() / 1000.0f };
+    });
+
+    this->_pipeline_compile = std::move(compile);
+}
+
+bool fmvk::Vulkan::pipelines_compiled() const {
+    auto ready = [](const auto& future) {
+        return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    };
+    for (const auto& [name, result] : this->_pipeline_compile->compute) {
+        if (!ready(result)) {
+            return false;
+        }
+    }
+    return ready(this->_pipeline_compile->material);
+}
+
+void fmvk::Vulkan::swap_compiled_pipelines() {
+    // Frames still in flight may use the replaced pipelines
+    auto& deletion_queue = get_current_frame()._deletion_queue;
+
+    for (auto& [name, result] : this->_pipeline_compile->compute) {
+        CompiledComputePipeline compiled = result.get();
+        fmt::println("Compiled pipeline {} in {:.2f} ms", name, compiled.compile_time);
+
+        auto current = this->compute_pipelines.find(name);
+        if (current != this->compute_pipelines.end()) {
+            deletion_queue.push_function([this, replaced = current->second]() mutable {
+                replaced.Cleanup(this->_device);
+            });
+        }
+        this->compute_pipelines[name] = compiled.pipeline;
+    }
+
+    CompiledMaterial compiled = this->_pipeline_compile->material.get();
+    fmt::println("Compiled material pipelines in {:.2f} ms", compiled.compile_time);
+    this->metal_roughness_material.swap_pipelines(*compiled.material);
+    this->_draw_generation++;
+    deletion_queue.push_function([this, replaced = compiled.material]() {
+        replaced->clear_pipelines(this->_device);
+    });
+
+    this->_pipeline_compile.reset();
 }
 
 // TODO: Move to Firemountain actual
-void fmvk::Vulkan::update_scene(const fmCamera* camera, std::vector<RenderSceneObj> scene)
+void fmvk::Vulkan::update_scene(const fmCamera* camera)
 {
     auto start = std::chrono::system_clock::now();
 
-    this->_main_draw_context.opaque_surfaces.clear();
-
     if (!this->ghost_mode && camera->debug_pov_lock) {
         this->ghost_mode = true;
         this->ghost_view = this->scene_data.view;
@@ -644,48 +1049,324 @@ void fmvk::Vulkan::update_scene(const fmCamera* camera, std::vector<RenderSceneO
     this->scene_data.view = camera->view;
     this->scene_data.projection = camera->projection;
 
-    // TODO: Light culling
-    size_t scene_light_idx = 0;
-    for (auto o : scene) {
-        if (o.light_id) {
-            GPULightData light = {
-                .positionType = o.light_position_type,
-                .colorIntensity = o.light_color_intensity,
-                .directionRange = o.light_direction_range
-            };
-            this->scene_data.lights[scene_light_idx] = light;
-            scene_light_idx += 1;
-        }
-        if (o.mesh_id) {
-            auto mesh = this->loaded_meshes.at(o.mesh_id.id);
-            mesh->Draw(o.transform, this->_main_draw_context);
+    // Lights are culled per cluster on the GPU, point lights go after the directional ones
+    if (this->_lights_dirty) {
+        std::vector<GPULightData> point_lights;
+        this->_scene_lights.clear();
+        for (const auto& [id, light] : this->_light_instances) {
+            if (light.positionType.w == (float) LightType::Point) {
+                point_lights.push_back(light);
+            } else {
+                this->_scene_lights.push_back(light);
+            }
         }
+        this->_directional_light_count = this->_scene_lights.size();
+        this->_scene_lights.insert(this->_scene_lights.end(), point_lights.begin(), point_lights.end());
+        this->scene_data.light_count = this->_scene_lights.size();
+        this->_lights_dirty = false;
     }
-    this->scene_data.light_count = scene_light_idx;
 
     auto end = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
     stats.scene_update_time = elapsed.count() / 1000.f;
 }
 
-void fmvk::Vulkan::draw_imgui(VkCommandBuffer cmd, const VkImageView image_view) const {
+void fmvk::Vulkan::clear_scene()
+{
+    this->_scene_instances.clear();
+    this->_light_instances.clear();
+    this->_lights_dirty = true;
+    this->_main_draw_context = {};
+    this->_opaque_owners.clear();
+    this->_masked_owners.clear();
+    this->_transparent_owners.clear();
+    this->_scene_objects.clear();
+    this->_free_objects.clear();
+    this->_dirty_objects.clear();
+    this->_surface_generation++;
+    this->_draw_generation++;
+}
+
+std::vector<fmvk::Vulkan::SurfaceOwner>& fmvk::Vulkan::surface_owners(const std::vector<RenderObject>& list)
+{
+    if (&list == &this->_main_draw_context.opaque_surfaces) {
+        return this->_opaque_owners;
+    } else if (&list == &this->_main_draw_context.masked_surfaces) {
+        return this->_masked_owners;
+    }
+    return this->_transparent_owners;
+}
+
+void fmvk::Vulkan::create_instance(InstanceID instance_id, MeshID mesh_id, const glm::mat4& transform)
+{
+    const uint32_t instance_index = instance_id.id - 1;
+    if (instance_index >= this->_scene_instances.size()) {
+        this->_scene_instances.resize(instance_index + 1);
+    }
+
+    // Records are prebuilt per asset, the surfaces keep their node transform to be placed later
+    const DrawContext& mesh_surfaces = this->loaded_meshes.at(mesh_id.id)->get_surfaces();
+
+    SceneInstance& instance = this->_scene_instances[instance_index];
+    instance = {};
+    auto add_surfaces = [&](const std::vector<RenderObject>& surfaces, std::vector<RenderObject>& list) {
+        std::vector<SurfaceOwner>& owners = surface_owners(list);
+        for (RenderObject object : surfaces) {
+            GPUObjectData record = {
+                .bounds_origin_radius = glm::vec4 { object.bounds.origin, object.bounds.sphere_radius },
+                .bounds_extents = glm::vec4 { object.bounds.extents, 0.0f }
+            };
+            if (!this->_free_objects.empty()) {
+                object.object_index = this->_free_objects.back();
+                this->_free_objects.pop_back();
+                this->_scene_objects[object.object_index] = record;
+            } else {
+                object.object_index = this->_scene_objects.size();
+                this->_scene_objects.push_back(record);
+            }
+
+            owners.push_back({ instance_index, (uint32_t) instance.surfaces.size() });
+            instance.surfaces.push_back({ &list, (uint32_t) list.size(), object.transform });
+            list.push_back(object);
+        }
+    };
+    add_surfaces(mesh_surfaces.opaque_surfaces, this->_main_draw_context.opaque_surfaces);
+    add_surfaces(mesh_surfaces.masked_surfaces, this->_main_draw_context.masked_surfaces);
+    add_surfaces(mesh_surfaces.transparent_surfaces, this->_main_draw_context.transparent_surfaces);
+
+    set_instance_transform(instance, transform);
+    this->_surface_generation++;
+    this->_draw_generation++;
+}
+
+void fmvk::Vulkan::destroy_instance(InstanceID instance_id)
+{
+    const uint32_t instance_index = instance_id.id - 1;
+    SceneInstance& instance = this->_scene_instances[instance_index];
+
+    for (const auto& surface : instance.surfaces) {
+        std::vector<RenderObject>& list = *surface.list;
+        std::vector<SurfaceOwner>& owners = surface_owners(list);
+        this->_free_objects.push_back(list[surface.index].object_index);
+
+        // The last entry of the list takes the place of the removed one
+        const uint32_t index = surface.index;
+        list[index] = list.back();
+        owners[index] = owners.back();
+        this->_scene_instances[owners[index].instance].surfaces[owners[index].surface].index = index;
+        list.pop_back();
+        owners.pop_back();
+    }
+    instance = {};
+
+    // Surface indices moved, occlusion starts over from everything being visible
+    this->_occlusion_visible.clear();
+    this->_surface_generation++;
+    this->_draw_generation++;
+}
+
+void fmvk::Vulkan::set_instance_transforms(std::span<const InstanceID> instance_ids, std::span<const glm::mat4> transforms)
+{
+    assert(instance_ids.size() == transforms.size());
+#ifndef NDEBUG
+    {
+        // Two workers placing the same instance would write the same records
+        std::vector<uint32_t> ids(instance_ids.size());
+        std::transform(instance_ids.begin(), instance_ids.end(), ids.begin(), [](InstanceID id) { return id.id; });
+        std::sort(ids.begin(), ids.end());
+        assert(std::adjacent_find(ids.begin(), ids.end()) == ids.end() && "instance ids of a batch have to be unique");
+    }
+#endif
+
+    // The instances of a batch are all different, so their surfaces are placed in parallel.
+    // The dirty list is shared and filled afterwards
+    std::vector<uint8_t> moved(instance_ids.size());
+    this->jobs->parallel_for(instance_ids.size(), 256, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            moved[i] = place_instance(this->_scene_instances[instance_ids[i].id - 1], transforms[i]);
+        }
+    });
+    for (size_t i = 0; i < instance_ids.size(); i++) {
+        if (moved[i]) {
+            mark_objects_dirty(this->_scene_instances[instance_ids[i].id - 1]);
+        }
+    }
+}
+
+void fmvk::Vulkan::set_light(LightID light_id, const GPULightData& light)
+{
+    GPULightData scene_light = light;
+
+    // Point lights need a finite range to be assigned to clusters
+    if (scene_light.positionType.w == (float) LightType::Point && scene_light.directionRange.w <= 0.0f) {
+        scene_light.directionRange.w = std::sqrt(scene_light.colorIntensity.w / LIGHT_ATTENUATION_CUTOFF);
+    }
+
+    // The light list is only packed again when a light actually changed
+    auto current = this->_light_instances.find(light_id.id);
+    if (current != this->_light_instances.end()
+        && current->second.positionType == scene_light.positionType
+        && current->second.colorIntensity == scene_light.colorIntensity
+        && current->second.directionRange == scene_light.directionRange
+        && current->second.info == scene_light.info) {
+        return;
+    }
+    this->_light_instances[light_id.id] = scene_light;
+    this->_lights_dirty = true;
+}
+
+void fmvk::Vulkan::remove_light(LightID light_id)
+{
+    this->_light_instances.erase(light_id.id);
+    this->_lights_dirty = true;
+}
+
+void fmvk::Vulkan::set_instance_transform(SceneInstance& instance, const glm::mat4& transform)
+{
+    if (place_instance(instance, transform)) {
+        mark_objects_dirty(instance);
+    }
+}
+
+// Returns false for an instance that didn't move
+bool fmvk::Vulkan::place_instance(SceneInstance& instance, const glm::mat4& transform)
+{
+    // Static instances are passed in every frame too, only the moved ones touch their records
+    if (instance.placed && instance.transform == transform) {
+        return false;
+    }
+    instance.transform = transform;
+    instance.placed = true;
+
+    for (const auto& surface : instance.surfaces) {
+        RenderObject& object = (*surface.list)[surface.index];
+        object.transform = transform * surface.node_transform;
+        this->_scene_objects[object.object_index].transform = object.transform;
+    }
+    return true;
+}
+
+void fmvk::Vulkan::mark_objects_dirty(const SceneInstance& instance)
+{
+    for (const auto& surface : instance.surfaces) {
+        this->_dirty_objects.push_back((*surface.list)[surface.index].object_index);
+    }
+    // Draws refer to the object records, only the culling of the moved surfaces has to be redone
+    this->_moved_instances.push_back(&instance - this->_scene_instances.data());
+}
+
+void fmvk::Vulkan::upload_scene_objects(VkCommandBuffer cmd)
+{
+    FrameData& frame = get_current_frame();
+
+    if (this->_object_capacity == 0 || this->_scene_objects.size() > this->_object_capacity) {
+        // Frames in flight keep reading the old buffer, every record is uploaded to the new one
+        if (this->_object_capacity > 0) {
+            fmvk::Buffer::AllocatedBuffer old_buffer = this->_object_buffer;
+            this->_timeline_deletion_queue.push_function(this->_timeline_value, [this, old_buffer]() {
+                fmvk::Buffer::destroy_buffer(old_buffer, this->_allocator);
+            });
+        }
+
+        this->_object_capacity = std::max<uint32_t>({ (uint32_t) this->_scene_objects.size(), this->_object_capacity * 2, 256 });
+        this->_object_buffer = fmvk::Buffer::create_buffer(
+            this->_object_capacity * sizeof(GPUObjectData),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VMA_MEMORY_USAGE_GPU_ONLY,
+            this->_allocator
+        );
+        this->_dirty_objects.resize(this->_scene_objects.size());
+        std::iota(this->_dirty_objects.begin(), this->_dirty_objects.end(), 0);
+    }
+
+    if (this->_dirty_objects.empty()) {
+        return;
+    }
+
+    // An object can be moved more than once before it's uploaded
+    std::sort(this->_dirty_objects.begin(), this->_dirty_objects.end());
+    this->_dirty_objects.erase(std::unique(this->_dirty_objects.begin(), this->_dirty_objects.end()), this->_dirty_objects.end());
+
+    // The frame's timeline value has been waited on, so the old staging buffer is no longer in use
+    uint32_t upload_count = this->_dirty_objects.size();
+    if (upload_count > frame._object_upload_capacity) {
+        if (frame._object_upload_capacity > 0) {
+            fmvk::Buffer::destroy_buffer(frame._object_upload, this->_allocator);
+        }
+        frame._object_upload_capacity = std::max({ upload_count, frame._object_upload_capacity * 2, 64u });
+        frame._object_upload = fmvk::Buffer::create_buffer(
+            frame._object_upload_capacity * sizeof(GPUObjectData),
+            VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+            VMA_MEMORY_USAGE_CPU_TO_GPU,
+            this->_allocator
+        );
+    }
+
+    auto staging = (GPUObjectData*) frame._object_upload.info.pMappedData;
+    std::pmr::vector<VkBufferCopy> regions(&frame._arena);
+    regions.reserve(upload_count);
+    for (uint32_t i = 0; i < upload_count; i++) {
+        uint32_t object_index = this->_dirty_objects[i];
+        staging[i] = this->_scene_objects[object_index];
+        regions.push_back(VkBufferCopy {
+            .srcOffset = i * sizeof(GPUObjectData),
+            .dstOffset = object_index * sizeof(GPUObjectData),
+            .size = sizeof(GPUObjectData)
+        });
+    }
+    this->_dirty_objects.clear();
+
+    // Earlier frames may still be reading the records that get replaced
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_NONE,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT
+    );
+    vkCmdCopyBuffer(cmd, frame._object_upload.buffer, this->_object_buffer.buffer, regions.size(), regions.data());
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_VERTEX_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+    );
+}
+
+void fmvk::Vulkan::build_ui() {
     ImGui_ImplVulkan_NewFrame();
     ImGui_ImplSDL3_NewFrame();
     ImGui::NewFrame();
 
     // Setup stats window
     ImGui::SetNextWindowPos(ImVec2(10, 10));
-    ImGui::SetNextWindowSize(ImVec2(300, 120));
+    ImGui::SetNextWindowSize(ImVec2(300, 293));
     ImGui::Begin("Stats");
     ImGui::Text("Frametime %f ms", stats.frametime);
     ImGui::Text("Draw time %f ms", stats.mesh_draw_time);
     ImGui::Text("Update time %f ms", stats.scene_update_time);
     ImGui::Text("Triangles %i", stats.triangle_count);
     ImGui::Text("Draw calls %i", stats.drawcall_count);
+    ImGui::Text("Occlusion culled %i", stats.occlusion_culled_count);
+    ImGui::Text("Cluster lights dropped %i", stats.cluster_lights_dropped);
+    ImGui::Text("Depth prepass %s", this->depth_prepass ? "on" : "off");
+    ImGui::Text("GPU depth prepass %f ms", stats.depth_prepass_gpu_time);
+    ImGui::Text("GPU occlusion cull %f ms", stats.occlusion_gpu_time);
+    ImGui::Text("GPU geometry %f ms", stats.geometry_gpu_time);
+    ImGui::Text("GPU frametime %f ms", stats.gpu_frametime);
+    ImGui::Text("Render scale %.2f", stats.render_scale);
+    ImGui::Text("Frame arena %i allocs, %i on heap", stats.frame_arena_allocations, stats.frame_heap_allocations);
+    ImGui::Text("Draw lists %s", stats.draw_lists_cached ? "cached" : "rebuilt");
+    ImGui::End();
+
+    // Busy time of every job worker since the last frame
+    const std::vector<JobSystem::WorkerStats> worker_stats = this->jobs->sample_stats();
+    ImGui::SetNextWindowPos(ImVec2(320, 10));
+    ImGui::SetNextWindowSize(ImVec2(300, 0));
+    ImGui::Begin("Jobs");
+    for (size_t i = 0; i < worker_stats.size(); i++) {
+        ImGui::Text("Worker %zu %3.0f%% %llu jobs %llu stolen", i, worker_stats[i].utilization * 100.0f,
+            (unsigned long long) worker_stats[i].jobs, (unsigned long long) worker_stats[i].steals);
+    }
     ImGui::End();
 
     // Setup camera info window
-    ImGui::SetNextWindowPos(ImVec2(10, 130));
+    ImGui::SetNextWindowPos(ImVec2(10, 313));
     ImGui::SetNextWindowSize(ImVec2(300, 85));
     ImGui::Begin("Camera");
 
@@ -699,12 +1380,18 @@ void fmvk::Vulkan::draw_imgui(VkCommandBuffer cmd, const VkImageView image_view)
 
     ImGui::End();
     ImGui::Render();
+}
+
+void fmvk::Vulkan::draw_imgui(VkCommandBuffer cmd, const VkImageView image_view, ImDrawData* ui_draw_data) const {
+    if (!ui_draw_data) {
+        return;
+    }
 
-    VkRenderingAttachmentInfo color_attachment = VKInit::attachment_info(image_view, nullptr, VK_IMAGE_LAYOUT_GENERAL);
+    VkRenderingAttachmentInfo color_attachment = VKInit::attachment_info(image_view, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
     VkRenderingInfo render_info = VKInit::rendering_info(this->_swapchain.extent, &color_attachment, nullptr);
     vkCmdBeginRendering(cmd, &render_info);
 
-    ImGui_ImplVulkan_RenderDrawData(ImGui::GetDrawData(), cmd);
+    ImGui_ImplVulkan_RenderDrawData(ui_draw_data, cmd);
 
     vkCmdEndRendering(cmd);
 }
@@ -714,10 +1401,18 @@ void fmvk::Vulkan::draw_background(VkCommandBuffer cmd)
     // TODO: I'm missing the ComputeEffect thing
     auto bg_pipeline = this->compute_pipelines["background"];
     vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, bg_pipeline.pipeline);
-    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, bg_pipeline.layout, 0, 1, &this->_draw_image_descriptors, 0, nullptr);
 
-    // Background color gradient
-    ComputePushConstants pc = {
+    // Allocated per frame, the draw image can be replaced while the previous frame is still in flight
+    VkDescriptorSet draw_image_set = get_current_frame()._frame_descriptors.allocate(this->_device, this->_draw_image_descriptor_layout);
+    {
+        DescriptorWriter writer { &get_current_frame()._arena };
+        writer.write_image(0, this->_draw_image.view, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+        writer.update_set(this->_device, draw_image_set);
+    }
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, bg_pipeline.layout, 0, 1, &draw_image_set, 0, nullptr);
+
+    // Background color gradient
+    ComputePushConstants pc = {
         .data_1 = glm::fvec4(0.10f, 0.10f, 0.10f, 1.0f),
         .data_2 = glm::fvec4(0.16f, 0.18f, 0.20f, 1.0f)
     };
@@ -726,13 +1421,215 @@ void fmvk::Vulkan::draw_background(VkCommandBuffer cmd)
     vkCmdDispatch(cmd, std::ceil(this->_draw_extent.width / 16.0), std::ceil(this->_draw_extent.height / 16.0), 1);
 }
 
-void fmvk::Vulkan::draw_geometry(VkCommandBuffer cmd, RenderObject* render_objects, uint32_t render_object_count) {
+// Culls and sorts the surfaces into the draw lists of the cache, together with the indirect data of each draw
+void fmvk::Vulkan::build_draw_lists(const glm::mat4& view_projection, bool use_occlusion) {
+    FrameData& frame = get_current_frame();
+    DrawListCache& cache = this->_draw_cache;
+    auto& opaque_surfaces = this->_main_draw_context.opaque_surfaces;
+
+    // Frustum visible opaque surfaces. With occlusion culling on, the ones that weren't visible
+    // the last time are held back for the second pass
+    std::vector<uint32_t>& opaque_draws = cache.opaque_draws;
+    opaque_draws.clear();
+    std::vector<uint32_t>& late_draws = cache.late_draws;
+    late_draws.clear();
+    std::pmr::vector<ScreenBounds> surface_bounds(use_occlusion ? opaque_surfaces.size() : 0, &frame._arena);
+
+    // Surfaces are tested in parallel, then put in their lists in order
+    std::vector<uint8_t>& opaque_visible = cache.opaque_visible;
+    opaque_visible.assign(opaque_surfaces.size(), 0);
+    this->jobs->parallel_for(opaque_surfaces.size(), 512, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            ScreenBounds bounds;
+            opaque_visible[i] = is_visible(opaque_surfaces[i], view_projection, &bounds);
+            if (use_occlusion && opaque_visible[i]) {
+                surface_bounds[i] = bounds;
+            }
+        }
+    });
+    for (uint32_t i = 0; i < opaque_surfaces.size(); i++) {
+        if (!opaque_visible[i]) {
+            continue;
+        }
+
+        if (!use_occlusion || this->_occlusion_visible[i] != 0) {
+            opaque_draws.push_back(i);
+        } else {
+            late_draws.push_back(i);
+        }
+    }
+
+    // Alpha masked surfaces discard, they are kept out of the opaque passes so those keep early depth testing
+    auto& masked_surfaces = this->_main_draw_context.masked_surfaces;
+    std::vector<uint32_t>& masked_draws = cache.masked_draws;
+    masked_draws.clear();
+    std::vector<uint8_t>& masked_visible = cache.masked_visible;
+    masked_visible.assign(masked_surfaces.size(), 0);
+    this->jobs->parallel_for(masked_surfaces.size(), 512, [&](uint32_t begin, uint32_t end) {
+        for (uint32_t i = begin; i < end; i++) {
+            masked_visible[i] = is_visible(masked_surfaces[i], view_projection);
+        }
+    });
+    for (uint32_t i = 0; i < masked_surfaces.size(); i++) {
+        if (masked_visible[i]) {
+            masked_draws.push_back(i);
+        }
+    }
+
+    // Materials are indexed from the material buffer, so neighbours that share the pipeline
+    // and index buffer end up in the same indirect draw
+    auto draw_order = [&](const RenderObject& A, const RenderObject& B) {
+        if (A.material->pipeline != B.material->pipeline) {
+            return A.material->pipeline < B.material->pipeline;
+        }
+        return A.index_buffer < B.index_buffer;
+    };
+    auto sort_draws = [&](std::span<uint32_t> draws, const std::vector<RenderObject>& surfaces) {
+        std::sort(draws.begin(), draws.end(),
+            [&](const auto& iA, const auto& iB) {
+                return draw_order(surfaces[iA], surfaces[iB]);
+        });
+    };
+    JobCounter sorted;
+    this->jobs->run([&]() { sort_draws(late_draws, opaque_surfaces); }, &sorted);
+    this->jobs->run([&]() { sort_draws(masked_draws, masked_surfaces); }, &sorted);
+    sort_draws(opaque_draws, opaque_surfaces);
+    this->jobs->wait(sorted);
+
+    auto& transparent_surfaces = this->_main_draw_context.transparent_surfaces;
+    std::vector<uint32_t>& transparent_draws = cache.transparent_draws;
+    transparent_draws.resize(transparent_surfaces.size());
+    std::iota(transparent_draws.begin(), transparent_draws.end(), 0);
+
+    // Every draw gets a slot in the frame's command and draw data buffers, each list is one range of them
+    const uint32_t late_first = opaque_draws.size();
+    const uint32_t masked_first = late_first + late_draws.size();
+    const uint32_t transparent_first = masked_first + masked_draws.size();
+    const uint32_t draw_count = transparent_first + transparent_draws.size();
+    cache.draw_data.resize(draw_count);
+    cache.draw_commands.resize(draw_count);
+
+    auto write_draws = [&](std::span<const uint32_t> draws, const std::vector<RenderObject>& surfaces, uint32_t first_slot) {
+        this->jobs->parallel_for(draws.size(), 1024, [&](uint32_t begin, uint32_t end) {
+            for (uint32_t d = begin; d < end; d++) {
+                const RenderObject& object = surfaces[draws[d]];
+                const uint32_t slot = first_slot + d;
+                cache.draw_data[slot] = GPUDrawData {
+                    .vertex_buffer = object.vertex_buffer_address,
+                    .position_buffer = object.position_buffer_address,
+                    .object_index = object.object_index,
+                    .material_index = object.material->material_index
+                };
+                cache.draw_commands[slot] = VkDrawIndexedIndirectCommand {
+                    .indexCount = object.index_count,
+                    .instanceCount = 1,
+                    .firstIndex = object.first_index,
+                    .vertexOffset = 0,
+                    .firstInstance = slot
+                };
+            }
+        });
+    };
+    write_draws(opaque_draws, opaque_surfaces, 0);
+    write_draws(late_draws, opaque_surfaces, late_first);
+    write_draws(masked_draws, masked_surfaces, masked_first);
+    write_draws(transparent_draws, transparent_surfaces, transparent_first);
+
+    // Candidates are the opaque slots, early draws first. The late ones keep their own
+    // commands since the cull shader sets their instance count
+    const uint32_t candidate_count = use_occlusion ? masked_first : 0;
+    cache.occlusion_candidates.resize(candidate_count);
+    cache.occlusion_objects.resize(candidate_count);
+    cache.occlusion_commands.resize(candidate_count);
+    cache.opaque_candidate.assign(opaque_surfaces.size(), UINT32_MAX);
+    for (uint32_t candidate = 0; candidate < candidate_count; candidate++) {
+        const bool drawn_early = candidate < late_first;
+        const uint32_t i = drawn_early ? opaque_draws[candidate] : late_draws[candidate - late_first];
+        const ScreenBounds& bounds = surface_bounds[i];
+        cache.occlusion_candidates[candidate] = i;
+        cache.opaque_candidate[i] = candidate;
+
+        cache.occlusion_objects[candidate] = GPUOcclusionObject {
+            .rect = bounds.rect,
+            .depth = bounds.depth,
+            .flags = (drawn_early ? OCCLUSION_FLAG_EARLY : 0) | (bounds.valid ? 0 : OCCLUSION_FLAG_SKIP_TEST)
+        };
+
+        // Instance count is filled in by the cull shader
+        cache.occlusion_commands[candidate] = cache.draw_commands[candidate];
+        cache.occlusion_commands[candidate].instanceCount = 0;
+    }
+
+    cache.generation = this->_draw_generation;
+    cache.view_projection = view_projection;
+    cache.use_occlusion = use_occlusion;
+    cache.build++;
+    this->_moved_instances.clear();
+}
+
+// Draws only refer to the object records, so a moved surface that stays on the same side of the frustum
+// leaves the lists as they are and only its occlusion bounds change. False if the lists have to be rebuilt
+bool fmvk::Vulkan::patch_draw_lists(const glm::mat4& view_projection) {
+    DrawListCache& cache = this->_draw_cache;
+    const auto& opaque_surfaces = this->_main_draw_context.opaque_surfaces;
+    const auto& masked_surfaces = this->_main_draw_context.masked_surfaces;
+
+    bool bounds_changed = false;
+    for (uint32_t instance_index : this->_moved_instances) {
+        for (const auto& surface : this->_scene_instances[instance_index].surfaces) {
+            const RenderObject& object = (*surface.list)[surface.index];
+
+            if (surface.list == &opaque_surfaces) {
+                ScreenBounds bounds;
+                if (is_visible(object, view_projection, &bounds) != (cache.opaque_visible[surface.index] != 0)) {
+                    return false;
+                }
+
+                const uint32_t candidate = cache.opaque_candidate[surface.index];
+                if (candidate != UINT32_MAX) {
+                    GPUOcclusionObject& occlusion_object = cache.occlusion_objects[candidate];
+                    occlusion_object.rect = bounds.rect;
+                    occlusion_object.depth = bounds.depth;
+                    occlusion_object.flags = (occlusion_object.flags & OCCLUSION_FLAG_EARLY) | (bounds.valid ? 0 : OCCLUSION_FLAG_SKIP_TEST);
+                    bounds_changed = true;
+                }
+            }
+            else if (surface.list == &masked_surfaces) {
+                if (is_visible(object, view_projection) != (cache.masked_visible[surface.index] != 0)) {
+                    return false;
+                }
+            }
+        }
+    }
+    this->_moved_instances.clear();
+
+    // The frames upload the patched occlusion objects like a new build
+    if (bounds_changed) {
+        cache.build++;
+    }
+    return true;
+}
+
+void fmvk::Vulkan::prepare_geometry(VkCommandBuffer cmd) {
     stats.drawcall_count = 0;
     stats.triangle_count = 0;
     auto start = std::chrono::system_clock::now();
 
-    std::vector<uint32_t> opaque_draws;
-    opaque_draws.reserve(this->_main_draw_context.opaque_surfaces.size());
+    FrameData& frame = get_current_frame();
+    auto& opaque_surfaces = this->_main_draw_context.opaque_surfaces;
+    auto& masked_surfaces = this->_main_draw_context.masked_surfaces;
+    auto& transparent_surfaces = this->_main_draw_context.transparent_surfaces;
+
+    // Results written by this frame slot's previous submission are complete now that its timeline value was reached
+    read_occlusion_results(frame);
+    if (this->_occlusion_visible.size() != opaque_surfaces.size()) {
+        // The surface list changed, start over from everything being visible
+        this->_occlusion_visible.assign(opaque_surfaces.size(), 1);
+        this->_draw_generation++;
+    }
+
+    // The ghost camera doesn't match the depth buffer, so occlusion is only tested from the real one
+    const bool use_occlusion = this->occlusion_culling && !this->ghost_mode;
 
     glm::mat4 view_projection {};
     if (this->ghost_mode) {
@@ -742,43 +1639,69 @@ void fmvk::Vulkan::draw_geometry(VkCommandBuffer cmd, RenderObject* render_objec
         view_projection = scene_data.projection * scene_data.view;
     }
 
-    for (uint32_t i = 0; i < this->_main_draw_context.opaque_surfaces.size(); i++) {
-        if (is_visible(this->_main_draw_context.opaque_surfaces[i], view_projection)) {
-            opaque_draws.push_back(i);
-        }
+    // The lists of an earlier frame still hold while nothing they were built from changed
+    DrawListCache& cache = this->_draw_cache;
+    const bool lists_cached = this->cache_draw_lists
+        && cache.build != 0
+        && cache.generation == this->_draw_generation
+        && cache.use_occlusion == use_occlusion
+        && cache.view_projection == view_projection
+        && patch_draw_lists(view_projection);
+    if (!lists_cached) {
+        build_draw_lists(view_projection, use_occlusion);
     }
+    stats.draw_lists_cached = lists_cached;
 
-    std::sort(opaque_draws.begin(), opaque_draws.end(),
-        [&](const auto& iA, const auto& iB) {
-            const RenderObject& A = this->_main_draw_context.opaque_surfaces[iA];
-            const RenderObject& B = this->_main_draw_context.opaque_surfaces[iB];
-            if (A.material == B.material) {
-                return A.index_buffer < B.index_buffer;
-            } else {
-                return A.material < B.material;
-            }
-    });
+    const uint32_t draw_count = cache.opaque_draws.size() + cache.late_draws.size() + cache.masked_draws.size() + cache.transparent_draws.size();
+    const uint32_t candidate_count = cache.occlusion_candidates.size();
 
-    // TODO: give the function a render target to support multiple passes?
-    VkRenderingAttachmentInfo color_attachment = VKInit::attachment_info(this->_draw_image.view, nullptr, VK_IMAGE_LAYOUT_GENERAL);
-    VkRenderingAttachmentInfo depth_attachment = VKInit::depth_attachment_info(this->_depth_image.view, VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL);
-    VkRenderingInfo render_info = VKInit::rendering_info(this->_draw_extent, &color_attachment, &depth_attachment);
-    vkCmdBeginRendering(cmd, &render_info);
+    // The frame's buffers are only written when they hold an older build of the lists
+    if (frame._draw_build != cache.build) {
+        reserve_draw_buffers(frame, draw_count);
+        if (draw_count > 0) {
+            memcpy(frame._draw_data.info.pMappedData, cache.draw_data.data(), draw_count * sizeof(GPUDrawData));
+            memcpy(frame._draw_commands.info.pMappedData, cache.draw_commands.data(), draw_count * sizeof(VkDrawIndexedIndirectCommand));
+        }
+        if (candidate_count > 0) {
+            reserve_occlusion_buffers(frame, candidate_count);
+            memcpy(frame._occlusion_objects.info.pMappedData, cache.occlusion_objects.data(), candidate_count * sizeof(GPUOcclusionObject));
+            memcpy(frame._occlusion_commands.info.pMappedData, cache.occlusion_commands.data(), candidate_count * sizeof(VkDrawIndexedIndirectCommand));
+        }
+        frame._draw_build = cache.build;
+    }
+    if (candidate_count > 0) {
+        frame._occlusion_candidates.assign(cache.occlusion_candidates.begin(), cache.occlusion_candidates.end());
+        frame._occlusion_surface_generation = this->_surface_generation;
+    }
 
 
+    // Object records of the surfaces that moved
+    upload_scene_objects(cmd);
+
     // Scene Data buffer
     //===========================================
 
-    // Allocate uniform buffer for the scene data
-    fmvk::Buffer::AllocatedBuffer gpu_scene_data_buffer = fmvk::Buffer::create_buffer(sizeof(GPUSceneData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, this->_allocator);
-    get_current_frame()._deletion_queue.push_function([=, this]() {
-        fmvk::Buffer::destroy_buffer(gpu_scene_data_buffer, this->_allocator);
-    });
+    // The frame's own uniform buffer, its previous contents were consumed once the timeline value was reached
+    fmvk::Buffer::AllocatedBuffer& gpu_scene_data_buffer = frame._scene_buffer;
+
+    // Light clusters cover the viewport
+    this->scene_data.cluster_grid = glm::uvec4 { CLUSTER_GRID_X, CLUSTER_GRID_Y, CLUSTER_GRID_Z, this->_directional_light_count };
+    this->scene_data.cluster_params = glm::vec4 {
+        CLUSTER_Z_NEAR,
+        CLUSTER_Z_FAR,
+        (float) this->_draw_extent.width,
+        (float) this->_draw_extent.height
+    };
 
     // Write the buffer
     auto scene_uniform_data = (GPUSceneData*) gpu_scene_data_buffer.allocation->GetMappedData();
     *scene_uniform_data = this->scene_data;
 
+    // Upload the lights
+    read_light_cluster_usage(frame);
+    reserve_light_buffers(frame, this->_scene_lights.size());
+    memcpy(frame._lights.info.pMappedData, this->_scene_lights.data(), this->_scene_lights.size() * sizeof(GPULightData));
+
 
     // Bindless things
     VkDescriptorSetVariableDescriptorCountAllocateInfo alloc_array_info = {
@@ -796,37 +1719,102 @@ void fmvk::Vulkan::draw_geometry(VkCommandBuffer cmd, RenderObject* render_objec
         _gpu_scene_data_descriptor_layout,
         &alloc_array_info
     );
-    DescriptorWriter writer;
+    DescriptorWriter writer { &frame._arena };
     writer.write_buffer(0, gpu_scene_data_buffer.buffer, sizeof(GPUSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    writer.write_buffer(1, frame._lights.buffer, frame._light_capacity * sizeof(GPULightData), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(2, frame._cluster_grid.buffer, CLUSTER_COUNT * sizeof(glm::uvec2), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(3, frame._cluster_light_indices.buffer, frame._cluster_index_capacity * sizeof(uint32_t), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(4, this->_material_buffer.buffer, this->_material_capacity * sizeof(GLTFMetallic_Roughness::MaterialConstants), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(5, this->_object_buffer.buffer, this->_object_capacity * sizeof(GPUObjectData), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
 
     if (texture_cache.cache.size() > 0) {
         VkWriteDescriptorSet array_set { .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
         array_set.descriptorCount = texture_cache.cache.size();
         array_set.dstArrayElement = 0;
         array_set.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        array_set.dstBinding = 1;
+        array_set.dstBinding = 6;
         array_set.pImageInfo = texture_cache.cache.data();
         writer.writes.push_back(array_set);
     }
     writer.update_set(this->_device, global_descriptor);
 
+    cull_lights(cmd, gpu_scene_data_buffer.buffer);
+
+    this->_geometry_frame = GeometryFrame {
+        .global_descriptor = global_descriptor,
+        .use_prepass = this->depth_prepass,
+        .use_occlusion = use_occlusion && !frame._occlusion_candidates.empty()
+    };
+
+    auto end = std::chrono::system_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    stats.mesh_draw_time = elapsed.count() / 1000.0f;
+}
+
+void fmvk::Vulkan::draw_geometry(VkCommandBuffer cmd, GeometryPass pass) {
+    auto start = std::chrono::system_clock::now();
+
+    FrameData& frame = get_current_frame();
+    const GeometryFrame& geometry = this->_geometry_frame;
+    const VkDescriptorSet global_descriptor = geometry.global_descriptor;
+    auto& opaque_surfaces = this->_main_draw_context.opaque_surfaces;
+    auto& masked_surfaces = this->_main_draw_context.masked_surfaces;
+    auto& transparent_surfaces = this->_main_draw_context.transparent_surfaces;
+
+    const DrawListCache& cache = this->_draw_cache;
+    const std::vector<uint32_t>& opaque_draws = cache.opaque_draws;
+    const std::vector<uint32_t>& late_draws = cache.late_draws;
+    const std::vector<uint32_t>& masked_draws = cache.masked_draws;
+    const std::vector<uint32_t>& transparent_draws = cache.transparent_draws;
+    const uint32_t late_first = opaque_draws.size();
+    const uint32_t masked_first = late_first + late_draws.size();
+    const uint32_t transparent_first = masked_first + masked_draws.size();
+
     MaterialPipeline* last_pipeline = nullptr;
-    MaterialInstance* last_material = nullptr;
     VkBuffer last_index_buffer = VK_NULL_HANDLE;
-    auto draw = [&](const RenderObject& object) {
-        if (object.material != last_material) {
-            last_material = object.material;
-
-            if (object.material->pipeline != last_pipeline) {
-                last_pipeline = object.material->pipeline;
-                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object.material->pipeline->pipeline);
-                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object.material->pipeline->layout, 0, 1, &global_descriptor, 0, nullptr);
-                
+
+    // Pass state for the submit function
+    const bool depth_only = geometry.use_prepass && pass != GeometryPass::SHADING;   // Depth prepass: position stream only, no material
+    const bool depth_equal = geometry.use_prepass && pass == GeometryPass::SHADING;  // Opaque depth has been laid down by the prepass
+    auto pass_pipeline = [&](const RenderObject& object) {
+        if (depth_only) {
+            return &this->metal_roughness_material.depth_prepass_pipeline;
+        }
+        else if (depth_equal) {
+            return object.material->depth_equal_pipeline;
+        }
+        return object.material->pipeline;
+    };
+
+    // Draws a list with one indirect call per run of draws that share the pipeline and index buffer.
+    // The commands of the list start at first_slot in the given buffer
+    auto submit = [&](std::span<const uint32_t> draws, const std::vector<RenderObject>& surfaces, uint32_t first_slot, VkBuffer commands) {
+        uint32_t d = 0;
+        while (d < draws.size()) {
+            const RenderObject& object = surfaces[draws[d]];
+            MaterialPipeline* pipeline = pass_pipeline(object);
+
+            uint32_t run_end = d + 1;
+            uint32_t triangle_count = object.index_count / 3;
+            while (run_end < draws.size()) {
+                const RenderObject& next = surfaces[draws[run_end]];
+                if (next.index_buffer != object.index_buffer || pass_pipeline(next) != pipeline) {
+                    break;
+                }
+                triangle_count += next.index_count / 3;
+                run_end++;
+            }
+
+            if (pipeline != last_pipeline) {
+                last_pipeline = pipeline;
+                vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline);
+                vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout, 0, 1, &global_descriptor, 0, nullptr);
+
                 VkViewport viewport = {
                     .x = 0,
                     .y = 0,
-                    .width = (float) this->_window_extent.width,
-                    .height = (float) this->_window_extent.height,
+                    .width = (float) this->_draw_extent.width,
+                    .height = (float) this->_draw_extent.height,
                     .minDepth = 0.0f,
                     .maxDepth = 1.0f
                 };
@@ -835,47 +1823,502 @@ void fmvk::Vulkan::draw_geometry(VkCommandBuffer cmd, RenderObject* render_objec
                 VkRect2D scissor = {
                     .offset = { .x = 0, .y = 0},
                     .extent = { 
-                        .width = this->_window_extent.width, 
-                        .height = this->_window_extent.height 
+                        .width = this->_draw_extent.width, 
+                        .height = this->_draw_extent.height 
                     }
                 };
                 vkCmdSetScissor(cmd, 0, 1, &scissor);
+
+                GPUDrawPushConstants constants = {
+                    .draw_data = frame._draw_data_address
+                };
+                vkCmdPushConstants(cmd, pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushConstants), &constants);
             }
 
-            vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, object.material->pipeline->layout, 1, 1, &object.material->material_set, 0, nullptr);
+            if (object.index_buffer != last_index_buffer) {
+                last_index_buffer = object.index_buffer;
+                vkCmdBindIndexBuffer(cmd, object.index_buffer, 0, VK_INDEX_TYPE_UINT32);
+            }
+
+            vkCmdDrawIndexedIndirect(
+                cmd,
+                commands,
+                (first_slot + d) * sizeof(VkDrawIndexedIndirectCommand),
+                run_end - d,
+                sizeof(VkDrawIndexedIndirectCommand)
+            );
+
+            stats.drawcall_count++;
+            stats.triangle_count += triangle_count;
+            d = run_end;
         }
+    };
 
-        if (object.index_buffer != last_index_buffer) {
-            last_index_buffer = object.index_buffer;
-            vkCmdBindIndexBuffer(cmd, object.index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    // Only the first pass clears depth, the later ones test against it
+    VkRenderingAttachmentInfo color_attachment = VKInit::attachment_info(this->_draw_image.view, nullptr, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
+    VkRenderingAttachmentInfo depth_attachment = VKInit::depth_attachment_info(
+        this->_depth_image.view,
+        VK_IMAGE_LAYOUT_DEPTH_ATTACHMENT_OPTIMAL,
+        pass == GeometryPass::EARLY ? VK_ATTACHMENT_LOAD_OP_CLEAR : VK_ATTACHMENT_LOAD_OP_LOAD
+    );
+    VkRenderingInfo render_info = VKInit::rendering_info(this->_draw_extent, &color_attachment, &depth_attachment);
+    VkRenderingInfo depth_render_info = VKInit::rendering_info(this->_draw_extent, nullptr, &depth_attachment);
+    VkRenderingInfo* opaque_render_info = geometry.use_prepass ? &depth_render_info : &render_info;
+
+    switch (pass) {
+    case GeometryPass::EARLY:
+        // The ranges of the steps that don't run this frame are left empty
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_GEOMETRY_BEGIN);
+        if (!geometry.use_prepass) {
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_DEPTH_PREPASS_END);
         }
-        
-        GPUDrawPushConstants constants = {
-            .world_matrix = object.transform,
-            .vertex_buffer = object.vertex_buffer_address
-        };
-        vkCmdPushConstants(cmd, object.material->pipeline->layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(GPUDrawPushConstants), &constants);
-        vkCmdDrawIndexed(cmd, object.index_count, 1, object.first_index, 0, 0);
+        if (!geometry.use_occlusion) {
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_OCCLUSION_BEGIN);
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_OCCLUSION_END);
+        }
+
+        // Everything that was visible the last time we looked
+        vkCmdBeginRendering(cmd, opaque_render_info);
+        submit(opaque_draws, opaque_surfaces, 0, frame._draw_commands.buffer);
+        vkCmdEndRendering(cmd);
+
+        if (geometry.use_prepass && !geometry.use_occlusion) {
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_DEPTH_PREPASS_END);
+        }
+        break;
 
-        stats.drawcall_count++;
-        stats.triangle_count += object.index_count / 3;
+    case GeometryPass::LATE:
+        vkCmdBeginRendering(cmd, opaque_render_info);
+        submit(late_draws, opaque_surfaces, late_first, frame._occlusion_commands.buffer);
+        vkCmdEndRendering(cmd);
+
+        if (geometry.use_prepass) {
+            vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_DEPTH_PREPASS_END);
+        }
+        break;
+
+    case GeometryPass::SHADING:
+        vkCmdBeginRendering(cmd, &render_info);
+
+        // Every opaque fragment that survives the EQUAL test is the visible one
+        if (geometry.use_prepass) {
+            submit(opaque_draws, opaque_surfaces, 0, frame._draw_commands.buffer);
+            submit(late_draws, opaque_surfaces, late_first, frame._occlusion_commands.buffer);
+        }
+        submit(masked_draws, masked_surfaces, masked_first, frame._draw_commands.buffer);
+        submit(transparent_draws, transparent_surfaces, transparent_first, frame._draw_commands.buffer);
+
+        vkCmdEndRendering(cmd);
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, frame._timestamp_pool, FM_TIMESTAMP_GEOMETRY_END);
+        break;
+    }
+
+    auto end = std::chrono::system_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+    stats.mesh_draw_time += elapsed.count() / 1000.0f;
+}
+
+void fmvk::Vulkan::reserve_draw_buffers(FrameData& frame, uint32_t draw_count) {
+    if (draw_count <= frame._draw_capacity) {
+        return;
+    }
+
+    // The frame's timeline value has been waited on, so the old buffers are no longer in use
+    if (frame._draw_capacity > 0) {
+        fmvk::Buffer::destroy_buffer(frame._draw_commands, this->_allocator);
+        fmvk::Buffer::destroy_buffer(frame._draw_data, this->_allocator);
+    }
+
+    frame._draw_capacity = std::max({ draw_count, frame._draw_capacity * 2, 256u });
+    frame._draw_commands = fmvk::Buffer::create_buffer(
+        frame._draw_capacity * sizeof(VkDrawIndexedIndirectCommand),
+        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU,
+        this->_allocator
+    );
+    frame._draw_data = fmvk::Buffer::create_buffer(
+        frame._draw_capacity * sizeof(GPUDrawData),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU,
+        this->_allocator
+    );
+
+    VkBufferDeviceAddressInfo device_address_info {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = frame._draw_data.buffer
     };
+    frame._draw_data_address = vkGetBufferDeviceAddress(this->_device, &device_address_info);
+}
 
-    for (auto& r : opaque_draws) {
-        draw(this->_main_draw_context.opaque_surfaces[r]);
+void fmvk::Vulkan::read_gpu_timings(FrameData& frame) {
+    if (!frame._timestamps_written) {
+        return;
     }
-    for (auto& r : this->_main_draw_context.transparent_surfaces) {
-        draw(r);
+
+    uint64_t timestamps[FM_TIMESTAMP_COUNT];
+    VkResult result = vkGetQueryPoolResults(
+        this->_device,
+        frame._timestamp_pool,
+        0,
+        FM_TIMESTAMP_COUNT,
+        sizeof(timestamps),
+        timestamps,
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT
+    );
+    if (result != VK_SUCCESS) {
+        return;
     }
 
-    vkCmdEndRendering(cmd);
+    const float ticks_to_ms = this->_timestamp_period / 1000000.0f;
+    const uint64_t occlusion_ticks = timestamps[FM_TIMESTAMP_OCCLUSION_END] - timestamps[FM_TIMESTAMP_OCCLUSION_BEGIN];
+    uint64_t depth_prepass_ticks = timestamps[FM_TIMESTAMP_DEPTH_PREPASS_END] - timestamps[FM_TIMESTAMP_GEOMETRY_BEGIN];
+    uint64_t geometry_ticks = timestamps[FM_TIMESTAMP_GEOMETRY_END] - timestamps[FM_TIMESTAMP_DEPTH_PREPASS_END];
 
-    this->_main_draw_context.opaque_surfaces.clear();
-    this->_main_draw_context.transparent_surfaces.clear();
+    // The pyramid and the cull run between the early and late pass, inside the prepass range when it is on
+    if (timestamps[FM_TIMESTAMP_OCCLUSION_END] <= timestamps[FM_TIMESTAMP_DEPTH_PREPASS_END]) {
+        depth_prepass_ticks -= std::min(occlusion_ticks, depth_prepass_ticks);
+    } else {
+        geometry_ticks -= std::min(occlusion_ticks, geometry_ticks);
+    }
 
-    auto end = std::chrono::system_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-    stats.mesh_draw_time = elapsed.count() / 1000.0f;
+    stats.depth_prepass_gpu_time = depth_prepass_ticks * ticks_to_ms;
+    stats.occlusion_gpu_time = occlusion_ticks * ticks_to_ms;
+    stats.geometry_gpu_time = geometry_ticks * ticks_to_ms;
+    stats.gpu_frametime = (timestamps[FM_TIMESTAMP_FRAME_END] - timestamps[FM_TIMESTAMP_FRAME_BEGIN]) * ticks_to_ms;
+
+    update_render_scale(stats.gpu_frametime);
+}
+
+void fmvk::Vulkan::update_render_scale(float gpu_frametime) {
+    if (!this->dynamic_resolution) {
+        this->_render_scale = 1.0f;
+    }
+    else if (gpu_frametime > 0.0f) {
+        // GPU time scales roughly with the pixel count, so with the square of the render scale.
+        // Move only part of the way there each frame to ride out single slow frames without oscillating.
+        float desired_scale = this->_render_scale * std::sqrt(this->target_gpu_frametime / gpu_frametime);
+        this->_render_scale += (desired_scale - this->_render_scale) * 0.1f;
+        this->_render_scale = std::clamp(this->_render_scale, this->min_render_scale, 1.0f);
+    }
+    stats.render_scale = this->_render_scale;
+}
+
+// ===========
+//  Upscaling
+// ===========
+
+// Edge adaptive upsampling from the rendered part of the draw image into the upscale image
+void fmvk::Vulkan::upscale_easu(VkCommandBuffer cmd) {
+    auto easu_pipeline = this->compute_pipelines["upscale_easu"];
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, easu_pipeline.pipeline);
+
+    VkDescriptorSet easu_set = get_current_frame()._frame_descriptors.allocate(this->_device, this->_upscale_descriptor_layout);
+    DescriptorWriter writer { &get_current_frame()._arena };
+    writer.write_image(0, this->_upscale_image.view, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    writer.write_image(1, this->_draw_image.view, this->_upscale_sampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    writer.update_set(this->_device, easu_set);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, easu_pipeline.layout, 0, 1, &easu_set, 0, nullptr);
+
+    ComputePushConstants pc = {
+        .data_1 = glm::vec4(
+            (float) this->_draw_extent.width,
+            (float) this->_draw_extent.height,
+            (float) this->_draw_image.extent.width,
+            (float) this->_draw_image.extent.height
+        ),
+        .data_2 = glm::vec4((float) this->_swapchain.extent.width, (float) this->_swapchain.extent.height, 0.0f, 0.0f)
+    };
+    vkCmdPushConstants(cmd, easu_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &pc);
+    vkCmdDispatch(cmd, std::ceil(this->_swapchain.extent.width / 16.0), std::ceil(this->_swapchain.extent.height / 16.0), 1);
+}
+
+// Sharpen the upscale image back into the draw image
+void fmvk::Vulkan::upscale_rcas(VkCommandBuffer cmd) {
+    auto rcas_pipeline = this->compute_pipelines["upscale_rcas"];
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, rcas_pipeline.pipeline);
+
+    VkDescriptorSet rcas_set = get_current_frame()._frame_descriptors.allocate(this->_device, this->_upscale_descriptor_layout);
+    DescriptorWriter writer { &get_current_frame()._arena };
+    writer.write_image(0, this->_draw_image.view, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+    writer.write_image(1, this->_upscale_image.view, this->_upscale_sampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    writer.update_set(this->_device, rcas_set);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, rcas_pipeline.layout, 0, 1, &rcas_set, 0, nullptr);
+
+    ComputePushConstants pc = {
+        .data_1 = glm::vec4((float) this->_swapchain.extent.width, (float) this->_swapchain.extent.height, this->sharpness, 0.0f),
+        .data_2 = glm::vec4((float) this->_upscale_image.extent.width, (float) this->_upscale_image.extent.height, 0.0f, 0.0f)
+    };
+    vkCmdPushConstants(cmd, rcas_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &pc);
+    vkCmdDispatch(cmd, std::ceil(this->_swapchain.extent.width / 16.0), std::ceil(this->_swapchain.extent.height / 16.0), 1);
+}
+
+// ==================
+//  Clustered lights
+// ==================
+
+void fmvk::Vulkan::reserve_light_buffers(FrameData& frame, uint32_t light_count) {
+    // Every point light in every cluster is the worst case, but the list is sized for an average density
+    // until the clusters asked for more
+    uint32_t point_light_count = light_count - this->_directional_light_count;
+    uint32_t index_capacity = std::max(1 + CLUSTER_COUNT * std::clamp(point_light_count, 1u, CLUSTER_AVERAGE_LIGHTS), this->_cluster_index_demand);
+    if (light_count <= frame._light_capacity && index_capacity <= frame._cluster_index_capacity) {
+        return;
+    }
+
+    // The frame's timeline value has been waited on, so the old buffers are no longer in use
+    if (frame._light_capacity > 0) {
+        fmvk::Buffer::destroy_buffer(frame._lights, this->_allocator);
+        fmvk::Buffer::destroy_buffer(frame._cluster_grid, this->_allocator);
+        fmvk::Buffer::destroy_buffer(frame._cluster_light_indices, this->_allocator);
+        fmvk::Buffer::destroy_buffer(frame._cluster_index_usage, this->_allocator);
+    }
+
+    frame._light_capacity = std::max({ light_count, frame._light_capacity * 2, 64u });
+    frame._cluster_index_capacity = std::max(index_capacity, frame._cluster_index_capacity);
+
+    frame._lights = fmvk::Buffer::create_buffer(
+        frame._light_capacity * sizeof(GPULightData),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU,
+        this->_allocator
+    );
+    frame._cluster_grid = fmvk::Buffer::create_buffer(
+        CLUSTER_COUNT * sizeof(glm::uvec2),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY,
+        this->_allocator
+    );
+    frame._cluster_light_indices = fmvk::Buffer::create_buffer(
+        frame._cluster_index_capacity * sizeof(uint32_t),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_ONLY,
+        this->_allocator
+    );
+    frame._cluster_index_usage = fmvk::Buffer::create_buffer(
+        sizeof(uint32_t),
+        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_TO_CPU,
+        this->_allocator
+    );
+    *(uint32_t*) frame._cluster_index_usage.info.pMappedData = 0;
+}
+
+void fmvk::Vulkan::read_light_cluster_usage(FrameData& frame) {
+    if (frame._light_capacity == 0) {
+        this->stats.cluster_lights_dropped = 0;
+        return;
+    }
+
+    // The counter holds every index the clusters of the slot's previous frame asked for, also the ones that didn't fit
+    vmaInvalidateAllocation(this->_allocator, frame._cluster_index_usage.allocation, 0, VK_WHOLE_SIZE);
+    const uint32_t needed = 1 + *(uint32_t*) frame._cluster_index_usage.info.pMappedData;
+    if (needed <= frame._cluster_index_capacity) {
+        this->stats.cluster_lights_dropped = 0;
+        return;
+    }
+
+    // Some headroom, so a slowly growing demand doesn't reallocate every frame
+    this->stats.cluster_lights_dropped = needed - frame._cluster_index_capacity;
+    this->_cluster_index_demand = std::max(this->_cluster_index_demand, needed + needed / 4);
+}
+
+void fmvk::Vulkan::cull_lights(VkCommandBuffer cmd, VkBuffer scene_buffer) {
+    FrameData& frame = get_current_frame();
+
+    // Reset the light index allocation counter
+    vkCmdFillBuffer(cmd, frame._cluster_light_indices.buffer, 0, sizeof(uint32_t), 0);
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+    );
+
+    auto cluster_pipeline = this->compute_pipelines["light_cluster"];
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cluster_pipeline.pipeline);
+
+    VkDescriptorSet cluster_set = frame._frame_descriptors.allocate(this->_device, this->_light_cluster_descriptor_layout);
+    DescriptorWriter writer { &frame._arena };
+    writer.write_buffer(0, scene_buffer, sizeof(GPUSceneData), 0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+    writer.write_buffer(1, frame._lights.buffer, frame._light_capacity * sizeof(GPULightData), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(2, frame._cluster_grid.buffer, CLUSTER_COUNT * sizeof(glm::uvec2), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(3, frame._cluster_light_indices.buffer, frame._cluster_index_capacity * sizeof(uint32_t), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.update_set(this->_device, cluster_set);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cluster_pipeline.layout, 0, 1, &cluster_set, 0, nullptr);
+
+    ComputePushConstants pc = {
+        .data_1 = glm::vec4((float) frame._cluster_index_capacity, 0.0f, 0.0f, 0.0f)
+    };
+    vkCmdPushConstants(cmd, cluster_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &pc);
+    vkCmdDispatch(cmd, std::ceil(CLUSTER_COUNT / 64.0), 1, 1);
+
+    // Cluster light lists are read by the mesh pixel shader
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT
+    );
+
+    // The allocation counter is read back once the frame is done, to grow the list when it overflowed
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT
+    );
+    VkBufferCopy counter_copy = { .srcOffset = 0, .dstOffset = 0, .size = sizeof(uint32_t) };
+    vkCmdCopyBuffer(cmd, frame._cluster_light_indices.buffer, frame._cluster_index_usage.buffer, 1, &counter_copy);
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT
+    );
+}
+
+// ===================
+//  Occlusion culling
+// ===================
+
+void fmvk::Vulkan::read_occlusion_results(FrameData& frame) {
+    if (frame._occlusion_candidates.empty()) {
+        this->stats.occlusion_culled_count = 0;
+        return;
+    }
+
+    // Candidates refer to surface indices, which only hold while no surface was added or removed since
+    if (frame._occlusion_surface_generation == this->_surface_generation) {
+        vmaInvalidateAllocation(this->_allocator, frame._occlusion_visibility.allocation, 0, VK_WHOLE_SIZE);
+        auto visibility = (uint32_t*) frame._occlusion_visibility.info.pMappedData;
+
+        this->stats.occlusion_culled_count = visibility[0];
+        bool changed = false;
+        for (size_t c = 0; c < frame._occlusion_candidates.size(); c++) {
+            const uint8_t visible = visibility[1 + c] != 0;
+            changed |= this->_occlusion_visible[frame._occlusion_candidates[c]] != visible;
+            this->_occlusion_visible[frame._occlusion_candidates[c]] = visible;
+        }
+        // Surfaces moved between the early and late lists
+        if (changed) {
+            this->_draw_generation++;
+        }
+    }
+    frame._occlusion_candidates.clear();
+}
+
+void fmvk::Vulkan::reserve_occlusion_buffers(FrameData& frame, uint32_t object_count) {
+    if (object_count <= frame._occlusion_capacity) {
+        return;
+    }
+
+    // The frame's timeline value has been waited on, so the old buffers are no longer in use
+    if (frame._occlusion_capacity > 0) {
+        fmvk::Buffer::destroy_buffer(frame._occlusion_objects, this->_allocator);
+        fmvk::Buffer::destroy_buffer(frame._occlusion_commands, this->_allocator);
+        fmvk::Buffer::destroy_buffer(frame._occlusion_visibility, this->_allocator);
+    }
+
+    uint32_t capacity = std::max({ object_count, frame._occlusion_capacity * 2, 256u });
+    frame._occlusion_objects = fmvk::Buffer::create_buffer(
+        capacity * sizeof(GPUOcclusionObject),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU,
+        this->_allocator
+    );
+    frame._occlusion_commands = fmvk::Buffer::create_buffer(
+        capacity * sizeof(VkDrawIndexedIndirectCommand),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+        VMA_MEMORY_USAGE_CPU_TO_GPU,
+        this->_allocator
+    );
+    frame._occlusion_visibility = fmvk::Buffer::create_buffer(
+        (capacity + 1) * sizeof(uint32_t),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VMA_MEMORY_USAGE_GPU_TO_CPU,
+        this->_allocator
+    );
+    frame._occlusion_capacity = capacity;
+}
+
+void fmvk::Vulkan::build_depth_pyramid(VkCommandBuffer cmd) {
+    auto pyramid_pipeline = this->compute_pipelines["depth_pyramid"];
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pyramid_pipeline.pipeline);
+
+    VkExtent2D level_extent = this->_depth_pyramid_extent;
+    for (size_t level = 0; level < this->_depth_pyramid_mips.size(); level++) {
+        VkDescriptorSet level_set = get_current_frame()._frame_descriptors.allocate(this->_device, this->_depth_pyramid_descriptor_layout);
+
+        DescriptorWriter writer { &get_current_frame()._arena };
+        writer.write_image(0, this->_depth_pyramid_mips[level], VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+
+        // The first level reduces the drawn part of the depth buffer, the rest the level above them
+        glm::vec2 uv_scale { 1.0f };
+        if (level == 0) {
+            writer.write_image(1, this->_depth_image.view, this->_depth_reduction_sampler, VK_IMAGE_LAYOUT_DEPTH_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+            uv_scale = {
+                (float) this->_draw_extent.width / this->_depth_image.extent.width,
+                (float) this->_draw_extent.height / this->_depth_image.extent.height
+            };
+        } else {
+            writer.write_image(1, this->_depth_pyramid_mips[level - 1], this->_depth_reduction_sampler, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        }
+        writer.update_set(this->_device, level_set);
+
+        vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pyramid_pipeline.layout, 0, 1, &level_set, 0, nullptr);
+
+        ComputePushConstants pc = {
+            .data_1 = glm::vec4((float) level_extent.width, (float) level_extent.height, uv_scale.x, uv_scale.y)
+        };
+        vkCmdPushConstants(cmd, pyramid_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &pc);
+        vkCmdDispatch(cmd, std::ceil(level_extent.width / 16.0), std::ceil(level_extent.height / 16.0), 1);
+
+        // Next level samples the one just written
+        VKUtil::memory_barrier(cmd,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_SAMPLED_READ_BIT
+        );
+
+        level_extent.width = std::max(level_extent.width / 2, 1u);
+        level_extent.height = std::max(level_extent.height / 2, 1u);
+    }
+}
+
+void fmvk::Vulkan::cull_occluded(VkCommandBuffer cmd, uint32_t object_count) {
+    FrameData& frame = get_current_frame();
+
+    // Reset the culled object counter
+    vkCmdFillBuffer(cmd, frame._occlusion_visibility.buffer, 0, sizeof(uint32_t), 0);
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT
+    );
+
+    auto cull_pipeline = this->compute_pipelines["occlusion_cull"];
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline.pipeline);
+
+    VkDescriptorSet cull_set = frame._frame_descriptors.allocate(this->_device, this->_occlusion_cull_descriptor_layout);
+    DescriptorWriter writer { &frame._arena };
+    writer.write_buffer(0, frame._occlusion_objects.buffer, object_count * sizeof(GPUOcclusionObject), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(1, frame._occlusion_commands.buffer, object_count * sizeof(VkDrawIndexedIndirectCommand), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_buffer(2, frame._occlusion_visibility.buffer, (object_count + 1) * sizeof(uint32_t), 0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    writer.write_image(3, this->_depth_pyramid.view, this->_depth_reduction_sampler, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+    writer.update_set(this->_device, cull_set);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline.layout, 0, 1, &cull_set, 0, nullptr);
+
+    ComputePushConstants pc = {
+        .data_1 = glm::vec4(
+            (float) this->_depth_pyramid_extent.width,
+            (float) this->_depth_pyramid_extent.height,
+            (float) object_count,
+            (float) this->_depth_pyramid_mips.size()
+        )
+    };
+    vkCmdPushConstants(cmd, cull_pipeline.layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(ComputePushConstants), &pc);
+    vkCmdDispatch(cmd, std::ceil(object_count / 64.0), 1, 1);
+
+    // Late draws read the instance counts, the CPU reads visibility once the frame has finished
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT
+    );
+    VKUtil::memory_barrier(cmd,
+        VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+        VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT
+    );
 }
 
 // =================
@@ -904,43 +2347,121 @@ void fmvk::Vulkan::init_descriptors() {
     {
         DescriptorLayoutBuilder builder;
         builder.add_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-        builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);  // Lights
+        builder.add_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);  // Light cluster grid
+        builder.add_binding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);  // Light cluster indices
+        builder.add_binding(4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);  // Material constants
+        builder.add_binding(5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);  // Scene objects
+
+        // Bindless textures, the variable sized binding has to be the last one
+        builder.add_binding(6, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
 
         VkDescriptorSetLayoutBindingFlagsCreateInfo bind_flags = {
             .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
             .pNext = nullptr
         };
-        std::array<VkDescriptorBindingFlags, 2> flags = { 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT };
-        builder.bindings[1].descriptorCount = 4080;
-        bind_flags.bindingCount = 2;
+        std::array<VkDescriptorBindingFlags, 7> flags = { 0, 0, 0, 0, 0, 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT };
+        builder.bindings[6].descriptorCount = 4080;
+        bind_flags.bindingCount = 7;
         bind_flags.pBindingFlags = flags.data();
         this->_gpu_scene_data_descriptor_layout = builder.build(this->_device, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, &bind_flags);
     }
 
+    // Depth pyramid reduction descriptor
+    {
+        DescriptorLayoutBuilder builder;
+        builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+        builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        this->_depth_pyramid_descriptor_layout = builder.build(this->_device, VK_SHADER_STAGE_COMPUTE_BIT);
+    }
+
+    // Occlusion cull descriptor
+    {
+        DescriptorLayoutBuilder builder;
+        builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        builder.add_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        builder.add_binding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        this->_occlusion_cull_descriptor_layout = builder.build(this->_device, VK_SHADER_STAGE_COMPUTE_BIT);
+    }
+
+    // Light cluster assignment descriptor
+    {
+        DescriptorLayoutBuilder builder;
+        builder.add_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+        builder.add_binding(1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        builder.add_binding(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        builder.add_binding(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+        this->_light_cluster_descriptor_layout = builder.build(this->_device, VK_SHADER_STAGE_COMPUTE_BIT);
+    }
+
+    // Upscaler descriptor, shared by the upsampling and sharpening passes
+    {
+        DescriptorLayoutBuilder builder;
+        builder.add_binding(0, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
+        builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
+        this->_upscale_descriptor_layout = builder.build(this->_device, VK_SHADER_STAGE_COMPUTE_BIT);
+    }
+
+    VkSamplerCreateInfo upscale_sampler_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .pNext = nullptr,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE
+    };
+    VK_CHECK(vkCreateSampler(this->_device, &upscale_sampler_info, nullptr, &this->_upscale_sampler));
+
+    // Min reduction sampler, returns the farthest depth of the filter footprint
+    VkSamplerReductionModeCreateInfo reduction_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_REDUCTION_MODE_CREATE_INFO,
+        .pNext = nullptr,
+        .reductionMode = VK_SAMPLER_REDUCTION_MODE_MIN
+    };
+    VkSamplerCreateInfo reduction_sampler_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .pNext = &reduction_info,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .minLod = 0.0f,
+        .maxLod = 16.0f
+    };
+    VK_CHECK(vkCreateSampler(this->_device, &reduction_sampler_info, nullptr, &this->_depth_reduction_sampler));
+
     _deletion_queue.push_function([&]() {
         vkDestroyDescriptorSetLayout(_device, this->_draw_image_descriptor_layout , nullptr);
         vkDestroyDescriptorSetLayout(_device, this->_gpu_scene_data_descriptor_layout, nullptr);
+        vkDestroyDescriptorSetLayout(_device, this->_depth_pyramid_descriptor_layout, nullptr);
+        vkDestroyDescriptorSetLayout(_device, this->_occlusion_cull_descriptor_layout, nullptr);
+        vkDestroyDescriptorSetLayout(_device, this->_light_cluster_descriptor_layout, nullptr);
+        vkDestroyDescriptorSetLayout(_device, this->_upscale_descriptor_layout, nullptr);
+        vkDestroySampler(_device, this->_upscale_sampler, nullptr);
+        vkDestroySampler(_device, this->_depth_reduction_sampler, nullptr);
     });
 
-    this->_draw_image_descriptors = this->global_descriptor_allocator.allocate(this->_device, this->_draw_image_descriptor_layout);
-    {
-        DescriptorWriter writer;
-        writer.write_image(0, this->_draw_image.view, VK_NULL_HANDLE, VK_IMAGE_LAYOUT_GENERAL, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE);
-        writer.update_set(this->_device, this->_draw_image_descriptors);
-    }
-    
     for (int i = 0; i < FRAME_OVERLAP; i++) {
         std::vector<DescriptorAllocatorGrowable::PoolSizeRatio> frame_sizes = {
             { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3 },
-            { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 },
+            { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5 },
             { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 3 },
             { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4}
         };
 
         this->_frames[i]._frame_descriptors = DescriptorAllocatorGrowable {};
         this->_frames[i]._frame_descriptors.init(this->_device, 1000, frame_sizes);
+
+        // Scene uniforms are rewritten every frame, each frame slot has its own buffer
+        this->_frames[i]._scene_buffer = fmvk::Buffer::create_buffer(sizeof(GPUSceneData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, this->_allocator);
         this->_deletion_queue.push_function([&, i]() {
             this->_frames[i]._frame_descriptors.destroy_pools(this->_device); 
+            fmvk::Buffer::destroy_buffer(this->_frames[i]._scene_buffer, this->_allocator);
         });
     }
 }
@@ -961,7 +2482,7 @@ fmvk::Image::AllocatedImage fmvk::Vulkan::create_image(void *data, VkExtent3D si
         mipmapped
     );
 
-    immediate_submit([&](VkCommandBuffer cmd) {
+    const uint64_t upload_value = immediate_submit([&](VkCommandBuffer cmd) {
         VKUtil::transition_image(cmd, new_image.image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
         VkBufferImageCopy copy_region = {
             .bufferOffset = 0,
@@ -995,7 +2516,9 @@ fmvk::Image::AllocatedImage fmvk::Vulkan::create_image(void *data, VkExtent3D si
             );
         }
     });
-    fmvk::Buffer::destroy_buffer(upload_buffer, this->_allocator);
+    this->_timeline_deletion_queue.push_function(upload_value, [=, this]() {
+        fmvk::Buffer::destroy_buffer(upload_buffer, this->_allocator);
+    });
     return new_image;
 }
 
@@ -1068,82 +2591,93 @@ void fmvk::Vulkan::init_default_textures()
 // This should also be in Firemountain
 void fmvk::Vulkan::init_default_data()
 {
-    GLTFMetallic_Roughness::MaterialResources material_resources = {
-        .color_image = this->_texture_missing_error_image,
-        .color_sampler = this->_default_sampler_linear,
-        .metal_roughness_image = this->_default_texture_white,
-        .metal_roughness_sampler = this->_default_sampler_linear,
-        .normal_image = this->_default_texture_black,
-        .normal_sampler = this->_default_sampler_linear,
-        .emissive_image = this->_default_texture_black,
-        .emissive_sampler = this->_default_sampler_linear
+    GLTFMetallic_Roughness::MaterialConstants constants = {
+        .color_factors = glm::vec4 { 1.0f, 1.0f, 1.0f, 1.0f },
+        .metal_roughness_factors = glm::vec2 { 1.0f, 0.5f }
     };
+    constants.color_tex_id = this->texture_cache.add_texture(this->_texture_missing_error_image.view, this->_default_sampler_linear).index;
+    constants.metal_roughness_tex_id = this->texture_cache.add_texture(this->_default_texture_white.view, this->_default_sampler_linear).index;
+    constants.normal_tex_id = this->texture_cache.add_texture(this->_default_texture_black.view, this->_default_sampler_linear).index;
+    constants.emissive_tex_id = constants.normal_tex_id;
 
-    fmvk::Buffer::AllocatedBuffer material_constants = fmvk::Buffer::create_buffer(
-        sizeof(GLTFMetallic_Roughness::MaterialConstants),
-        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-        VMA_MEMORY_USAGE_CPU_TO_GPU,
-        this->_allocator
-    );
-
-    auto scene_uniform_data = (GLTFMetallic_Roughness::MaterialConstants*) material_constants.allocation->GetMappedData();
-    scene_uniform_data->color_factors = glm::vec4 { 1.0f, 1.0f, 1.0f, 1.0f};
-    scene_uniform_data->metal_roughness_factors = glm::vec4 { 1.0f, 0.5f, 0.0f, 0.0f };
-
-    // TODO: This might cause problems
-    this->_deletion_queue.push_function([=, this]() {
-        fmvk::Buffer::destroy_buffer(material_constants, this->_allocator);
+    this->_deletion_queue.push_function([this]() {
+        fmvk::Buffer::destroy_buffer(this->_material_buffer, this->_allocator);
     });
 
-    material_resources.data_buffer = material_constants.buffer;
-    material_resources.data_buffer_offset = 0;
-
     this->default_data = metal_roughness_material.write_material(
-        this->_device,
         MaterialPass::FM_MATERIAL_PASS_OPAQUE,
-        material_resources,
-        this->global_descriptor_allocator
+        0,
+        add_material_constants(constants)
     );
 }
 
-void MeshNode::Draw(const glm::mat4 &top_matrix, DrawContext &ctx)
+uint32_t fmvk::Vulkan::add_material_constants(const GLTFMetallic_Roughness::MaterialConstants& constants)
 {
-    glm::mat4 node_matrix = top_matrix * this->world_transform;
-    for (auto& s : this->mesh->surfaces) {
-        RenderObject object = {
-            .index_count = s.count,
-            .first_index = s.start_index,
-            .index_buffer = this->mesh->mesh_buffers.index_buffer.buffer,
-            .material = &s.material->data,
-            .bounds = s.bounds,
-            .transform = node_matrix,
-            .vertex_buffer_address = this->mesh->mesh_buffers.vertex_buffer_address
-        };
+    uint32_t material_index = this->_material_constants.size();
+    if (!this->_free_material_indices.empty()) {
+        material_index = this->_free_material_indices.back();
+        this->_free_material_indices.pop_back();
+        this->_material_constants[material_index] = constants;
+    } else {
+        this->_material_constants.push_back(constants);
+    }
 
-        if (s.material->data.pass_type == MaterialPass::FM_MATERIAL_PASS_TRANSPARENT) {
-            ctx.transparent_surfaces.push_back(object);
-        } else {
-            ctx.opaque_surfaces.push_back(object);
+    if (this->_material_constants.size() > this->_material_capacity) {
+        // Frames in flight keep reading the old buffer, it goes once they are done
+        if (this->_material_capacity > 0) {
+            fmvk::Buffer::AllocatedBuffer old_buffer = this->_material_buffer;
+            this->_timeline_deletion_queue.push_function(this->_timeline_value, [this, old_buffer]() {
+                fmvk::Buffer::destroy_buffer(old_buffer, this->_allocator);
+            });
         }
+
+        this->_material_capacity = std::max<uint32_t>(this->_material_capacity * 2, 256);
+        this->_material_buffer = fmvk::Buffer::create_buffer(
+            this->_material_capacity * sizeof(GLTFMetallic_Roughness::MaterialConstants),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VMA_MEMORY_USAGE_CPU_TO_GPU,
+            this->_allocator
+        );
+        memcpy(
+            this->_material_buffer.info.pMappedData,
+            this->_material_constants.data(),
+            this->_material_constants.size() * sizeof(GLTFMetallic_Roughness::MaterialConstants)
+        );
+    } else {
+        // Slots are only reused once no frame can read them anymore, so it's written in place
+        auto materials = (GLTFMetallic_Roughness::MaterialConstants*) this->_material_buffer.info.pMappedData;
+        materials[material_index] = constants;
     }
-    Node::Draw(top_matrix, ctx);
+
+    return material_index;
+}
+
+void fmvk::Vulkan::remove_material_constants(uint32_t material_index)
+{
+    this->_timeline_deletion_queue.push_function(this->_timeline_value, [this, material_index]() {
+        this->_free_material_indices.push_back(material_index);
+    });
 }
 
-void fmvk::GLTFMetallic_Roughness::build_pipelines(const fmvk::Vulkan* renderer)
+void fmvk::GLTFMetallic_Roughness::build_pipelines(const BuildInfo& info, const std::vector<uint32_t>& features)
 {
-    // Shaders
+    this->device = info.device;
+    this->pipeline_library = info.pipeline_library;
+    this->fast_linking = info.fast_linking;
+    this->color_format = info.color_format;
+    this->depth_format = info.depth_format;
+
+    // Shaders, kept until the pipelines are cleared for the variants built later
     // -------------------------------------------------------------------------
     // TODO: Get shader paths from pipeline name. Use fmt::format
-    VkShaderModule pixel_shader;
-    if (!fmvk::load_shader_module("shaders/mesh_pixel.spv", renderer->_device, &pixel_shader)) {
+    if (!fmvk::load_shader_module("shaders/mesh_pixel.spv", this->device, &this->pixel_shader)) {
         fmt::println("Error building pixel shader module");
     }
     else {
         fmt::println("Fragment shader module loaded.");
     }
 
-    VkShaderModule vertex_shader;
-    if (!fmvk::load_shader_module("shaders/mesh_vertex.spv", renderer->_device, &vertex_shader)) {
+    if (!fmvk::load_shader_module("shaders/mesh_vertex.spv", this->device, &this->vertex_shader)) {
         fmt::println("Error building vertex shader module");
     } 
     else {
@@ -1159,124 +2693,301 @@ void fmvk::GLTFMetallic_Roughness::build_pipelines(const fmvk::Vulkan* renderer)
         .size = sizeof(GPUDrawPushConstants)
     };
 
-    DescriptorLayoutBuilder layout_builder;
-    layout_builder.add_binding(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
-    layout_builder.add_binding(1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layout_builder.add_binding(2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layout_builder.add_binding(3, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-    layout_builder.add_binding(4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER);
-
-    this->material_layout = layout_builder.build(
-        renderer->_device,
-        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT
-    );
-
-    VkDescriptorSetLayout layouts[] = {
-        renderer->_gpu_scene_data_descriptor_layout,
-        this->material_layout
-    };
-
+    // Shared by every variant, materials are indexed from the scene descriptor set
     VkPipelineLayoutCreateInfo mesh_layout_info = VKInit::pipeline_layout_create_info();
     mesh_layout_info.pPushConstantRanges = &push_constant_range;
     mesh_layout_info.pushConstantRangeCount = 1;
-    mesh_layout_info.pSetLayouts = layouts;
-    mesh_layout_info.setLayoutCount = 2;
+    mesh_layout_info.pSetLayouts = &info.scene_layout;
+    mesh_layout_info.setLayoutCount = 1;
+    VK_CHECK(vkCreatePipelineLayout(this->device, &mesh_layout_info, nullptr, &this->mesh_layout));
+
+    // Depth prepass
+    // -------------------------------------------------------------------------
+    VkShaderModule depth_vertex_shader;
+    if (!fmvk::load_shader_module("shaders/depth_only_vertex.spv", this->device, &depth_vertex_shader)) {
+        fmt::println("Error building depth only vertex shader module");
+    }
+    else {
+        fmt::println("Depth only vertex shader module loaded.");
+    }
 
-    VkPipelineLayout opaque_layout;
-    VK_CHECK(vkCreatePipelineLayout(renderer->_device, &mesh_layout_info,nullptr, &opaque_layout));
-    this->opaque_pipeline.layout = opaque_layout;
+    // Only the scene data is used, materials don't affect the depth of opaque surfaces
+    VkPipelineLayoutCreateInfo depth_layout_info = VKInit::pipeline_layout_create_info();
+    depth_layout_info.pPushConstantRanges = &push_constant_range;
+    depth_layout_info.pushConstantRangeCount = 1;
+    depth_layout_info.pSetLayouts = &info.scene_layout;
+    depth_layout_info.setLayoutCount = 1;
+
+    VkPipelineLayout depth_prepass_layout;
+    VK_CHECK(vkCreatePipelineLayout(this->device, &depth_layout_info, nullptr, &depth_prepass_layout));
+    this->depth_prepass_pipeline.layout = depth_prepass_layout;
+
+    fmvk::PipelineBuilder depth_builder;
+    depth_builder.set_vertex_shader_only(depth_vertex_shader);
+    depth_builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+    depth_builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+    depth_builder.set_cull_mode(VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE);
+    depth_builder.set_multisampling_none();
+    depth_builder.enable_depth_test(true, VK_COMPARE_OP_GREATER_OR_EQUAL);
+    depth_builder.set_depth_format(this->depth_format);
+    depth_builder._pipeline_layout = depth_prepass_layout;
+
+    if (this->pipeline_library) {
+        // Parts that don't depend on the material features are compiled once here.
+        // The variant layouts are identically defined, so the mesh parts are shared between them
+        fmvk::PipelineBuilder pipeline_builder;
+        configure_mesh_builder(pipeline_builder);
+        this->vertex_input_library = pipeline_builder.build_vertex_input_library(this->device);
+        this->mesh_pre_rasterization_library = pipeline_builder.build_pre_rasterization_library(this->device);
+
+        pipeline_builder.enable_blending_alphablend();
+        this->alphablend_output_library = pipeline_builder.build_fragment_output_library(this->device);
+        pipeline_builder.enable_blending_additive();
+        this->additive_output_library = pipeline_builder.build_fragment_output_library(this->device);
+
+        VkPipeline depth_pre_rasterization = depth_builder.build_pre_rasterization_library(this->device);
+        VkPipeline depth_fragment = depth_builder.build_fragment_shader_library(this->device);
+        VkPipeline depth_output = depth_builder.build_fragment_output_library(this->device);
+
+        this->pipeline_libraries = {
+            this->vertex_input_library, this->mesh_pre_rasterization_library,
+            this->alphablend_output_library, this->additive_output_library,
+            depth_pre_rasterization, depth_fragment, depth_output
+        };
 
-    VkPipelineLayout transparent_layout;
-    VK_CHECK(vkCreatePipelineLayout(renderer->_device, &mesh_layout_info,nullptr, &transparent_layout));
-    this->transparent_pipeline.layout = transparent_layout;
+        link_variant(this->depth_prepass_pipeline, { this->vertex_input_library, depth_pre_rasterization, depth_fragment, depth_output });
+    }
+    else {
+        this->depth_prepass_pipeline.pipeline = depth_builder.build_pipeline(this->device);
+    }
+
+    vkDestroyShaderModule(this->device, depth_vertex_shader, nullptr);
+
+    for (uint32_t feature_set : features) {
+        get_variants(feature_set);
+    }
+}
+
+void fmvk::GLTFMetallic_Roughness::configure_mesh_builder(fmvk::PipelineBuilder& builder) const
+{
+    builder.set_shaders(this->vertex_shader, this->pixel_shader);
+    builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+    builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
+    builder.set_cull_mode(VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE);
+    builder.set_multisampling_none();
+    builder.set_color_attachment_format(this->color_format);
+    builder.set_depth_format(this->depth_format);
+    builder._pipeline_layout = this->mesh_layout;
+}
+
+fmvk::GLTFMetallic_Roughness::FeatureVariants& fmvk::GLTFMetallic_Roughness::get_variants(uint32_t features)
+{
+    auto found = this->feature_variants.find(features);
+    if (found != this->feature_variants.end()) {
+        return found->second;
+    }
+
+    FeatureVariants& variants = this->feature_variants[features];
+    variants.opaque.layout = this->mesh_layout;
+    variants.transparent.layout = this->mesh_layout;
+    variants.opaque_depth_equal.layout = this->mesh_layout;
+
+    // One boolean constant per feature bit
+    std::array<VkBool32, FM_MATERIAL_FEATURE_COUNT> feature_values;
+    std::array<VkSpecializationMapEntry, FM_MATERIAL_FEATURE_COUNT> map_entries;
+    for (uint32_t i = 0; i < FM_MATERIAL_FEATURE_COUNT; i++) {
+        feature_values[i] = (features >> i) & 1u;
+        map_entries[i] = {
+            .constantID = i,
+            .offset = (uint32_t) (i * sizeof(VkBool32)),
+            .size = sizeof(VkBool32)
+        };
+    }
+    VkSpecializationInfo specialization = {
+        .mapEntryCount = (uint32_t) map_entries.size(),
+        .pMapEntries = map_entries.data(),
+        .dataSize = sizeof(feature_values),
+        .pData = feature_values.data()
+    };
 
-    // Pipeline builder
-    // -------------------------------------------------------------------------
     fmvk::PipelineBuilder pipeline_builder;
-    pipeline_builder.set_shaders(vertex_shader, pixel_shader);
-    pipeline_builder.set_input_topology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
-    pipeline_builder.set_polygon_mode(VK_POLYGON_MODE_FILL);
-    pipeline_builder.set_cull_mode(VK_CULL_MODE_BACK_BIT, VK_FRONT_FACE_COUNTER_CLOCKWISE);
-    pipeline_builder.set_multisampling_none();
-    pipeline_builder.enable_blending_alphablend();
-    pipeline_builder.enable_depth_test(true, VK_COMPARE_OP_GREATER_OR_EQUAL);
+    configure_mesh_builder(pipeline_builder);
+    pipeline_builder.set_specialization(VK_SHADER_STAGE_FRAGMENT_BIT, &specialization);
+
+    if (this->pipeline_library) {
+        // Only the fragment shader part is compiled per feature set
+        pipeline_builder.enable_depth_test(true, VK_COMPARE_OP_GREATER_OR_EQUAL);
+        VkPipeline opaque_fragment = pipeline_builder.build_fragment_shader_library(this->device);
+        pipeline_builder.enable_depth_test(false, VK_COMPARE_OP_GREATER_OR_EQUAL);
+        VkPipeline transparent_fragment = pipeline_builder.build_fragment_shader_library(this->device);
+        pipeline_builder.enable_depth_test(false, VK_COMPARE_OP_EQUAL);
+        VkPipeline depth_equal_fragment = pipeline_builder.build_fragment_shader_library(this->device);
+        this->pipeline_libraries.insert(this->pipeline_libraries.end(), { opaque_fragment, transparent_fragment, depth_equal_fragment });
+
+        link_variant(variants.opaque, { this->vertex_input_library, this->mesh_pre_rasterization_library, opaque_fragment, this->alphablend_output_library });
+        link_variant(variants.transparent, { this->vertex_input_library, this->mesh_pre_rasterization_library, transparent_fragment, this->additive_output_library });
+        link_variant(variants.opaque_depth_equal, { this->vertex_input_library, this->mesh_pre_rasterization_library, depth_equal_fragment, this->alphablend_output_library });
+    }
+    else {
+        pipeline_builder.enable_blending_alphablend();
+        pipeline_builder.enable_depth_test(true, VK_COMPARE_OP_GREATER_OR_EQUAL);
+        variants.opaque.pipeline = pipeline_builder.build_pipeline(this->device);
+
+        pipeline_builder.enable_blending_additive();
+        pipeline_builder.enable_depth_test(false, VK_COMPARE_OP_GREATER_OR_EQUAL);
+        variants.transparent.pipeline = pipeline_builder.build_pipeline(this->device);
 
-    // Set formats
-    pipeline_builder.set_color_attachment_format(renderer->_draw_image.format);
-    pipeline_builder.set_depth_format(renderer->_depth_image.format);
+        pipeline_builder.enable_blending_alphablend();
+        pipeline_builder.enable_depth_test(false, VK_COMPARE_OP_EQUAL);
+        variants.opaque_depth_equal.pipeline = pipeline_builder.build_pipeline(this->device);
+    }
+
+    return variants;
+}
 
-    // Build opaque pipeline
-    pipeline_builder._pipeline_layout = opaque_layout;
-    this->opaque_pipeline.pipeline = pipeline_builder.build_pipeline(renderer->_device);
+std::vector<uint32_t> fmvk::GLTFMetallic_Roughness::variant_features() const
+{
+    std::vector<uint32_t> features;
+    for (const auto& [feature_set, variants] : this->feature_variants) {
+        features.push_back(feature_set);
+    }
+    return features;
+}
 
-    // Create and build transparent pipeline
-    pipeline_builder.enable_blending_additive();
-    pipeline_builder.enable_depth_test(false, VK_COMPARE_OP_GREATER_OR_EQUAL);
-    pipeline_builder._pipeline_layout = transparent_layout;
-    this->transparent_pipeline.pipeline = pipeline_builder.build_pipeline(renderer->_device);
+void fmvk::GLTFMetallic_Roughness::link_variant(MaterialPipeline& variant, std::vector<VkPipeline> libraries)
+{
+    if (!this->fast_linking) {
+        // A second link gains nothing when linking is not fast to begin with
+        variant.pipeline = fmvk::PipelineBuilder::link_libraries(this->device, variant.layout, libraries, true);
+        return;
+    }
 
-    vkDestroyShaderModule(renderer->_device, pixel_shader, nullptr);
-    vkDestroyShaderModule(renderer->_device, vertex_shader, nullptr);
+    // Usable right away, the optimized link replaces it once it is done
+    variant.pipeline = fmvk::PipelineBuilder::link_libraries(this->device, variant.layout, libraries, false);
+    this->optimized_links.push_back({
+        .target = &variant,
+        .pipeline = std::async(std::launch::async, [device = this->device, layout = variant.layout, libraries = std::move(libraries)]() {
+            return fmvk::PipelineBuilder::link_libraries(device, layout, libraries, true);
+        })
+    });
 }
 
-void fmvk::GLTFMetallic_Roughness::clear_resources(VkDevice device)
+std::vector<VkPipeline> fmvk::GLTFMetallic_Roughness::swap_optimized_pipelines()
 {
-    vkDestroyDescriptorSetLayout(device, this->material_layout, nullptr);
-    vkDestroyPipelineLayout(device, this->opaque_pipeline.layout, nullptr);
-    vkDestroyPipeline(device, this->opaque_pipeline.pipeline, nullptr);
-    vkDestroyPipelineLayout(device, this->transparent_pipeline.layout, nullptr);
-    vkDestroyPipeline(device, this->transparent_pipeline.pipeline, nullptr);
+    std::vector<VkPipeline> replaced;
+    std::erase_if(this->optimized_links, [&replaced](OptimizedLink& link) {
+        if (link.pipeline.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+
+        VkPipeline optimized = link.pipeline.get();
+        if (optimized != VK_NULL_HANDLE) {
+            replaced.push_back(link.target->pipeline);
+            link.target->pipeline = optimized;
+        }
+        return true;
+    });
+    return replaced;
 }
 
-MaterialInstance fmvk::GLTFMetallic_Roughness::write_material(VkDevice device, MaterialPass pass, const MaterialResources &resources, DescriptorAllocatorGrowable &descriptor_allocators)
+void fmvk::GLTFMetallic_Roughness::clear_pipelines(VkDevice device)
+{
+    // Links still running in the background read the libraries and layouts
+    for (auto& link : this->optimized_links) {
+        vkDestroyPipeline(device, link.pipeline.get(), nullptr);
+    }
+    this->optimized_links.clear();
+
+    for (auto& [features, variants] : this->feature_variants) {
+        vkDestroyPipeline(device, variants.opaque.pipeline, nullptr);
+        vkDestroyPipeline(device, variants.transparent.pipeline, nullptr);
+        vkDestroyPipeline(device, variants.opaque_depth_equal.pipeline, nullptr);
+    }
+    this->feature_variants.clear();
+    vkDestroyPipelineLayout(device, this->mesh_layout, nullptr);
+    vkDestroyPipelineLayout(device, this->depth_prepass_pipeline.layout, nullptr);
+    vkDestroyPipeline(device, this->depth_prepass_pipeline.pipeline, nullptr);
+
+    for (VkPipeline library : this->pipeline_libraries) {
+        vkDestroyPipeline(device, library, nullptr);
+    }
+    this->pipeline_libraries.clear();
+
+    vkDestroyShaderModule(device, this->pixel_shader, nullptr);
+    vkDestroyShaderModule(device, this->vertex_shader, nullptr);
+
+    this->depth_prepass_pipeline = {};
+    this->mesh_layout = VK_NULL_HANDLE;
+    this->pixel_shader = VK_NULL_HANDLE;
+    this->vertex_shader = VK_NULL_HANDLE;
+    this->vertex_input_library = VK_NULL_HANDLE;
+    this->mesh_pre_rasterization_library = VK_NULL_HANDLE;
+    this->alphablend_output_library = VK_NULL_HANDLE;
+    this->additive_output_library = VK_NULL_HANDLE;
+}
+
+void fmvk::GLTFMetallic_Roughness::swap_pipelines(GLTFMetallic_Roughness& other)
+{
+    // Feature sets first used while the other one was being built
+    for (const auto& [features, variants] : this->feature_variants) {
+        other.get_variants(features);
+    }
+
+    // Pipelines are exchanged in place, material instances point to them
+    std::unordered_map<MaterialPipeline*, MaterialPipeline*> counterparts;
+    auto exchange = [&counterparts](MaterialPipeline& a, MaterialPipeline& b) {
+        std::swap(a, b);
+        counterparts[&a] = &b;
+        counterparts[&b] = &a;
+    };
+    exchange(this->depth_prepass_pipeline, other.depth_prepass_pipeline);
+    for (auto& [features, variants] : this->feature_variants) {
+        FeatureVariants& others = other.feature_variants[features];
+        exchange(variants.opaque, others.opaque);
+        exchange(variants.transparent, others.transparent);
+        exchange(variants.opaque_depth_equal, others.opaque_depth_equal);
+    }
+
+    std::swap(this->device, other.device);
+    std::swap(this->pipeline_library, other.pipeline_library);
+    std::swap(this->fast_linking, other.fast_linking);
+    std::swap(this->color_format, other.color_format);
+    std::swap(this->depth_format, other.depth_format);
+    std::swap(this->vertex_shader, other.vertex_shader);
+    std::swap(this->pixel_shader, other.pixel_shader);
+    std::swap(this->mesh_layout, other.mesh_layout);
+    std::swap(this->pipeline_libraries, other.pipeline_libraries);
+    std::swap(this->vertex_input_library, other.vertex_input_library);
+    std::swap(this->mesh_pre_rasterization_library, other.mesh_pre_rasterization_library);
+    std::swap(this->alphablend_output_library, other.alphablend_output_library);
+    std::swap(this->additive_output_library, other.additive_output_library);
+    std::swap(this->optimized_links, other.optimized_links);
+
+    // Pending optimized links follow the variants they were started for
+    for (auto* links : { &this->optimized_links, &other.optimized_links }) {
+        for (auto& link : *links) {
+            link.target = counterparts[link.target];
+        }
+    }
+}
+
+MaterialInstance fmvk::GLTFMetallic_Roughness::write_material(MaterialPass pass, uint32_t features, uint32_t material_index)
 {
     MaterialInstance data {};
     data.pass_type = pass;
+    data.material_index = material_index;
+    FeatureVariants& variants = get_variants(features);
     if (pass == MaterialPass::FM_MATERIAL_PASS_TRANSPARENT) {
-        data.pipeline = &this->transparent_pipeline;
+        data.pipeline = &variants.transparent;
+        data.depth_equal_pipeline = &variants.transparent;
+    } else if (pass == MaterialPass::FM_MATERIAL_PASS_OTHER) {
+        // Masked surfaces are not in the depth prepass, they test and write depth themselves
+        data.pipeline = &variants.opaque;
+        data.depth_equal_pipeline = &variants.opaque;
     } else {
-        data.pipeline = &this->opaque_pipeline;
+        data.pipeline = &variants.opaque;
+        data.depth_equal_pipeline = &variants.opaque_depth_equal;
     }
-    data.material_set = descriptor_allocators.allocate(device, this->material_layout);
-
-    this->writer.clear();
-    this->writer.write_buffer(
-        0,
-        resources.data_buffer,
-        sizeof(MaterialConstants),
-        resources.data_buffer_offset,
-        VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER
-    );
-    this->writer.write_image(
-        1,
-        resources.color_image.view,
-        resources.color_sampler,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
-    );
-    this->writer.write_image(
-        2,
-        resources.metal_roughness_image.view,
-        resources.metal_roughness_sampler,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
-    );
-    this->writer.write_image(
-        3,
-        resources.normal_image.view,
-        resources.normal_sampler,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
-    );
-    this->writer.write_image(
-        4,
-        resources.emissive_image.view,
-        resources.emissive_sampler,
-        VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER
-    );
-
-    this->writer.update_set(device, data.material_set);
     return data;
 }
 
@@ -0,0 +1,282 @@
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <string_view>
+#include <fmt/core.h>
+
+#include "vk_shader_compiler.hpp"
+
+
+namespace {
+    // FNV-1a, chained through the previous hash
+    uint64_t hash_bytes(std::string_view bytes, uint64_t hash = 0xcbf29ce484222325ull) {
+        for (unsigned char c : bytes) {
+            hash ^= c;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    bool read_file(const std::filesystem::path& path, std::string& out) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    bool write_file(const std::filesystem::path& path, std::string_view data) {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            return false;
+        }
+        file.write(data.data(), data.size());
+        return file.good();
+    }
+
+    void print_diagnostics(slang::IBlob* diagnostics) {
+        if (diagnostics != nullptr) {
+            fmt::println("{}", std::string_view((const char*) diagnostics->getBufferPointer(), diagnostics->getBufferSize()));
+        }
+    }
+
+    // Stage part of the spv file names, the renderer loads the shaders by these
+    const char* stage_name(SlangStage stage) {
+        switch (stage) {
+            case SLANG_STAGE_VERTEX: return "vertex";
+            case SLANG_STAGE_FRAGMENT: return "pixel";
+            case SLANG_STAGE_COMPUTE: return "compute";
+            default: return nullptr;
+        }
+    }
+}
+
+void fmvk::ShaderCompiler::init(const std::filesystem::path& source_dir, const std::filesystem::path& output_dir, const std::filesystem::path& cache_dir)
+{
+    this->source_dir = source_dir;
+    this->output_dir = output_dir;
+    this->cache_dir = cache_dir;
+
+    std::filesystem::create_directories(this->output_dir);
+    std::filesystem::create_directories(this->cache_dir);
+}
+
+void fmvk::ShaderCompiler::destroy()
+{
+    stop_watching();
+
+    std::scoped_lock lock(this->build_mutex);
+    this->global_sessions.clear();
+    this->modules.clear();
+}
+
+bool fmvk::ShaderCompiler::is_dirty(const std::string& module_name) const
+{
+    auto module = this->modules.find(module_name);
+    if (module == this->modules.end()) {
+        return true;
+    }
+
+    for (const auto& [path, write_time] : module->second.dependencies) {
+        std::error_code error;
+        if (std::filesystem::last_write_time(path, error) != write_time || error) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool fmvk::ShaderCompiler::build()
+{
+    std::scoped_lock lock(this->build_mutex);
+    auto start = std::chrono::system_clock::now();
+
+    std::vector<std::string> dirty;
+    for (const auto& entry : std::filesystem::directory_iterator(this->source_dir)) {
+        const std::string module_name = entry.path().stem().string();
+        if (entry.path().extension() == ".slang" && is_dirty(module_name)) {
+            dirty.push_back(module_name);
+        }
+    }
+    if (dirty.empty()) {
+        return false;
+    }
+
+    const size_t worker_count = std::min<size_t>(dirty.size(), std::max(1u, std::thread::hardware_concurrency()));
+    if (this->global_sessions.size() < worker_count) {
+        this->global_sessions.resize(worker_count);
+    }
+
+    std::vector<ModuleResult> results(dirty.size());
+    std::atomic<size_t> next_module = 0;
+    {
+        std::vector<std::jthread> workers;
+        for (size_t i = 0; i < worker_count; i++) {
+            workers.emplace_back([this, i, &dirty, &results, &next_module]() {
+                auto& global_session = this->global_sessions[i];
+                if (!global_session && SLANG_FAILED(slang::createGlobalSession(global_session.writeRef()))) {
+                    fmt::println("Failed to create a Slang global session");
+                    return;
+                }
+
+                for (size_t m = next_module++; m < dirty.size(); m = next_module++) {
+                    results[m] = build_module(global_session, dirty[m]);
+                }
+            });
+        }
+    }
+
+    bool outputs_changed = false;
+    for (auto& result : results) {
+        // Failed modules stay dirty and are tried again on the next build
+        if (result.compiled) {
+            this->modules[result.name] = std::move(result.state);
+        }
+        outputs_changed |= result.outputs_changed;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - start);
+    fmt::println("Built {} shader modules in {:.2f} ms", dirty.size(), elapsed.count() / 1000.0f);
+    return outputs_changed;
+}
+
+fmvk::ShaderCompiler::ModuleResult fmvk::ShaderCompiler::build_module(slang::IGlobalSession* global_session, const std::string& module_name) const
+{
+    ModuleResult result = { .name = module_name };
+
+    slang::TargetDesc target_desc {};
+    target_desc.format = SLANG_SPIRV;
+    target_desc.profile = global_session->findProfile("spirv_1_5");
+
+    const std::string search_path = this->source_dir.string();
+    const char* search_paths[] = { search_path.c_str() };
+
+    slang::SessionDesc session_desc {};
+    session_desc.targets = &target_desc;
+    session_desc.targetCount = 1;
+    session_desc.searchPaths = search_paths;
+    session_desc.searchPathCount = 1;
+
+    // Sessions keep the modules they have loaded, a fresh one sees the current sources
+    Slang::ComPtr<slang::ISession> session;
+    if (SLANG_FAILED(global_session->createSession(session_desc, session.writeRef()))) {
+        fmt::println("Failed to create a Slang session for {}", module_name);
+        return result;
+    }
+
+    Slang::ComPtr<slang::IBlob> diagnostics;
+    slang::IModule* module = session->loadModule(module_name.c_str(), diagnostics.writeRef());
+    print_diagnostics(diagnostics);
+    if (module == nullptr) {
+        return result;
+    }
+
+    // The module source and everything it imports go into the cache key
+    uint64_t source_hash = hash_bytes(global_session->getBuildTagString());
+    std::string contents;
+    for (SlangInt32 i = 0; i < module->getDependencyFileCount(); i++) {
+        const std::filesystem::path path = module->getDependencyFilePath(i);
+        std::error_code error;
+        const auto write_time = std::filesystem::last_write_time(path, error);
+        if (error || !read_file(path, contents)) {
+            fmt::println("Failed to read shader dependency {}", path.string());
+            return result;
+        }
+        result.state.dependencies[path.string()] = write_time;
+        source_hash = hash_bytes(path.string(), source_hash);
+        source_hash = hash_bytes(contents, source_hash);
+    }
+
+    bool failed = false;
+    for (SlangInt32 i = 0; i < module->getDefinedEntryPointCount(); i++) {
+        Slang::ComPtr<slang::IEntryPoint> entry_point;
+        module->getDefinedEntryPoint(i, entry_point.writeRef());
+
+        slang::IComponentType* components[] = { module, entry_point };
+        Slang::ComPtr<slang::IComponentType> program;
+        Slang::ComPtr<slang::IComponentType> linked;
+        session->createCompositeComponentType(components, 2, program.writeRef(), diagnostics.writeRef());
+        if (!program || SLANG_FAILED(program->link(linked.writeRef(), diagnostics.writeRef()))) {
+            print_diagnostics(diagnostics);
+            failed = true;
+            continue;
+        }
+
+        slang::EntryPointReflection* reflection = linked->getLayout()->getEntryPointByIndex(0);
+        const char* stage = stage_name(reflection->getStage());
+        if (stage == nullptr) {
+            fmt::println("Skipping {} in {}, unsupported stage", reflection->getName(), module_name);
+            continue;
+        }
+
+        const uint64_t hash = hash_bytes(stage, hash_bytes(reflection->getName(), source_hash));
+        const auto cache_path = this->cache_dir / fmt::format("{:016x}.spv", hash);
+        const auto output_path = this->output_dir / fmt::format("{}_{}.spv", module_name, stage);
+
+        // Code generation is the slow part, skipped whenever the same input was compiled before
+        std::string code;
+        if (!read_file(cache_path, code)) {
+            Slang::ComPtr<slang::IBlob> blob;
+            if (SLANG_FAILED(linked->getEntryPointCode(0, 0, blob.writeRef(), diagnostics.writeRef()))) {
+                print_diagnostics(diagnostics);
+                failed = true;
+                continue;
+            }
+            code.assign((const char*) blob->getBufferPointer(), blob->getBufferSize());
+            if (!write_file(cache_path, code)) {
+                fmt::println("Failed to write shader cache {}", cache_path.string());
+            }
+            fmt::println("Compiled {}", output_path.filename().string());
+        }
+
+        std::string current;
+        if (!read_file(output_path, current) || current != code) {
+            if (!write_file(output_path, code)) {
+                fmt::println("Failed to write {}", output_path.string());
+                failed = true;
+                continue;
+            }
+            result.outputs_changed = true;
+        }
+    }
+
+    result.compiled = !failed;
+    return result;
+}
+
+fmvk::ShaderCompiler::WriteTimes fmvk::ShaderCompiler::source_write_times() const
+{
+    WriteTimes write_times;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(this->source_dir, error)) {
+        if (entry.is_regular_file(error)) {
+            write_times[entry.path().string()] = entry.last_write_time(error);
+        }
+    }
+    return write_times;
+}
+
+void fmvk::ShaderCompiler::start_watching(std::chrono::milliseconds interval)
+{
+    stop_watching();
+    this->watcher = std::jthread([this, interval](std::stop_token stop) {
+        WriteTimes known = source_write_times();
+        while (!stop.stop_requested()) {
+            std::this_thread::sleep_for(interval);
+            WriteTimes current = source_write_times();
+            if (current != known) {
+                known = std::move(current);
+                this->changed = true;
+            }
+        }
+    });
+}
+
+void fmvk::ShaderCompiler::stop_watching()
+{
+    if (this->watcher.joinable()) {
+        this->watcher.request_stop();
+        this->watcher.join();
+    }
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <algorithm>
+#include <vector>
+#include <cstdint>
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <unordered_map>
@@ -15,12 +18,100 @@ struct Transform {
     glm::vec3 scale = { 1.0f, 1.0f, 1.0f};
 };
 
-struct Mesh {
-    std::string mesh_file;
-    MeshID mesh_id {0};
+// Same matrix as translate * mat4_cast(rotation) * scale, built from the rotation columns directly
+inline glm::mat4 compose_transform(const Transform& transform) {
+    const glm::mat3 rotation = glm::mat3_cast(transform.rotation);
+    return glm::mat4 {
+        glm::vec4 { rotation[0] * transform.scale.x, 0.0f },
+        glm::vec4 { rotation[1] * transform.scale.y, 0.0f },
+        glm::vec4 { rotation[2] * transform.scale.z, 0.0f },
+        glm::vec4 { transform.position, 1.0f }
+    };
+}
+
+// Transforms split into one array per component, so compose() works on four of them at a time.
+// Every lane of a vec4 is a different transform, the same math as compose_transform()
+struct TransformBatch {
+    std::vector<glm::vec4> position[3];
+    std::vector<glm::vec4> rotation[4];  // x, y, z, w
+    std::vector<glm::vec4> scale[3];
+    size_t count = 0;
+
+    void clear() {
+        for (auto& lanes : this->position) lanes.clear();
+        for (auto& lanes : this->rotation) lanes.clear();
+        for (auto& lanes : this->scale) lanes.clear();
+        this->count = 0;
+    }
+
+    void push(const Transform& transform) {
+        const size_t lane = this->count % 4;
+        if (lane == 0) {
+            // The unused lanes of the last group stay an identity transform
+            for (auto& lanes : this->position) lanes.push_back(glm::vec4 { 0.0f });
+            for (auto& lanes : this->rotation) lanes.push_back(glm::vec4 { 0.0f });
+            for (auto& lanes : this->scale) lanes.push_back(glm::vec4 { 1.0f });
+            this->rotation[3].back() = glm::vec4 { 1.0f };
+        }
+        const size_t group = this->count / 4;
+        for (int i = 0; i < 3; i++) {
+            this->position[i][group][lane] = transform.position[i];
+            this->scale[i][group][lane] = transform.scale[i];
+        }
+        this->rotation[0][group][lane] = transform.rotation.x;
+        this->rotation[1][group][lane] = transform.rotation.y;
+        this->rotation[2][group][lane] = transform.rotation.z;
+        this->rotation[3][group][lane] = transform.rotation.w;
+        this->count++;
+    }
+
+    // Writes count matrices to out
+    void compose(glm::mat4* out) const {
+        for (size_t group = 0; group * 4 < this->count; group++) {
+            const glm::vec4 x = this->rotation[0][group];
+            const glm::vec4 y = this->rotation[1][group];
+            const glm::vec4 z = this->rotation[2][group];
+            const glm::vec4 w = this->rotation[3][group];
+
+            const glm::vec4 xx = x * x, yy = y * y, zz = z * z;
+            const glm::vec4 xy = x * y, xz = x * z, yz = y * z;
+            const glm::vec4 wx = w * x, wy = w * y, wz = w * z;
+
+            const glm::vec4 sx = this->scale[0][group] * 2.0f;
+            const glm::vec4 sy = this->scale[1][group] * 2.0f;
+            const glm::vec4 sz = this->scale[2][group] * 2.0f;
+
+            // Rotation columns times the scale, the 2 of the quaternion terms is folded into it
+            const glm::vec4 m00 = this->scale[0][group] - sx * (yy + zz);
+            const glm::vec4 m01 = sx * (xy + wz);
+            const glm::vec4 m02 = sx * (xz - wy);
+            const glm::vec4 m10 = sy * (xy - wz);
+            const glm::vec4 m11 = this->scale[1][group] - sy * (xx + zz);
+            const glm::vec4 m12 = sy * (yz + wx);
+            const glm::vec4 m20 = sz * (xz + wy);
+            const glm::vec4 m21 = sz * (yz - wx);
+            const glm::vec4 m22 = this->scale[2][group] - sz * (xx + yy);
+
+            const glm::vec4& px = this->position[0][group];
+            const glm::vec4& py = this->position[1][group];
+            const glm::vec4& pz = this->position[2][group];
+
+            const size_t lanes = std::min<size_t>(4, this->count - group * 4);
+            for (size_t lane = 0; lane < lanes; lane++) {
+                out[group * 4 + lane] = glm::mat4 {
+                    glm::vec4 { m00[lane], m01[lane], m02[lane], 0.0f },
+                    glm::vec4 { m10[lane], m11[lane], m12[lane], 0.0f },
+                    glm::vec4 { m20[lane], m21[lane], m22[lane], 0.0f },
+                    glm::vec4 { px[lane], py[lane], pz[lane], 1.0f }
+                };
+            }
+        }
+    }
+};
 
-    Mesh() {}
-    Mesh(const char* file) { this->mesh_file = file; }
+struct MeshRef {
+    MeshID mesh_id {0};
+    InstanceID instance_id {0};  // Placed in the renderer
 };
 
 struct Light {
@@ -32,43 +123,86 @@ struct Light {
     glm::vec3 light_color {0.0f, 0.0f, 0.0f};
 };
 
-struct GameSceneObject {
-    std::string mesh_file;
-    std::string name;
-    MeshID mesh_id {0};
-    Transform transform;
-
-    bool is_light = false;
-
-    LightID light_id {0};
-    LightType light_type = LightType::None;
-    float light_intensity = 0.0f;
-    float light_range = 0.0f;
-    glm::vec3 light_direction {0.0f, 0.0f, 0.0f};
-    glm::vec3 light_color {0.0f, 0.0f, 0.0f};
-
-    bool dirty = true;
-
-    GameSceneObject() {};
-    GameSceneObject(const char* id) { this->name = id; };
+// Index of an entity in the scene's per entity arrays
+struct Entity {
+    operator bool() const noexcept { return id != UINT32_MAX; }
+    uint32_t id = UINT32_MAX;
+};
 
-    int get_id(const char* name, const int scene_id, sqlite3* db);
-    int load(const char* name, const int scene_id, sqlite3* db);
-    int save(const int scene_id, sqlite3* db);
+// Components of one type packed densely, together with the entity each one belongs to
+template <typename T>
+struct ComponentArray {
+    std::vector<T> components;
+    std::vector<Entity> entities;
+    std::vector<uint32_t> slots;  // By entity, UINT32_MAX for the ones without the component
+
+    T& add(Entity entity, const T& component) {
+        if (entity.id >= this->slots.size()) {
+            this->slots.resize(entity.id + 1, UINT32_MAX);
+        }
+        if (this->slots[entity.id] != UINT32_MAX) {
+            return this->components[this->slots[entity.id]] = component;
+        }
+        this->slots[entity.id] = this->components.size();
+        this->entities.push_back(entity);
+        return this->components.emplace_back(component);
+    }
+
+    bool has(Entity entity) const {
+        return entity.id < this->slots.size() && this->slots[entity.id] != UINT32_MAX;
+    }
+
+    T& get(Entity entity) { return this->components[this->slots[entity.id]]; }
+    const T& get(Entity entity) const { return this->components[this->slots[entity.id]]; }
 };
 
+// Names and asset paths, only used for tooling and loading
+struct EntityInfo {
+    std::string name;
+    std::string mesh_file;
+};
 
+// Entities of a scene. Every entity has a transform, meshes and lights are packed in their own
+// arrays, and the changed entities are listed so the renderer only gets those.
 struct GameScene {
     std::string id;
     std::string name;
-    std::unordered_map<std::string, GameSceneObject> objects;
+
+    std::vector<Transform> transforms;  // By entity
+    ComponentArray<MeshRef> meshes;
+    ComponentArray<Light> lights;
+
+    std::vector<uint8_t> dirty;  // By entity
+    std::vector<Entity> dirty_entities;
+
+    std::vector<EntityInfo> info;  // By entity
+    std::unordered_map<std::string, Entity> names;
 
     GameScene() {};
     GameScene(const char* id) { this->name = id; };
 
     void Update();
 
-    void add_object(GameSceneObject obj, const char* id) { this->objects[id] = obj ;}
+    Entity create_entity(const std::string& name, const Transform& transform = {});
+    Entity find(const std::string& name) const;
+
+    void add_mesh(Entity entity, const std::string& mesh_file);
+    void add_light(Entity entity, const Light& light);
+
+    void set_transform(Entity entity, const Transform& transform) {
+        this->transforms[entity.id] = transform;
+        mark_dirty(entity);
+    }
+
+    void mark_dirty(Entity entity) {
+        if (!this->dirty[entity.id]) {
+            this->dirty[entity.id] = 1;
+            this->dirty_entities.push_back(entity);
+        }
+    }
+
+    uint32_t entity_count() const { return this->transforms.size(); }
+
     void load(const char* name, sqlite3* db);
     void save(sqlite3* db);
 };
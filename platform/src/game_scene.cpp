@@ -92,124 +92,91 @@ void GameScene::load(const char* scene_name, sqlite3* db) {
     }
 
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-        GameSceneObject obj;
         // int obj_id = sqlite3_column_int(stmt, 0);
         auto asd = sqlite3_column_text(stmt, 1);
-        obj.name = std::string(reinterpret_cast<const char*>(asd));
+        auto obj_name = std::string(reinterpret_cast<const char*>(asd));
         int mesh_id = sqlite3_column_int(stmt, 2);
         int light_id = sqlite3_column_int(stmt, 3);
 
-        obj.transform.position.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4)));
-        obj.transform.position.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)));
-        obj.transform.position.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6)));
+        Transform transform;
+        transform.position.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4)));
+        transform.position.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)));
+        transform.position.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6)));
 
-        obj.transform.rotation.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 7)));
-        obj.transform.rotation.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 8)));
-        obj.transform.rotation.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 9)));
-        obj.transform.rotation.w = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 10)));
+        transform.rotation.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 7)));
+        transform.rotation.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 8)));
+        transform.rotation.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 9)));
+        transform.rotation.w = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 10)));
 
-        obj.transform.scale.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 11)));
-        obj.transform.scale.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 12)));
-        obj.transform.scale.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 13)));
+        transform.scale.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 11)));
+        transform.scale.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 12)));
+        transform.scale.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 13)));
+
+        Entity entity = create_entity(obj_name, transform);
 
         if (mesh_id) {
             auto mesh = sqlite3_column_text(stmt, 14);
-            obj.mesh_file = std::string(reinterpret_cast<const char*>(mesh));
+            add_mesh(entity, std::string(reinterpret_cast<const char*>(mesh)));
         }
 
         if(light_id) {
+            Light light;
+
             // This could be a int cast to enum, but meh
             auto light_type = std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 15)));
-            if (light_type ==  "area") obj.light_type = LightType::Area;
-            else if (light_type == "point") obj.light_type = LightType::Point;
-            else if (light_type == "spot") obj.light_type = LightType::Spot;
+            if (light_type ==  "area") light.light_type = LightType::Area;
+            else if (light_type == "point") light.light_type = LightType::Point;
+            else if (light_type == "spot") light.light_type = LightType::Spot;
 
-            obj.light_intensity = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 16)));
-            obj.light_range = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 17)));
+            light.light_intensity = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 16)));
+            light.light_range = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 17)));
 
-            obj.light_color.r = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 18)));
-            obj.light_color.g = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 19)));
-            obj.light_color.b = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 20)));
+            light.light_color.r = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 18)));
+            light.light_color.g = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 19)));
+            light.light_color.b = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 20)));
 
-            obj.light_direction.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 21)));
-            obj.light_direction.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 22)));
-            obj.light_direction.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 23)));
-            obj.is_light = true;
+            light.light_direction.x = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 21)));
+            light.light_direction.y = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 22)));
+            light.light_direction.z = atof(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 23)));
+            add_light(entity, light);
         }
-
-        this->objects[obj.name] = obj;
     }
     sqlite3_finalize(stmt);
 }
 
-int GameSceneObject::get_id(const char* name, const int scene_id, sqlite3* db) {
-    sqlite3_stmt* stmt;
-    auto exists_q = fmt::format(
-        "SELECT id FROM scene_objects WHERE name=? AND scene_id=?",
-        this->name, scene_id);
-    int rc = sqlite3_prepare_v2(db, exists_q.c_str(), -1, &stmt, 0);
-    if (rc != SQLITE_OK) {
-        fmt::println("SQL Error: {}", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return 0;
-    }
-
-    // Bind the name to ? in the query
-    rc = sqlite3_bind_text(stmt, 1, this->name.c_str(), strlen(this->name.c_str()), SQLITE_STATIC);
-    if (rc != SQLITE_OK) {
-        fmt::println("SQL Error: {}", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return 0;
-    }
-
-    // Bind the scene_id to second ? in the query
-    rc = sqlite3_bind_int(stmt, 2, scene_id);
-    if (rc != SQLITE_OK) {
-        fmt::println("SQL Error: {}", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return 0;
-    }
-
-    rc = sqlite3_step(stmt);
-    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
-        fmt::println("SQL Error: {}", sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        return 0;
-    }
+Entity GameScene::create_entity(const std::string& name, const Transform& transform)
+{
+    Entity entity { (uint32_t) this->transforms.size() };
+    this->transforms.push_back(transform);
+    this->info.push_back({ .name = name });
+    this->names[name] = entity;
+
+    // New entities have to reach the renderer
+    this->dirty.push_back(0);
+    mark_dirty(entity);
+    return entity;
+}
 
-    if (rc == SQLITE_DONE) {
-        fmt::println("SQL: scene_object not found ({})", name);
-        sqlite3_finalize(stmt);
-        return 0;
+Entity GameScene::find(const std::string& name) const
+{
+    auto entity = this->names.find(name);
+    if (entity == this->names.end()) {
+        return {};
     }
-
-
-    int scene_object_id = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-
-    return scene_object_id;
+    return entity->second;
 }
 
-int GameSceneObject::save(const int scene_id, sqlite3* db) {
-    char* errmsg = 0;
-    auto t = this->transform;
-    auto oq = fmt::format(
-        "INSERT INTO scene_objects " \
-        "(name, scene_id, pos_x, pos_y, pos_z, rot_x, rot_y, rot_z, rot_w, scale_x, scale_y, scale_z) " \
-        "VALUES ('{}', {}, {}, {}, {}, {}, {}, {}, {}, {}, {}, {});"
-        , this->name, scene_id, t.position.x, t.position.y, t.position.z
-        , t.rotation.x, t.rotation.y, t.rotation.z, t.rotation.w
-        , t.scale.x, t.scale.y, t.scale.z);
-
-    int rc = sqlite3_exec(db, oq.c_str(), callback, 0, &errmsg);
-    if (rc != SQLITE_OK) {
-        fmt::println("SQL Error (scene_objects): {}", errmsg);
-        fmt::println("{}", oq);
-        sqlite3_free(errmsg);
-    }
+void GameScene::add_mesh(Entity entity, const std::string& mesh_file)
+{
+    this->info[entity.id].mesh_file = mesh_file;
+    this->meshes.add(entity, MeshRef {});
+    mark_dirty(entity);
+}
 
-    auto new_id = sqlite3_last_insert_rowid(db);
-    return new_id;
+void GameScene::add_light(Entity entity, const Light& light)
+{
+    this->lights.add(entity, light);
+    mark_dirty(entity);
 }
 
 void GameScene::save(sqlite3* db) {
@@ -226,8 +193,10 @@ void GameScene::save(sqlite3* db) {
     auto s_id = sqlite3_last_insert_rowid(db);
     fmt::println("{}", s_id);
 
-    for(auto [n, o] : this->objects) {
-        auto t = o.transform;
+    for (uint32_t i = 0; i < entity_count(); i++) {
+        const Entity entity { i };
+        const EntityInfo& o = this->info[i];
+        auto t = this->transforms[i];
         auto oq = fmt::format(
             "INSERT INTO scene_objects " \
             "(name, scene_id, pos_x, pos_y, pos_z, rot_x, rot_y, rot_z, rot_w, scale_x, scale_y, scale_z) " \
@@ -264,21 +233,22 @@ void GameScene::save(sqlite3* db) {
         }
 
         // Save and connect light stuffs if the object is a light
-        if (o.light_type) {
+        if (this->lights.has(entity)) {
+            const Light& light = this->lights.get(entity);
             std::string light_type_s;
-            switch (o.light_type) {
-                case LightType::Area: light_type_s = "area";
-                case LightType::Point: light_type_s = "point";
-                case LightType::Spot: light_type_s = "spot";
+            switch (light.light_type) {
+                case LightType::Area: light_type_s = "area"; break;
+                case LightType::Point: light_type_s = "point"; break;
+                case LightType::Spot: light_type_s = "spot"; break;
                 default: break;
             }
             auto lq = fmt::format(
                 "INSERT INTO scene_lights " \
                 "(light_type, intensity, radius, color_r, color_g, color_b, dir_x, dir_y, dir_z) " \
                 "VALUES ('{}', {}, {}, {}, {}, {}, {}, {}, {});"
-                , light_type_s, o.light_intensity, o.light_range
-                , o.light_color.r, o.light_color.g, o.light_color.b
-                , o.light_direction.x, o.light_direction.y, o.light_direction.z);
+                , light_type_s, light.light_intensity, light.light_range
+                , light.light_color.r, light.light_color.g, light.light_color.b
+                , light.light_direction.x, light.light_direction.y, light.light_direction.z);
             rc = sqlite3_exec(db, lq.c_str(), 0, 0, &errmsg);
             if (rc != SQLITE_OK) {
                 fmt::println("SQL Error (scene_lights): {}", errmsg);
@@ -12,7 +12,6 @@
 
 #include "SDL3/SDL_keycode.h"
 #include "fmt/base.h"
-#include "python_embed.h"
 #include "firemountain.hpp"
 #include "game_scene.hpp"
 #include "display.hpp"
@@ -43,6 +42,7 @@ int RunApp()
     SDL_Init(SDL_INIT_VIDEO);
     display.Init(WIDTH, HEIGHT);
     firemountain.Init(WIDTH, HEIGHT, display.window);
+    firemountain.WatchShaders(FM_SHADER_SOURCE_DIR);
 
     if (sqlite3_open("gamedata.db", &DB)) {
         fmt::println("* DB: {}", sqlite3_errmsg(DB));
@@ -64,20 +64,26 @@ int RunApp()
 
     // game_scene.load("Sponza", DB);
     for (auto scene : scenes) {
-        for (auto& [key, obj] : scene->scene.objects) {
-            if (obj.light_type != LightType::None) {
-                obj.light_id = firemountain.AddLight(key);
-            } else {
-                obj.mesh_id = firemountain.AddMesh(key, obj.mesh_file.c_str());
-            }
+        GameScene& game_scene = scene->scene;
+        for (size_t i = 0; i < game_scene.meshes.components.size(); i++) {
+            const EntityInfo& info = game_scene.info[game_scene.meshes.entities[i].id];
+            game_scene.meshes.components[i].mesh_id = firemountain.AddMesh(info.name, info.mesh_file.c_str());
+        }
+        for (size_t i = 0; i < game_scene.lights.components.size(); i++) {
+            const EntityInfo& info = game_scene.info[game_scene.lights.entities[i].id];
+            game_scene.lights.components[i].light_id = firemountain.AddLight(info.name);
         }
     }
     // game_scene.save(DB);
 
+    // Assets are in, from here on the renderer draws a frame while the next one is simulated
+    firemountain.StartRenderThread();
+
     float tick = 0;
     bool running = true;
     bool resize_requested = false;
     bool shader_reload_requested = false;
+    bool depth_prepass = false;
     SDL_Event event = {};
 
     camera.position = glm::vec3(3.0f, 1.0f, 0.0f);
@@ -139,11 +145,19 @@ int RunApp()
                     }
                 }
                 if (event.key.key == SDLK_L) { camera_pov_lock = !camera_pov_lock; }
+                if (event.key.key == SDLK_P) {
+                    depth_prepass = !depth_prepass;
+                    firemountain.SetDepthPrepass(depth_prepass);
+                }
                 if (event.key.key == SDLK_F9) {
                     if (scene_idx == 0) scene_idx = 1;
                     else scene_idx = 0;
 
                     active_scene = scenes[scene_idx];
+
+                    // The renderer keeps the scene between frames, the new one is sent in full
+                    firemountain.ClearScene();
+                    active_scene->MarkDirty();
                 }
                 break;
 
@@ -193,13 +207,12 @@ int RunApp()
         }
 
         if (shader_reload_requested) {
-            py_build_shaders("shaders", "shaders/bin");
             firemountain.CompileShaders();
             shader_reload_requested = false;
         }
 
         active_scene->Update(tick);
-        auto render_scene = active_scene->GetRenderScene();
+        active_scene->Submit(firemountain);
 
         camera.yaw += static_cast<float>(mouse_yaw_acc) * CAMERA_H_SPEED / 100.0f;
         camera.pitch -= static_cast<float>(mouse_pitch_acc) * CAMERA_V_SPEED / 100.0f;
@@ -215,7 +228,7 @@ int RunApp()
             ),
             .debug_pov_lock = camera_pov_lock
         };
-        firemountain.Frame(&render_camera, render_scene);
+        firemountain.Frame(&render_camera);
     }
 
     SDL_SetWindowMouseGrab(display.window, false);  // Release mouse before the exit
@@ -7,105 +7,63 @@ public:
     void Init() {
         this->scene = GameScene("sponza");
 
-        auto sponz = GameSceneObject("sponza");
-        sponz.mesh_file = "assets/Sponza/glTF/Sponza.gltf";
-        this->scene.add_object(sponz, "sponza");
+        auto sponza = this->scene.create_entity("sponza");
+        this->scene.add_mesh(sponza, "assets/Sponza/glTF/Sponza.gltf");
 
-        auto froge = GameSceneObject("froge");
-        froge.mesh_file = "assets/good_froge.glb";
-        froge.name = "Good Froge";
-        froge.transform = (Transform) {
+        this->froge = this->scene.create_entity("froge", Transform {
             .position = {0.1f, 0.5f, -0.2f}
-        };
-        this->scene.add_object(froge, "froge");
+        });
+        this->scene.add_mesh(this->froge, "assets/good_froge.glb");
 
-        auto cube = GameSceneObject("cube");
-        cube.mesh_file = "assets/cube_1m.glb";
-        cube.name = "Cube";
-        cube.transform = (Transform) {
+        this->cube = this->scene.create_entity("cube", Transform {
             .position = {0.0f, 5.0f, -0.2f}
-        };
-        this->scene.add_object(cube, "cube");
-
-        auto sun_light = GameSceneObject("Sun");
-        sun_light.name = "Sun";
-        sun_light.light_type = LightType::Area;
-        sun_light.light_intensity = 1.8f;
-        sun_light.light_range = 100.0f;
-        sun_light.light_direction = { 0.0f, -1.0f, -0.5f };
-        sun_light.light_color = { 0.8f, 0.4f, 0.2f };
-        this->scene.add_object(sun_light, "Sun");
+        });
+        this->scene.add_mesh(this->cube, "assets/cube_1m.glb");
 
-        auto mid_light = GameSceneObject("LightMid");
-        mid_light.name = "Light Mid";
-        mid_light.transform = (Transform) {
-            .position = { 0.0f, 3.0f, 0.0f }
-        };
-        mid_light.light_type = LightType::Point;
-        mid_light.light_intensity = 8.0f;
-        mid_light.light_range = 100.0f;
-        mid_light.light_color = { 0.8f, 0.4f, 0.2f };
-        this->scene.add_object(mid_light, "LightMid");
-
-        auto blue_light = GameSceneObject("LightTorchBlue");
-        blue_light.name = "Torch (blue)";
-        blue_light.transform = (Transform) {
-            .position = { 8.8f, 1.5f, 3.2f }
-        };
-        blue_light.light_type = LightType::Point;
-        blue_light.light_intensity = 8.0f;
-        blue_light.light_range = 100.0f;
-        blue_light.light_color = { 0.2f, 0.4f, 0.8f };
-        this->scene.add_object(blue_light, "LightTorchBlue");
+        auto sun_light = this->scene.create_entity("Sun");
+        this->scene.add_light(sun_light, Light {
+            .light_type = LightType::Area,
+            .light_intensity = 1.8f,
+            .light_range = 100.0f,
+            .light_direction = { 0.0f, -1.0f, -0.5f },
+            .light_color = { 0.8f, 0.4f, 0.2f }
+        });
 
-        auto green_light = GameSceneObject("LightTorchGreen");
-        green_light.name = "Torch (green)";
-        green_light.transform = (Transform) {
-            .position = { 9.0f, 1.5f, -3.6f }
+        auto add_point_light = [&](const char* name, glm::vec3 position, float intensity, glm::vec3 color) {
+            auto light = this->scene.create_entity(name, Transform { .position = position });
+            this->scene.add_light(light, Light {
+                .light_type = LightType::Point,
+                .light_intensity = intensity,
+                .light_range = 100.0f,
+                .light_color = color
+            });
         };
-        green_light.light_type = LightType::Point;
-        green_light.light_intensity = 8.0f;
-        green_light.light_range = 100.0f;
-        green_light.light_color = { 0.2f, 0.8f, 0.4f };
-        this->scene.add_object(green_light, "LightTorchGreen");
-
-        auto red_light = GameSceneObject("LightTorchRed");
-        red_light.name = "Torch (red)";
-        red_light.transform = (Transform) {
-            .position = { -9.5f, 1.5f, -3.65f }
-        };
-        red_light.light_type = LightType::Point;
-        red_light.light_intensity = 8.0f;
-        red_light.light_range = 100.0f;
-        red_light.light_color = { 0.8f, 0.2f, 0.1f };
-        this->scene.add_object(red_light, "LightTorchRed");
-
-        auto purp_light = GameSceneObject("LightTorchPurple");
-        purp_light.name = "Torch (purple)";
-        purp_light.transform = (Transform) {
-            .position = { -9.5f, 1.5f, 3.2f }
-        };
-        purp_light.light_type = LightType::Point;
-        purp_light.light_intensity = 8.0f;
-        purp_light.light_range = 100.0f;
-        purp_light.light_color = { 0.8f, 0.2f, 0.8f };
-        this->scene.add_object(purp_light, "LightTorchPurple");
+        add_point_light("LightMid", { 0.0f, 3.0f, 0.0f }, 8.0f, { 0.8f, 0.4f, 0.2f });
+        add_point_light("LightTorchBlue", { 8.8f, 1.5f, 3.2f }, 8.0f, { 0.2f, 0.4f, 0.8f });
+        add_point_light("LightTorchGreen", { 9.0f, 1.5f, -3.6f }, 8.0f, { 0.2f, 0.8f, 0.4f });
+        add_point_light("LightTorchRed", { -9.5f, 1.5f, -3.65f }, 8.0f, { 0.8f, 0.2f, 0.1f });
+        add_point_light("LightTorchPurple", { -9.5f, 1.5f, 3.2f }, 8.0f, { 0.8f, 0.2f, 0.8f });
     }
 
     void Update(int tick) {
         // Rotate and bob the froge
-        this->scene.objects["froge"].transform.position.y += 0.0025f * sin(0.02f * tick);
-        this->scene.objects["froge"].transform.rotation = glm::angleAxis(
+        Transform& froge_transform = this->scene.transforms[this->froge.id];
+        froge_transform.position.y += 0.0025f * sin(0.02f * tick);
+        froge_transform.rotation = glm::angleAxis(
             glm::radians(0.5f * tick),              // Rotation speed
             glm::normalize(glm::vec3(0, 1, 0))     // Rotate along Y-axis
         );
-        this->scene.objects["froge"].dirty = true;
+        this->scene.mark_dirty(this->froge);
 
         // Rotate cube
-        this->scene.objects["cube"].transform.rotation = glm::angleAxis(
+        this->scene.transforms[this->cube.id].rotation = glm::angleAxis(
             glm::radians(0.4f * tick),
             glm::normalize(glm::vec3(-0.8, 0.1, -0.4))
         );
-        this->scene.objects["cube"].dirty = true;
+        this->scene.mark_dirty(this->cube);
     }
+
+private:
+    Entity froge;
+    Entity cube;
 };
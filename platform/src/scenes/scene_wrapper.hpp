@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include "game_scene.hpp"
 #include "vk_types.hpp"
 
@@ -10,37 +11,60 @@ public:
 
     GameScene scene;
 
-    std::vector<RenderSceneObj> GetRenderScene() {
-        std::vector<RenderSceneObj> render_scene;
-
-        // Send meshes with updated transforms to renderer
-        for (auto& [key, obj] : this->scene.objects) {
-            // Push meshes
-
-            // TODO:
-            // This should probably just be done in shaders or a comp shader while rendering.
-            // Just send the transform stuff to renderer.
-            if (obj.mesh_id) {
-                const auto m = glm::translate(glm::identity<glm::mat4>(), obj.transform.position)
-                    * glm::mat4_cast(obj.transform.rotation)
-                    * glm::scale(glm::identity<glm::mat4>(), obj.transform.scale);
-                render_scene.push_back({
-                    .mesh_id = obj.mesh_id,
-                    .transform = m
-                });
+    // Send everything again, e.g. after the renderer's scene was cleared
+    void MarkDirty() {
+        for (auto& mesh : this->scene.meshes.components) {
+            mesh.instance_id = {0};
+        }
+        for (uint32_t i = 0; i < this->scene.entity_count(); i++) {
+            this->scene.mark_dirty({ i });
+        }
+    }
+
+    // Send the changed meshes and lights to renderer, it keeps the rest from earlier frames.
+    // Entities that didn't change since the last call cost nothing here
+    void Submit(Firemountain& firemountain) {
+        this->moved_instances.clear();
+        this->moved_batch.clear();
+
+        // In entity order, so the component arrays are walked front to back
+        auto& dirty_entities = this->scene.dirty_entities;
+        std::sort(dirty_entities.begin(), dirty_entities.end(), [](Entity a, Entity b) { return a.id < b.id; });
+
+        for (Entity entity : dirty_entities) {
+            const Transform& transform = this->scene.transforms[entity.id];
+
+            if (this->scene.meshes.has(entity)) {
+                MeshRef& mesh = this->scene.meshes.get(entity);
+                if (!mesh.instance_id) {
+                    mesh.instance_id = firemountain.CreateInstance(mesh.mesh_id, compose_transform(transform));
+                } else {
+                    this->moved_instances.push_back(mesh.instance_id);
+                    this->moved_batch.push(transform);
+                }
             }
 
-            // Push lights
-            if (obj.light_id)  {
-                render_scene.push_back({
-                    .light_id = obj.light_id,
-                    .light_position_type = { obj.transform.position, obj.light_type },
-                    .light_color_intensity = { obj.light_color, obj.light_intensity },
-                    .light_direction_range = { obj.light_direction, obj.light_range}
+            if (this->scene.lights.has(entity)) {
+                const Light& light = this->scene.lights.get(entity);
+                firemountain.SetLight(light.light_id, GPULightData {
+                    .positionType = { transform.position, light.light_type },
+                    .colorIntensity = { light.light_color, light.light_intensity },
+                    .directionRange = { light.light_direction, light.light_range }
                 });
             }
-            obj.dirty = false;
+            this->scene.dirty[entity.id] = 0;
         }
-        return render_scene;
+        dirty_entities.clear();
+
+        // Composed four at a time from the gathered transforms
+        this->moved_transforms.resize(this->moved_batch.count);
+        this->moved_batch.compose(this->moved_transforms.data());
+        firemountain.SetTransforms(this->moved_instances, this->moved_transforms);
     };
+
+private:
+    // Batch of the frame's moved instances, kept so it's not reallocated every frame
+    std::vector<InstanceID> moved_instances;
+    TransformBatch moved_batch;
+    std::vector<glm::mat4> moved_transforms;
 };